@@ -5,6 +5,22 @@
 
 BOOL Bench_Open(__in PUVPERF_PARAM TestParams);
 
+BOOL Bench_IsBenchPipe(__in PUVPERF_PARAM TestParams, __in PWINUSB_PIPE_INFORMATION_EX pipeInfo);
+
+BOOL Bench_OpenAssociatedInterfaces(__in PUVPERF_PARAM TestParams);
+
+void Bench_CloseAssociatedInterfaces(__in PUVPERF_PARAM TestParams);
+
+PUVPERF_ASSOCIATED_INTERFACE Bench_FindAssociatedPipe(__in PUVPERF_PARAM TestParams,
+                                                      __in int endpointID, __out UCHAR *pipeIndex);
+
+int Bench_SelectAllPipes(__in PUVPERF_PARAM TestParams);
+
+
+void Bench_VendorSetupPacket(__out WINUSB_SETUP_PACKET *Pkt, __in BOOL isIn, __in UCHAR request,
+                             __in USHORT value, __in USHORT index, __in USHORT length);
+
+BOOL Bench_SetEndpointHalt(__in KUSB_HANDLE handle, __in UCHAR pipeId);
 
 BOOL Bench_Configure(__in KUSB_HANDLE handle, __in UVPERF_DEVICE_COMMAND command, __in UCHAR intf,
                      __inout PUVPERF_DEVICE_TRANSFER_TYPE testType);
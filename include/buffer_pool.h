@@ -0,0 +1,11 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "setting.h"
+
+int CreateBufferPool(PUVPERF_BUFFER_POOL bufferPool, int bufferSize, int bufferCount,
+                     BOOL useLargePages);
+
+void FreeBufferPool(PUVPERF_BUFFER_POOL bufferPool);
+
+#endif // BUFFER_POOL_H
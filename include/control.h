@@ -0,0 +1,14 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include "setting.h"
+
+#define CONTROL_DEFAULT_COUNT 10000 // transactions when neither c=COUNT nor -T is given
+#define CONTROL_MAX_DEPTH 64
+#define CONTROL_MAX_LENGTH 4096
+
+int ParseControlSpec(PUVPERF_PARAM TestParams, const char *spec);
+
+int RunControlBench(PUVPERF_PARAM TestParams);
+
+#endif // CONTROL_H
@@ -0,0 +1,16 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "setting.h"
+
+#define ENGINE_WAIT_MS 100
+
+DWORD EngineThread(PUVPERF_PARAM TestParams);
+
+void StartCpuUsage(PUVPERF_PARAM TestParams);
+
+DOUBLE GetCpuSeconds(PUVPERF_PARAM TestParams);
+
+void ShowCpuUsage(PUVPERF_PARAM TestParams);
+
+#endif // ENGINE_H
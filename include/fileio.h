@@ -4,8 +4,12 @@
 #include "param.h"
 
 void FileIOOpen(PUVPERF_PARAM TestParams);
+FILE *FileIOOpenEndpointFile(PUVPERF_TRANSFER_PARAM transferParam, const char *name,
+                             const char *mode, char *fileName);
 void FileIOBuffer(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM transferParam);
 void FileIOLog(PUVPERF_PARAM TestParams);
+void FileIOIsoTimeline(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM transferParam);
+void FileIOLatency(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM transferParam);
 void FileIOClose(PUVPERF_PARAM TestParams);
 
 #endif // FILEIO_H
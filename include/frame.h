@@ -0,0 +1,62 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "setting.h"
+
+// One application frame split over several transfers.
+typedef struct _UVPERF_FRAME_RECORD {
+    LONGLONG Sequence;
+    LONGLONG StartTime;   // ns, first segment submitted
+    LONGLONG EndTime;     // ns, latest completion of a counted segment, 0 = none yet
+    LONGLONG Transferred; // bytes of the segments reaped so far
+    int Submitted;        // segments submitted, the zero length packet included
+    int Completed;        // segments reaped, failed ones included
+    BOOL Closed;          // every segment of the frame has been submitted
+    BOOL Terminated;      // an IN segment came back short, the device ended the frame early
+    int LastSegment;      // that segment, the ones submitted after it are discarded
+    BOOL Failed;
+    BOOL InUse;
+} UVPERF_FRAME_RECORD, *PUVPERF_FRAME_RECORD;
+
+// Per transfer param state of the segmentation layer.
+typedef struct _UVPERF_FRAME {
+    int FrameSize;
+    int SegmentSize;  // -l/-w, the length of every transfer but the last of a frame
+    BOOL AppendZlp;   // OUT frames end with a zero length packet
+    LONGLONG SubmitSequence; // frame the next segment belongs to
+    int SubmitOffset;        // bytes of that frame submitted so far
+    BOOL ZlpPending;
+
+    // Frames in flight, Sequence % slotCount.
+    PUVPERF_FRAME_RECORD Records;
+    int slotCount;
+
+    LONGLONG FrameCount;
+    LONGLONG TerminatedCount;
+    LONGLONG FailedCount;
+    LONGLONG DiscardedSegments; // in flight behind a short IN segment, see FrameSegmentDone
+    LONGLONG DiscardedBytes;
+    DOUBLE MinFrameBps;
+    DOUBLE MaxFrameBps;
+    DOUBLE FrameBpsSum;
+    struct _UVPERF_LATENCY_HISTOGRAM *FrameTime; // first segment submit to last completion
+
+    FILE *FrameFile;
+} UVPERF_FRAME, *PUVPERF_FRAME;
+
+int ParseFrameSpec(PUVPERF_PARAM TestParams, const char *spec);
+
+int CreateFrame(PUVPERF_TRANSFER_PARAM transferParam);
+
+void FreeFrame(PUVPERF_TRANSFER_PARAM transferParam);
+
+int NextFrameSegment(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle);
+
+void FrameSegmentDone(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle,
+                      int ret);
+
+void FlushFrames(PUVPERF_TRANSFER_PARAM transferParam);
+
+void ShowFrames(PUVPERF_TRANSFER_PARAM transferParam);
+
+#endif // FRAME_H
@@ -7,7 +7,6 @@
 #define ENDPOINT_TYPE(TransferParam) (TransferParam->Ep.PipeType & 3)
 
 extern KUSB_DRIVER_API K;
-extern CRITICAL_SECTION DisplayCriticalSection;
 
 extern const char *TestDisplayString[];
 extern const char *EndpointTypeDisplayString[];
@@ -0,0 +1,34 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "setting.h"
+
+// Log-linear latency histogram: values below 2^LATENCY_SUB_BUCKET_BITS ns are counted exactly,
+// larger values in 2^LATENCY_SUB_BUCKET_BITS sub-buckets per power of two (< 1% error).
+#define LATENCY_SUB_BUCKET_BITS 7
+#define LATENCY_SUB_BUCKET_COUNT (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_BITS 48 // values are clamped to 2^48 ns (~78 hours)
+#define LATENCY_BUCKET_COUNT                                                                       \
+    ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKET_COUNT)
+
+typedef struct _UVPERF_LATENCY_HISTOGRAM {
+    LONGLONG Count;
+    LONGLONG Min; // ns
+    LONGLONG Max; // ns
+    DOUBLE Sum;   // ns
+    LONGLONG Buckets[LATENCY_BUCKET_COUNT];
+} UVPERF_LATENCY_HISTOGRAM, *PUVPERF_LATENCY_HISTOGRAM;
+
+void ResetLatencyHistogram(PUVPERF_LATENCY_HISTOGRAM histogram);
+
+void RecordLatency(PUVPERF_LATENCY_HISTOGRAM histogram, LONGLONG latency);
+
+LONGLONG GetLatencyBucketValue(int bucket);
+
+LONGLONG GetLatencyPercentile(PUVPERF_LATENCY_HISTOGRAM histogram, DOUBLE percentile);
+
+void ShowLatencyHistogram(const char *name, PUVPERF_LATENCY_HISTOGRAM histogram);
+
+int RunPingPong(PUVPERF_PARAM TestParams);
+
+#endif // LATENCY_H
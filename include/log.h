@@ -10,6 +10,9 @@ void ShowUsage();
 // Forward declaration of the LogPrint function with variable arguments
 int LogPrint(const int line, const char *func, const char *format, ...);
 
+// Set by -V, defined in uvperf.c
+extern int verbose;
+
 #define LOG_VERBOSE(format, ...)                                                                   \
     do {                                                                                           \
         if (verbose)                                                                               \
@@ -24,7 +27,7 @@ int LogPrint(const int line, const char *func, const char *format, ...);
 #define Log(fmt, ...) LogPrint(__LINE__, __func__, fmt, ##__VA_ARGS__)
 
 // Macros for logging with specific prefixes and the name of the current function
-#define LOG(LogTypeString, format, ...) Log("[%s] : " format, LogTypeString)
+#define LOG(LogTypeString, format, ...) Log("[%s] : " format, LogTypeString, ##__VA_ARGS__)
 #define LOG_NO_FN(LogTypeString, format, ...) Log("%s " format, LogTypeString, ##__VA_ARGS__)
 
 // Specific logging level macros that simplify usage
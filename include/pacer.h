@@ -0,0 +1,22 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include "setting.h"
+
+// Busy wait margin before a release when the high resolution waitable timer is available, and
+// when only the regular (timer tick granular) one is.
+#define PACER_SPIN_NS 200000
+#define PACER_COARSE_SPIN_NS 2000000
+
+// Longest single timer wait, so a slow rate still notices isCancelled.
+#define PACER_MAX_WAIT_MS 100
+
+int InitPacer(PUVPERF_PACER pacer, DOUBLE bytesPerSec, int burstBytes);
+
+LONGLONG PacerSleepUntil(PUVPERF_PACER pacer, PUVPERF_PARAM TestParams, LONGLONG releaseTime);
+
+BOOL PacerWait(PUVPERF_TRANSFER_PARAM transferParam, int bytes);
+
+void FreePacer(PUVPERF_PACER pacer);
+
+#endif // PACER_H
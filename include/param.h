@@ -5,10 +5,14 @@
 
 void ShowParams(PUVPERF_PARAM TestParams);
 
+const char *MatchSpecKey(const char *entry, const char *key);
+
 int GetDeviceParam(PUVPERF_PARAM TestParams);
 
 void SetParamsDefaults(PUVPERF_PARAM TestParms);
 
+int SetProcessPlacement(PUVPERF_PARAM TestParams);
+
 int GetDeviceInfoFromList(PUVPERF_PARAM TestParams);
 
 int CreateVerifyBuffer(PUVPERF_PARAM TestParam, WORD endpointMaxPacketSize);
@@ -0,0 +1,29 @@
+#ifndef POLLING_H
+#define POLLING_H
+
+#include "setting.h"
+
+// Per transfer param state of the interrupt polling measurement, only set up with -K on
+// interrupt IN endpoints.
+typedef struct _UVPERF_POLLING {
+    LONGLONG PeriodNs;    // polling period the descriptor asks for
+    LONGLONG LastArrival; // ns, completion of the previous report, 0 before the first
+    LONGLONG Reports;
+    LONGLONG MissedIntervals; // periods that passed without a report while one was queued
+    LONGLONG StarvedReports;  // submitted after the previous report arrived, see polling.c
+    struct _UVPERF_LATENCY_HISTOGRAM *InterArrival;
+    struct _UVPERF_LATENCY_HISTOGRAM *Jitter; // |inter-arrival - period|
+} UVPERF_POLLING, *PUVPERF_POLLING;
+
+int CreatePolling(PUVPERF_TRANSFER_PARAM transferParam);
+
+void FreePolling(PUVPERF_TRANSFER_PARAM transferParam);
+
+void RecordPollingArrival(PUVPERF_TRANSFER_PARAM transferParam, LONGLONG submitTime,
+                          LONGLONG arrival);
+
+void ResetPollingArrival(PUVPERF_TRANSFER_PARAM transferParam);
+
+void ShowPolling(PUVPERF_TRANSFER_PARAM transferParam);
+
+#endif // POLLING_H
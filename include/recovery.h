@@ -0,0 +1,50 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include "setting.h"
+
+#define RECOVERY_MAX_INCIDENTS 64 // kept per endpoint, later incidents are only counted
+
+// Recovery steps, in the order they are tried while the endpoint keeps failing.
+typedef enum _UVPERF_RECOVERY_STEP {
+    RecoveryIdle,
+    RecoveryResetPipe, // clear the halt and reset the host side of the pipe and its data toggle
+    RecoveryReclaim,   // release and re-claim the interface, restore the alt setting
+    RecoveryFailed,
+} UVPERF_RECOVERY_STEP;
+
+typedef struct _UVPERF_RECOVERY_INCIDENT {
+    DWORD Cause;               // error of the transfer that started the incident
+    BOOL Injected;             // started by -J
+    UVPERF_RECOVERY_STEP Step; // last step taken
+    LONGLONG StartTime;        // ns, the failed transfer was reaped
+    LONGLONG RecoveredTime;    // ns, first good byte after the last step, 0 = never
+    LONGLONG LostBytes;        // requested length of the failed and flushed transfers
+    int LostTransfers;
+} UVPERF_RECOVERY_INCIDENT, *PUVPERF_RECOVERY_INCIDENT;
+
+// Per transfer param state of the recovery state machine.
+typedef struct _UVPERF_RECOVERY {
+    UVPERF_RECOVERY_STEP Step;
+    BOOL Flushing;      // the ring is being cancelled, its completions are not the recovery
+    BOOL InjectPending; // InjectStall halted the endpoint, the next error is its stall
+    LONGLONG InjectCount;
+    LONG ReclaimsSeen; // InterfaceReclaims of the endpoint's interface when it last looked
+    UVPERF_RECOVERY_INCIDENT Incidents[RECOVERY_MAX_INCIDENTS];
+    UVPERF_RECOVERY_INCIDENT Overflow; // the running incident once Incidents is full
+    int incidentCount;
+} UVPERF_RECOVERY, *PUVPERF_RECOVERY;
+
+int CreateRecovery(PUVPERF_TRANSFER_PARAM transferParam);
+
+void FreeRecovery(PUVPERF_TRANSFER_PARAM transferParam);
+
+void InjectStall(PUVPERF_TRANSFER_PARAM transferParam, int ret);
+
+BOOL RecoverTransferParam(PUVPERF_TRANSFER_PARAM transferParam, int ret);
+
+void RecoveryTransferDone(PUVPERF_TRANSFER_PARAM transferParam, int ret);
+
+void ShowRecovery(PUVPERF_TRANSFER_PARAM transferParam);
+
+#endif // RECOVERY_H
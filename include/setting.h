@@ -14,7 +14,21 @@
 #include "libusbk.h"
 #include "log.h"
 
-#define MAX_OUTSTANDING_TRANSFERS 10
+// One transfer param (and thread) per endpoint under test.
+#define MAX_TRANSFER_PARAMS 32
+#define MAX_ASSOCIATED_INTERFACES 16
+#define MAX_CPUS ((int)sizeof(DWORD_PTR) * 8) // the width of a thread affinity mask
+
+// Time the cancelled transfers of one endpoint get to come back, and the transfer threads get to
+// stop, before the pipes are aborted again.
+#define CANCEL_DEADLINE_MS 100
+#define STOP_DEADLINE_MS 100
+
+// Frames between the current bus frame and a rescheduled isochronous transfer.
+#define ISO_SCHEDULE_LEAD_FRAMES 8
+
+// Feature selector of SET_FEATURE/CLEAR_FEATURE to an endpoint (-J).
+#define USB_FEATURE_ENDPOINT_HALT 0
 
 #define VerifyListLock(mTest)                                                                      \
     while (InterlockedExchange(&((mTest)->verifyLock), 1) != 0)                                    \
@@ -59,6 +73,20 @@ typedef enum _UVPERF_TRANSFER_MODE {
     TRANSFER_MODE_ASYNC,
 } UVPERF_TRANSFER_MODE;
 
+typedef enum _UVPERF_BACKEND {
+    BACKEND_LIBUSBK,
+    BACKEND_LIBUSB,
+} UVPERF_BACKEND;
+
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+struct _UVPERF_LATENCY_HISTOGRAM;
+struct _UVPERF_WORKLOAD;
+struct _UVPERF_RECOVERY;
+struct _UVPERF_FRAME;
+struct _UVPERF_POLLING;
+
 typedef struct _BENCHMARK_ISOCH_RESULTS {
     UINT GoodPackets;
     UINT BadPackets;
@@ -66,12 +94,119 @@ typedef struct _BENCHMARK_ISOCH_RESULTS {
     UINT TotalPackets;
 } BENCHMARK_ISOCH_RESULTS;
 
+// One isochronous packet in the timeline ring, written to disk as is (see FileIOIsoTimeline).
+// Timestamps are GetTimestampNs values: TSC derived when the calibrated TSC is the clock source,
+// on the CLOCK_MONOTONIC epoch either way. Neither backend times single packets, so Timestamp is
+// that of the whole transfer; the frame is the packet's own, derived from the transfer's start
+// frame and the endpoint's service interval.
+typedef struct _UVPERF_ISO_PACKET_RECORD {
+    LONGLONG Timestamp; // ns at which the transfer completed
+    UINT FrameNumber;   // (1 ms) frame the packet was scheduled in, 0 when unknown
+    UINT Status;        // packet status as reported by the backend, 0 = success
+    UINT Length;        // bytes received or sent in this packet
+    USHORT PacketIndex; // packet index within the transfer
+    USHORT Microframe;  // microframe within FrameNumber at high speed and above, else 0
+} UVPERF_ISO_PACKET_RECORD, *PUVPERF_ISO_PACKET_RECORD;
+
+// File header preceding the records, oldest record first.
+typedef struct _UVPERF_ISO_TIMELINE_HEADER {
+    char Magic[4]; // "UVIT"
+    UINT Version;
+    UINT RecordSize;
+    UINT PacketSize;
+    LONGLONG RecordCount;
+    LONGLONG DroppedCount; // overwritten by the ring before the dump
+    LONGLONG StartTime;    // GetTimestampNs ns of the first transfer, see the record timestamps
+    UCHAR PipeId;
+    UCHAR Reserved[7];
+} UVPERF_ISO_TIMELINE_HEADER;
+
+#define ISO_TIMELINE_VERSION 2
+
+// Page aligned data buffers of one transfer param, see buffer_pool.c
+typedef struct _UVPERF_BUFFER_POOL {
+    PUCHAR Data;
+    SIZE_T Size;
+    int Stride;
+    BOOL IsLocked;
+    BOOL IsLargePages;
+} UVPERF_BUFFER_POOL, *PUVPERF_BUFFER_POOL;
+
+// Token bucket releasing the submissions of one transfer param at -B MBPS, see pacer.c
+typedef struct _UVPERF_PACER {
+    DOUBLE BytesPerNs;
+    DOUBLE BurstBytes;
+    DOUBLE Tokens;       // bytes that may be submitted right now
+    LONGLONG LastRefill; // ns, 0 until the first release
+    LONGLONG SpinNs;     // the last SpinNs before a release are busy waited
+    HANDLE Timer;
+    LONGLONG PacedCount;  // releases that had to wait for tokens
+    LONGLONG BehindCount; // releases that found the bucket full, the pipe is slower than the rate
+    struct _UVPERF_LATENCY_HISTOGRAM *Error; // actual minus scheduled release time
+} UVPERF_PACER, *PUVPERF_PACER;
+
+#define WORKLOAD_MAX_SIZES 16
+
+typedef enum _UVPERF_WORKLOAD_SHAPE {
+    WORKLOAD_ON_OFF, // bursts separated by a fixed idle time
+    WORKLOAD_POISSON, // bursts start at exponentially distributed intervals
+} UVPERF_WORKLOAD_SHAPE;
+
+// Traffic shape parsed from -G PROFILE, see workload.c
+typedef struct _UVPERF_WORKLOAD_PROFILE {
+    UVPERF_WORKLOAD_SHAPE shape;
+    int burstCount; // transfers per burst, 0 when the burst is timed by onMs
+    int onMs;
+    int offMs;
+    DOUBLE rate; // Poisson bursts per second
+    int sizes[WORKLOAD_MAX_SIZES];
+    int sizeCount; // 0 = every transfer is -l/-w long
+    int maxSize;
+    ULONGLONG seed;
+} UVPERF_WORKLOAD_PROFILE, *PUVPERF_WORKLOAD_PROFILE;
+
+// Zero length packet termination of -F frames, see frame.c
+typedef enum _UVPERF_ZLP_POLICY {
+    ZlpNever,
+    ZlpAuto,   // only frames that are a multiple of wMaxPacketSize
+    ZlpAlways,
+} UVPERF_ZLP_POLICY;
+
+// Vendor request stream parsed from -O SPEC, see control.c
+typedef struct _UVPERF_CONTROL_PROFILE {
+    BOOL isIn;
+    UCHAR request;
+    USHORT value;
+    int index; // -1 = the -i interface
+    int length;
+    int depth;      // requests in flight
+    LONGLONG count; // 0 = CONTROL_DEFAULT_COUNT, or until -T runs out
+} UVPERF_CONTROL_PROFILE, *PUVPERF_CONTROL_PROFILE;
+
+typedef enum _UVPERF_SCHEDULING {
+    SchedulingNormal,
+    SchedulingHigh,     // HIGH_PRIORITY_CLASS, THREAD_PRIORITY_HIGHEST
+    SchedulingRealtime, // REALTIME_PRIORITY_CLASS, THREAD_PRIORITY_TIME_CRITICAL
+} UVPERF_SCHEDULING;
+
+// Another interface of a composite device that -A or -e runs pipes on, opened with
+// K.GetAssociatedInterface, see Bench_OpenAssociatedInterfaces.
+typedef struct _UVPERF_ASSOCIATED_INTERFACE {
+    KUSB_HANDLE InterfaceHandle;
+    USB_INTERFACE_DESCRIPTOR InterfaceDescriptor; // at the alt setting the test runs
+    UCHAR DefaultAltSetting;
+    WINUSB_PIPE_INFORMATION_EX PipeInformation[32];
+} UVPERF_ASSOCIATED_INTERFACE, *PUVPERF_ASSOCIATED_INTERFACE;
+
 typedef struct _UVPERF_PARAM {
     int vid;
     int pid;
     int intf;
     int altf;
     int endpoint;
+    int endpoints[MAX_TRANSFER_PARAMS];
+    int endpointCount;
+    BOOL allEndpoints;
     int Timer;
     int timeout;
     int refresh;
@@ -84,6 +219,11 @@ typedef struct _UVPERF_PARAM {
     int repeat;
     int fixedIsoPackets;
     int priority;
+    UVPERF_SCHEDULING scheduling;
+    DWORD priorityClass; // granted process priority class, see SetProcessPlacement
+    int cpus[MAX_TRANSFER_PARAMS]; // -C, transfer thread i runs on cpus[i % cpuCount]
+    int cpuCount;
+    int displayCpu; // -M, -1 = not pinned
     BOOL fileIO;
     BOOL ShowTransfer;
     BOOL useList;
@@ -91,6 +231,23 @@ typedef struct _UVPERF_PARAM {
     BOOL verifyDetails;
     UVPERF_DEVICE_TRANSFER_TYPE TestType;
     UVPERF_TRANSFER_MODE TransferMode;
+    UVPERF_BACKEND Backend;
+    BOOL useEventLoop;
+    BOOL useLargePages;
+    int isoTimelineSize;
+    int tunePercent;
+    char *sweepSpec;
+    char sweepFileName[MAX_PATH];
+    int pingPongCount;
+    DOUBLE targetMbps;
+    char *workloadSpec;
+    UVPERF_WORKLOAD_PROFILE WorkloadProfile;
+    int injectStallEvery; // -J, 0 = off
+    int frameSize;        // -F, 0 = every transfer stands alone
+    BOOL measurePolling;  // -K
+    char *controlSpec;    // -O
+    UVPERF_CONTROL_PROFILE ControlProfile;
+    UVPERF_ZLP_POLICY zlpPolicy;
 
     KLST_HANDLE DeviceList;
     KLST_DEVINFO_HANDLE SelectedDeviceProfile;
@@ -101,6 +258,10 @@ typedef struct _UVPERF_PARAM {
     USB_INTERFACE_DESCRIPTOR InterfaceDescriptor;
     USB_ENDPOINT_DESCRIPTOR EndpointDescriptor;
     WINUSB_PIPE_INFORMATION_EX PipeInformation[32];
+    UVPERF_ASSOCIATED_INTERFACE AssociatedInterfaces[MAX_ASSOCIATED_INTERFACES];
+    int associatedInterfaceCount;
+    // Per interface number, odd while an endpoint re-claims it, see recovery.c.
+    volatile LONG InterfaceReclaims[256];
     BOOL isCancelled;
     BOOL isUserAborted;
 
@@ -124,6 +285,20 @@ typedef struct _UVPERF_PARAM {
     BYTE *VerifyBuffer;
 
     unsigned char defaultAltSetting;
+
+    // libusb-1.0 backend, see usb_transfer.c
+    struct libusb_context *UsbContext;
+    struct libusb_device_handle *UsbHandle;
+    HANDLE UsbEventThreadHandle;
+    volatile BOOL UsbEventThreadStop;
+
+    // Event loop mode, see engine.c
+    struct _UVPERF_TRANSFER_PARAM **TransferParams;
+    int transferParamCount;
+    HANDLE EngineThreadHandle;
+    LONGLONG EngineWakeups;
+    ULONGLONG StartKernelTime;
+    ULONGLONG StartUserTime;
 } UVPERF_PARAM, *PUVPERF_PARAM;
 
 
@@ -135,48 +310,133 @@ typedef struct _UVPERF_TRANSFER_HANDLE {
     INT DataMaxLength;
     INT ReturnCode;
     BENCHMARK_ISOCH_RESULTS IsochResults;
+    struct libusb_transfer *UsbTransfer;
+    LONGLONG FrameSequence; // -F frame the handle's segment belongs to, 0 = none
+    int FrameSegment;       // index of the segment within that frame
+    UINT StartFrame;
+    LONGLONG SubmitTime;     // ns, see GetTimestampNs
+    LONGLONG CompletionTime; // ns, taken in the completion path, see ReapTransfer
+    struct _UVPERF_TRANSFER_PARAM *TransferParam;
+    int Index;
 } UVPERF_TRANSFER_HANDLE, *PUVPERF_TRANSFER_HANDLE;
 
+#define CACHE_LINE_SIZE 64
+
+// Counters of one transfer param that reporters read while the test runs. TransferComplete
+// updates the byte and tick counters under Sequence (odd while it does), the rest are single
+// writer counters updated as transfers are reaped. Reporters copy only this block, with
+// ReadTransferStats. It is cache line aligned so that the submission state the transfer thread
+// writes next to it never shares a line with it.
+typedef struct DECLSPEC_ALIGN(CACHE_LINE_SIZE) _UVPERF_TRANSFER_STATS {
+    volatile LONG Sequence;
+
+    LONG Packets;
+    LONGLONG TotalTransferred;
+    LONG LastTransferred;
+    LONGLONG StartTick; // ns, see GetTimestampNs
+    LONGLONG LastTick;
+    LONGLONG LastStartTick;
+
+    int TotalTimeoutCount;
+    int TotalErrorCount;
+
+    // Outstanding transfers seen each time one is reaped, for the achieved queue depth.
+    LONGLONG QueueDepthTotal;
+    LONG QueueDepthSamples;
+    int MaxQueueDepth;
+
+    // Packet results and the number of times an isochronous OUT schedule ran empty.
+    BENCHMARK_ISOCH_RESULTS IsochResults;
+    int isoUnderrunCount;
+} UVPERF_TRANSFER_STATS, *PUVPERF_TRANSFER_STATS;
+
+// Set by the display to restart the current rate window, the transfer thread does the actual
+// reset. The display writes it while the test runs, so it gets a cache line of its own.
+typedef struct DECLSPEC_ALIGN(CACHE_LINE_SIZE) _UVPERF_WINDOW_RESET {
+    volatile LONG Requested;
+} UVPERF_WINDOW_RESET, *PUVPERF_WINDOW_RESET;
+
 typedef struct _UVPERF_TRANSFER_PARAM {
     PUVPERF_PARAM TestParams;
     unsigned int frameNumber;
     unsigned int numberOFIsoPackets;
     HANDLE ThreadHandle;
     DWORD ThreadId;
+    int Cpu; // -1 = not pinned
+
+    // Interface the pipe belongs to, the selected one or one of AssociatedInterfaces.
+    KUSB_HANDLE InterfaceHandle;
+    UCHAR InterfaceNumber;
+    UCHAR AltSetting;
+
     WINUSB_PIPE_INFORMATION_EX Ep;
     USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR EpCompanionDescriptor;
     BOOL HasEpCompanionDescriptor;
     BOOL isRunning;
 
-    LONGLONG TotalTransferred;
-    LONG LastTransferred;
-
-    LONG Packets;
-    struct timespec StartTick;
-    struct timespec LastTick;
-    struct timespec LastStartTick;
+    // The only part the reporters copy while the test runs, see UVPERF_TRANSFER_STATS.
+    UVPERF_TRANSFER_STATS Stats;
 
-    int shortTrasnferred;
+    // See UVPERF_WINDOW_RESET.
+    UVPERF_WINDOW_RESET WindowReset;
 
-    int TotalTimeoutCount;
     int RunningTimeoutCount;
 
     int totalErrorCount;
     int runningErrorCount;
 
-    int TotalErrorCount;
     int RunningErrorCount;
 
+    // Bulk and interrupt completions shorter than submitted, and those of zero length.
     int shortTransferCount;
+    int zeroLengthCount;
 
     int transferHandleNextIndex;
     int transferHandleWaitIndex;
     int outstandingTransferCount;
 
-    UVPERF_TRANSFER_HANDLE TransferHandles[MAX_OUTSTANDING_TRANSFERS];
-    BENCHMARK_ISOCH_RESULTS IsochResults;
+    LONGLONG Wakeups;
+
+    // Index of the newest transfer on the schedule.
+    int lastSubmittedIndex;
+
+    // Ring of the last isoTimelineSize iso packets, filled by IsoTransferCb.
+    PUVPERF_ISO_PACKET_RECORD IsoTimeline;
+    LONGLONG isoTimelineCount;
+    UINT isoPacketMicroframes; // service interval of one packet in 125 us microframes
+
+    // Submit to completion latency of every successful transfer. Only the thread reaping this
+    // endpoint records into it, so it needs no lock.
+    struct _UVPERF_LATENCY_HISTOGRAM *Latency;
+
+    // Submission pacing, only set up with -B.
+    UVPERF_PACER Pacer;
+
+    // Burst generator state, only set up with -G.
+    struct _UVPERF_WORKLOAD *Workload;
+
+    // Stall recovery state and incident log, see recovery.c.
+    struct _UVPERF_RECOVERY *Recovery;
+
+    // Frame segmentation state, only set up with -F.
+    struct _UVPERF_FRAME *Frame;
+
+    // Interrupt IN polling measurement, only set up with -K.
+    struct _UVPERF_POLLING *Polling;
+
+    // bufferCount handles, allocated in CreateTransferParam.
+    PUVPERF_TRANSFER_HANDLE TransferHandles;
+
+    // libusb backend completion queue: handle indexes pushed by the event thread callback,
+    // popped by the transfer thread. One slot larger than bufferCount so it never fills.
+    HANDLE CompletionEvent;
+    int *CompletionQueue;
+    volatile LONG completionQueueHead;
+    volatile LONG completionQueueTail;
 
-    UCHAR Buffer[0];
+    // bufferCount data buffers of BufferPool.Stride bytes each, kept apart from the counters above.
+    UVPERF_BUFFER_POOL BufferPool;
+    PUCHAR Buffer;
 } UVPERF_TRANSFER_PARAM, *PUVPERF_TRANSFER_PARAM;
 
 LONG WinError(__in_opt DWORD errorCode);
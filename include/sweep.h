@@ -0,0 +1,25 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "setting.h"
+
+#define SWEEP_MAX_VALUES 32
+
+// Values of one swept parameter, parsed from a -s SPEC entry.
+typedef struct _UVPERF_SWEEP_RANGE {
+    int values[SWEEP_MAX_VALUES];
+    int count;
+} UVPERF_SWEEP_RANGE, *PUVPERF_SWEEP_RANGE;
+
+typedef struct _UVPERF_SWEEP {
+    UVPERF_SWEEP_RANGE altSettings;
+    UVPERF_SWEEP_RANGE transferModes;
+    UVPERF_SWEEP_RANGE bufferCounts;
+    UVPERF_SWEEP_RANGE lengths;
+} UVPERF_SWEEP, *PUVPERF_SWEEP;
+
+int ParseSweepSpec(PUVPERF_PARAM TestParams, const char *spec, PUVPERF_SWEEP sweep);
+
+int RunSweep(PUVPERF_PARAM TestParams);
+
+#endif // SWEEP_H
@@ -0,0 +1,56 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <windows.h>
+#include <time.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <intrin.h>
+#define TIMESTAMP_HAS_TSC 1
+#else
+#define TIMESTAMP_HAS_TSC 0
+#endif
+
+#define TIMESTAMP_CALIBRATION_MS 50   // length of one calibration window
+#define TIMESTAMP_CALIBRATION_PPM 500 // max disagreement of the two windows
+#define TIMESTAMP_COST_SAMPLES 10000
+
+typedef enum _UVPERF_CLOCK_SOURCE {
+    ClockSourceMonotonic, // clock_gettime(CLOCK_MONOTONIC)
+    ClockSourceTsc,       // invariant TSC, calibrated against QueryPerformanceCounter
+} UVPERF_CLOCK_SOURCE;
+
+typedef struct _UVPERF_TIMESTAMP_CLOCK {
+    UVPERF_CLOCK_SOURCE Source;
+    BOOL InvariantTsc;
+    DOUBLE TscHz; // 0 when the TSC was not calibrated
+    DOUBLE NsPerTsc;
+    ULONGLONG TscBase; // TSC and ns at the same instant
+    LONGLONG NsBase;
+    DOUBLE CalibrationPpm; // disagreement between the two calibration windows
+    LONGLONG ReadCostNs;   // cost of one GetTimestampNs call
+} UVPERF_TIMESTAMP_CLOCK, *PUVPERF_TIMESTAMP_CLOCK;
+
+extern UVPERF_TIMESTAMP_CLOCK TimestampClock;
+
+void InitTimestampClock(void);
+
+static __inline LONGLONG GetMonotonicNs(void) {
+    struct timespec tick;
+
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    return tick.tv_sec * 1000000000LL + tick.tv_nsec;
+}
+
+// Monotonic time in ns, the time base of every tick and latency measurement. Same epoch whichever
+// source InitTimestampClock picked.
+static __inline LONGLONG GetTimestampNs(void) {
+#if TIMESTAMP_HAS_TSC
+    if (TimestampClock.Source == ClockSourceTsc)
+        return TimestampClock.NsBase +
+               (LONGLONG)((LONGLONG)(__rdtsc() - TimestampClock.TscBase) * TimestampClock.NsPerTsc);
+#endif
+    return GetMonotonicNs();
+}
+
+#endif // TIMESTAMP_H
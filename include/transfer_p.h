@@ -12,6 +12,12 @@
     IncField = 0
 
 
+UCHAR GetDeviceSpeed(PUVPERF_PARAM TestParams);
+
+int GetTransferLength(PUVPERF_TRANSFER_PARAM transferParam);
+
+BOOL HasVariableTransferLength(PUVPERF_TRANSFER_PARAM transferParam);
+
 void AppendLoopBuffer(PUVPERF_PARAM TestParams, unsigned char *buffer, unsigned int length);
 
 int VerifyData(PUVPERF_TRANSFER_PARAM transferParam, BYTE *data, INT dataLength);
@@ -22,6 +28,13 @@ BOOL WINAPI IsoTransferCb(_in unsigned int packetIndex, _ref unsigned int *offse
                           _ref unsigned int *length, _ref unsigned int *status,
                           _in void *userState);
 int TransferAsync(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE *handleRef);
+int TransferAsyncEx(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE *handleRef,
+                    DWORD msToWait);
+BOOL TransferTimedOut(PUVPERF_TRANSFER_PARAM transferParam);
+BOOL TransferComplete(PUVPERF_TRANSFER_PARAM transferParam, unsigned char *buffer, int ret);
+LONGLONG CancelTransfers(PUVPERF_TRANSFER_PARAM transferParam);
+
+LONGLONG AbortTransfers(PUVPERF_TRANSFER_PARAM transferParam);
 void VerifyLoopData();
 
 
@@ -29,17 +42,29 @@ void FreeTransferParam(PUVPERF_TRANSFER_PARAM *transferParamRef);
 
 PUVPERF_TRANSFER_PARAM CreateTransferParam(PUVPERF_PARAM TestParams, int endpointID);
 
-void GetAverageBytesSec(PUVPERF_TRANSFER_PARAM transferParam, DOUBLE *bps);
+int CreateTransferParams(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM *transferParams);
+
+int StartTransferParams(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM *transferParams,
+                        int transferParamCount);
+
+void StopTransferParams(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM *transferParams,
+                        int transferParamCount);
+
+void ReadTransferStats(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_STATS snapshot);
+
+void GetAverageBytesSec(PUVPERF_TRANSFER_STATS stats, DOUBLE *bps);
+
+void GetCurrentBytesSec(PUVPERF_TRANSFER_STATS stats, DOUBLE *bps);
 
-void GetCurrentBytesSec(PUVPERF_TRANSFER_PARAM transferParam, DOUBLE *bps);
+void GetAverageQueueDepth(PUVPERF_TRANSFER_STATS stats, DOUBLE *depth);
 
-void ShowRunningStatus(PUVPERF_TRANSFER_PARAM readParam, PUVPERF_TRANSFER_PARAM writeParam);
+void ShowRunningStatus(PUVPERF_TRANSFER_PARAM *transferParams, int transferParamCount);
 
 DWORD TransferThread(PUVPERF_TRANSFER_PARAM transferParam);
 
 void ShowTransfer(PUVPERF_TRANSFER_PARAM transferParam);
 
-BOOL WaitForTestTransfer(PUVPERF_TRANSFER_PARAM transferParam, UINT msToWait);
+void ShowTransferSummary(PUVPERF_TRANSFER_PARAM *transferParams, int transferParamCount);
 
 
 
@@ -0,0 +1,29 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include "setting.h"
+
+#define TUNE_MEASURE_MS 2000
+#define TUNE_MAX_BUFFER_COUNT 64
+#define TUNE_MAX_LENGTH (1024 * 1024)
+#define TUNE_MAX_POINTS 128
+
+// Result of one measurement, shared by the tuner and the sweep.
+typedef struct _UVPERF_TUNE_POINT {
+    int altSetting;
+    UVPERF_TRANSFER_MODE transferMode;
+    int bufferCount;
+    int length;
+    BOOL failed; // the point could not be set up, ran into an error or was aborted
+    DOUBLE bps;  // aggregate average bytes per second, 0 when the point failed
+    DOUBLE transfersPerSec;
+    int errorCount;
+    int timeoutCount;
+    DOUBLE cpuSeconds;
+} UVPERF_TUNE_POINT, *PUVPERF_TUNE_POINT;
+
+int MeasureTransferParams(PUVPERF_PARAM TestParams, DWORD msToMeasure, PUVPERF_TUNE_POINT point);
+
+int RunTuner(PUVPERF_PARAM TestParams);
+
+#endif // TUNER_H
@@ -0,0 +1,25 @@
+#ifndef USB_TRANSFER_H
+#define USB_TRANSFER_H
+
+#include "setting.h"
+
+int UsbBackendOpen(PUVPERF_PARAM TestParams);
+void UsbBackendClose(PUVPERF_PARAM TestParams);
+int UsbSetAltSetting(PUVPERF_PARAM TestParams, int altSetting);
+BOOL UsbClearHalt(PUVPERF_TRANSFER_PARAM transferParam);
+BOOL UsbSetHalt(PUVPERF_TRANSFER_PARAM transferParam);
+BOOL UsbReclaimInterface(PUVPERF_PARAM TestParams, int number, int altSetting);
+
+int UsbInitCompletionQueue(PUVPERF_TRANSFER_PARAM transferParam);
+void UsbFreeCompletionQueue(PUVPERF_TRANSFER_PARAM transferParam);
+
+int UsbTransferSync(PUVPERF_TRANSFER_PARAM transferParam);
+BOOL UsbSubmitTransfer(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle);
+BOOL UsbGetTransferResult(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle,
+                          UINT *transferred);
+int UsbHandleEvents(PUVPERF_PARAM TestParams, DWORD msToWait);
+int UsbWaitForCompletion(PUVPERF_TRANSFER_PARAM transferParam, DWORD msToWait);
+BOOL UsbCancelTransfer(PUVPERF_TRANSFER_HANDLE handle);
+void UsbFreeTransfer(PUVPERF_TRANSFER_HANDLE handle);
+
+#endif // USB_TRANSFER_H
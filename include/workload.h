@@ -0,0 +1,39 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include "setting.h"
+
+#define WORKLOAD_DEFAULT_BURST_COUNT 16
+#define WORKLOAD_DEFAULT_OFF_MS 100
+#define WORKLOAD_DEFAULT_RATE 10.0
+#define WORKLOAD_DEFAULT_SEED 1
+
+// Per transfer param state of the burst generator.
+typedef struct _UVPERF_WORKLOAD {
+    PUVPERF_WORKLOAD_PROFILE Profile;
+    ULONGLONG Random;  // xorshift64* state, seeded from the profile seed and the pipe id
+    int SubmitBudget;  // transfers TransferAsyncEx may still submit in the current burst
+    UVPERF_PACER Idle; // timer for the idle time between bursts
+
+    LONGLONG BurstCount;
+    DOUBLE MinBurstBps;
+    DOUBLE MaxBurstBps;
+    DOUBLE BurstBpsSum;
+    struct _UVPERF_LATENCY_HISTOGRAM *FirstByte; // first completion after idle minus burst start
+
+    FILE *BurstFile;
+} UVPERF_WORKLOAD, *PUVPERF_WORKLOAD;
+
+int ParseWorkloadProfile(PUVPERF_PARAM TestParams, const char *spec);
+
+int CreateWorkload(PUVPERF_TRANSFER_PARAM transferParam);
+
+void FreeWorkload(PUVPERF_TRANSFER_PARAM transferParam);
+
+int NextWorkloadLength(PUVPERF_TRANSFER_PARAM transferParam);
+
+DWORD WorkloadThread(PUVPERF_TRANSFER_PARAM transferParam);
+
+void ShowWorkload(PUVPERF_TRANSFER_PARAM transferParam);
+
+#endif // WORKLOAD_H
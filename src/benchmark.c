@@ -163,20 +163,200 @@ BOOL Bench_Open(__in PUVPERF_PARAM TestParams) {
     return FALSE;
 }
 
+// -A runs bulk and isochronous pipes. Interrupt pipes only run with -K, which measures IN
+// polling, and zero bandwidth pipes of an idle alt setting never run.
+BOOL Bench_IsBenchPipe(__in PUVPERF_PARAM TestParams, __in PWINUSB_PIPE_INFORMATION_EX pipeInfo) {
+    if (!pipeInfo->MaximumPacketSize)
+        return FALSE;
+
+    switch (pipeInfo->PipeType) {
+    case UsbdPipeTypeBulk:
+    case UsbdPipeTypeIsochronous:
+        return TRUE;
+    case UsbdPipeTypeInterrupt:
+        return TestParams->measurePolling && USB_ENDPOINT_DIRECTION_IN(pipeInfo->PipeId);
+    default:
+        return FALSE;
+    }
+}
+
+static BOOL IsRequestedPipe(PUVPERF_PARAM TestParams, PWINUSB_PIPE_INFORMATION_EX pipeInfo) {
+    int i;
+
+    if (TestParams->allEndpoints)
+        return Bench_IsBenchPipe(TestParams, pipeInfo);
+
+    for (i = 0; i < TestParams->endpointCount; i++) {
+        if (TestParams->endpoints[i] == pipeInfo->PipeId)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Opens the other interfaces of a composite device for -A and -e. Each one is switched to its
+// first alt setting with a pipe the test asks for; interfaces without one are closed again.
+BOOL Bench_OpenAssociatedInterfaces(__in PUVPERF_PARAM TestParams) {
+    PUVPERF_ASSOCIATED_INTERFACE associated;
+    KUSB_HANDLE associatedHandle;
+    UCHAR index, altSetting, pipeIndex;
+    BOOL found;
+
+    TestParams->associatedInterfaceCount = 0;
+
+    for (index = 0; K.GetAssociatedInterface(TestParams->InterfaceHandle, index, &associatedHandle);
+         index++) {
+        if (TestParams->associatedInterfaceCount == MAX_ASSOCIATED_INTERFACES) {
+            LOG_WARNING("only the first %d associated interfaces are used\n",
+                        MAX_ASSOCIATED_INTERFACES);
+            K.Free(associatedHandle);
+            break;
+        }
+
+        associated = &TestParams->AssociatedInterfaces[TestParams->associatedInterfaceCount];
+        memset(associated, 0, sizeof(*associated));
+        associated->InterfaceHandle = associatedHandle;
+
+        found = FALSE;
+        altSetting = 0;
+        while (!found && K.QueryInterfaceSettings(associatedHandle, altSetting,
+                                                  &associated->InterfaceDescriptor)) {
+            memset(associated->PipeInformation, 0, sizeof(associated->PipeInformation));
+            pipeIndex = 0;
+            while (K.QueryPipeEx(associatedHandle, altSetting, pipeIndex,
+                                 &associated->PipeInformation[pipeIndex])) {
+                if (IsRequestedPipe(TestParams, &associated->PipeInformation[pipeIndex]))
+                    found = TRUE;
+                pipeIndex++;
+            }
+
+            if (!found)
+                altSetting++;
+        }
+
+        if (!found) {
+            K.Free(associatedHandle);
+            continue;
+        }
+
+        K.GetCurrentAlternateSetting(associatedHandle, &associated->DefaultAltSetting);
+        if (!K.SetCurrentAlternateSetting(associatedHandle, altSetting)) {
+            LOG_ERROR("can not find alt interface %02X:%02X\n",
+                      associated->InterfaceDescriptor.bInterfaceNumber, altSetting);
+            K.Free(associatedHandle);
+            return FALSE;
+        }
+
+        LOG_VERBOSE("interface %02X:%02X joins the test\n",
+                    associated->InterfaceDescriptor.bInterfaceNumber, altSetting);
+        TestParams->associatedInterfaceCount++;
+    }
+
+    return TRUE;
+}
+
+void Bench_CloseAssociatedInterfaces(__in PUVPERF_PARAM TestParams) {
+    PUVPERF_ASSOCIATED_INTERFACE associated;
+    int i;
+
+    for (i = 0; i < TestParams->associatedInterfaceCount; i++) {
+        associated = &TestParams->AssociatedInterfaces[i];
+        K.SetAltInterface(associated->InterfaceHandle,
+                          associated->InterfaceDescriptor.bInterfaceNumber, FALSE,
+                          associated->DefaultAltSetting);
+        K.Free(associated->InterfaceHandle);
+    }
+    TestParams->associatedInterfaceCount = 0;
+}
+
+// Returns the associated interface endpointID is on and its index there, NULL when none has it.
+PUVPERF_ASSOCIATED_INTERFACE Bench_FindAssociatedPipe(__in PUVPERF_PARAM TestParams,
+                                                      __in int endpointID, __out UCHAR *pipeIndex) {
+    PUVPERF_ASSOCIATED_INTERFACE associated;
+    int i, j;
+
+    for (i = 0; i < TestParams->associatedInterfaceCount; i++) {
+        associated = &TestParams->AssociatedInterfaces[i];
+        for (j = 0; j < associated->InterfaceDescriptor.bNumEndpoints; j++) {
+            if ((int)associated->PipeInformation[j].PipeId == endpointID) {
+                *pipeIndex = (UCHAR)j;
+                return associated;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void SelectPipe(PUVPERF_PARAM TestParams, PWINUSB_PIPE_INFORMATION_EX pipeInfo) {
+    if (!Bench_IsBenchPipe(TestParams, pipeInfo))
+        return;
+
+    if (TestParams->endpointCount == MAX_TRANSFER_PARAMS) {
+        LOG_WARNING("-A runs at most %d pipes, skipping Ep0x%02X\n", MAX_TRANSFER_PARAMS,
+                    pipeInfo->PipeId);
+        return;
+    }
+
+    TestParams->endpoints[TestParams->endpointCount++] = pipeInfo->PipeId;
+}
+
+// Fills the -A endpoint list: the pipes of the selected interface, then those of the associated
+// interfaces. Every pipe runs in its own direction. Returns the number of endpoints.
+int Bench_SelectAllPipes(__in PUVPERF_PARAM TestParams) {
+    PUVPERF_ASSOCIATED_INTERFACE associated;
+    int i, j;
+
+    TestParams->endpointCount = 0;
+    for (i = 0; i < TestParams->InterfaceDescriptor.bNumEndpoints; i++)
+        SelectPipe(TestParams, &TestParams->PipeInformation[i]);
+
+    for (i = 0; i < TestParams->associatedInterfaceCount; i++) {
+        associated = &TestParams->AssociatedInterfaces[i];
+        for (j = 0; j < associated->InterfaceDescriptor.bNumEndpoints; j++)
+            SelectPipe(TestParams, &associated->PipeInformation[j]);
+    }
+
+    return TestParams->endpointCount;
+}
+
+// Builds the setup packet of a vendor request to the device, in (device to host) or out.
+void Bench_VendorSetupPacket(__out WINUSB_SETUP_PACKET *Pkt, __in BOOL isIn, __in UCHAR request,
+                             __in USHORT value, __in USHORT index, __in USHORT length) {
+    KUSB_SETUP_PACKET *defPkt = (KUSB_SETUP_PACKET *)Pkt;
+
+    memset(Pkt, 0, sizeof(*Pkt));
+    defPkt->BmRequest.Dir = isIn ? BMREQUEST_DIR_DEVICE_TO_HOST : BMREQUEST_DIR_HOST_TO_DEVICE;
+    defPkt->BmRequest.Type = BMREQUEST_TYPE_VENDOR;
+    defPkt->Request = request;
+    defPkt->Value = value;
+    defPkt->Index = index;
+    defPkt->Length = length;
+}
+
+// Sends SET_FEATURE(ENDPOINT_HALT) to pipeId, so the device stalls it until it is cleared.
+BOOL Bench_SetEndpointHalt(__in KUSB_HANDLE handle, __in UCHAR pipeId) {
+    WINUSB_SETUP_PACKET Pkt;
+    KUSB_SETUP_PACKET *defPkt = (KUSB_SETUP_PACKET *)&Pkt;
+    UINT transferred = 0;
+
+    memset(&Pkt, 0, sizeof(Pkt));
+    defPkt->BmRequest.Dir = BMREQUEST_DIR_HOST_TO_DEVICE;
+    defPkt->BmRequest.Type = BMREQUEST_TYPE_STANDARD;
+    defPkt->BmRequest.Recipient = BMREQUEST_RECIPIENT_ENDPOINT;
+    defPkt->Request = USB_REQUEST_SET_FEATURE;
+    defPkt->Value = USB_FEATURE_ENDPOINT_HALT;
+    defPkt->Index = pipeId;
+
+    return K.ControlTransfer(handle, Pkt, NULL, 0, &transferred, NULL);
+}
+
 BOOL Bench_Configure(__in KUSB_HANDLE handle, __in UVPERF_DEVICE_COMMAND command, __in UCHAR intf,
                      __inout PUVPERF_DEVICE_TRANSFER_TYPE testType) {
     UCHAR buffer[1];
     UINT transferred = 0;
     WINUSB_SETUP_PACKET Pkt;
-    KUSB_SETUP_PACKET *defPkt = (KUSB_SETUP_PACKET *)&Pkt;
 
-    memset(&Pkt, 0, sizeof(Pkt));
-    defPkt->BmRequest.Dir = BMREQUEST_DIR_DEVICE_TO_HOST;
-    defPkt->BmRequest.Type = BMREQUEST_TYPE_VENDOR;
-    defPkt->Request = (UCHAR)command;
-    defPkt->Value = (UCHAR)*testType;
-    defPkt->Index = intf;
-    defPkt->Length = 1;
+    Bench_VendorSetupPacket(&Pkt, TRUE, (UCHAR)command, (UCHAR)*testType, intf, 1);
 
     if (!handle || handle == INVALID_HANDLE_VALUE) {
         return WinError(ERROR_INVALID_HANDLE);
@@ -0,0 +1,112 @@
+#include <windows.h>
+
+#include "log.h"
+#include "buffer_pool.h"
+
+#define ROUND_UP(value, alignment) ((((value) + (alignment) - 1) / (alignment)) * (alignment))
+
+// Large pages need SeLockMemoryPrivilege in the process token. The privilege has to be granted to
+// the user beforehand (Local Security Policy, "Lock pages in memory"); this only enables it.
+static BOOL EnableLockMemoryPrivilege(void) {
+    HANDLE token;
+    TOKEN_PRIVILEGES privileges;
+    BOOL success;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return FALSE;
+
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    success = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+              AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+              GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+
+    CloseHandle(token);
+    return success;
+}
+
+static PUCHAR AllocLargePages(SIZE_T *size) {
+    SIZE_T largePageSize = GetLargePageMinimum();
+    PUCHAR data;
+
+    if (!largePageSize || !EnableLockMemoryPrivilege())
+        return NULL;
+
+    data = VirtualAlloc(NULL, ROUND_UP(*size, largePageSize),
+                        MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (data)
+        *size = ROUND_UP(*size, largePageSize);
+
+    return data;
+}
+
+// VirtualLock can only lock up to the minimum working set, grow it by the pool size first.
+static BOOL LockPages(PUCHAR data, SIZE_T size) {
+    SIZE_T minWorkingSet, maxWorkingSet;
+
+    if (GetProcessWorkingSetSize(GetCurrentProcess(), &minWorkingSet, &maxWorkingSet)) {
+        SetProcessWorkingSetSize(GetCurrentProcess(), minWorkingSet + size,
+                                 max(maxWorkingSet, minWorkingSet + size));
+    }
+
+    return VirtualLock(data, size);
+}
+
+// Allocates bufferCount page aligned buffers of at least bufferSize bytes, faults every page in
+// and locks them so neither page faults nor paging show up in the measurement. Large pages are
+// tried first when requested, normal pages are the fallback. Returns the buffer stride or -1.
+int CreateBufferPool(PUVPERF_BUFFER_POOL bufferPool, int bufferSize, int bufferCount,
+                     BOOL useLargePages) {
+    SYSTEM_INFO systemInfo;
+
+    memset(bufferPool, 0, sizeof(*bufferPool));
+
+    GetSystemInfo(&systemInfo);
+    bufferPool->Stride = ROUND_UP(bufferSize, (int)systemInfo.dwPageSize);
+    bufferPool->Size = (SIZE_T)bufferPool->Stride * bufferCount;
+
+    if (useLargePages) {
+        bufferPool->Data = AllocLargePages(&bufferPool->Size);
+        if (bufferPool->Data) {
+            // Large pages are never paged out.
+            bufferPool->IsLargePages = TRUE;
+            bufferPool->IsLocked = TRUE;
+        } else {
+            LOG_WARNING("large pages unavailable (needs 'Lock pages in memory'), using %u byte "
+                        "pages\n",
+                        systemInfo.dwPageSize);
+        }
+    }
+
+    if (!bufferPool->Data) {
+        bufferPool->Data =
+            VirtualAlloc(NULL, bufferPool->Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (!bufferPool->Data) {
+            LOG_ERROR("VirtualAlloc failed for %Iu bytes. ErrorCode: %08Xh\n", bufferPool->Size,
+                      GetLastError());
+            return -1;
+        }
+    }
+
+    // Touch every page now rather than on the first transfer.
+    memset(bufferPool->Data, 0, bufferPool->Size);
+
+    if (!bufferPool->IsLocked) {
+        bufferPool->IsLocked = LockPages(bufferPool->Data, bufferPool->Size);
+        if (!bufferPool->IsLocked)
+            LOG_WARNING("VirtualLock failed. ErrorCode: %08Xh\n", GetLastError());
+    }
+
+    return bufferPool->Stride;
+}
+
+void FreeBufferPool(PUVPERF_BUFFER_POOL bufferPool) {
+    if (!bufferPool->Data)
+        return;
+
+    if (bufferPool->IsLocked && !bufferPool->IsLargePages)
+        VirtualUnlock(bufferPool->Data, bufferPool->Size);
+
+    VirtualFree(bufferPool->Data, 0, MEM_RELEASE);
+    memset(bufferPool, 0, sizeof(*bufferPool));
+}
@@ -0,0 +1,322 @@
+#include <windows.h>
+#include <conio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "k.h"
+#include "control.h"
+#include "latency.h"
+#include "timestamp.h"
+#include "param.h"
+#include "benchmark.h"
+
+// EP0 control transfer benchmark (-O SPEC). Streams vendor requests to the device, built with
+// Bench_VendorSetupPacket like the one in Bench_Configure, and reports transactions per second and
+// the latency of every request from its submission to its completion. With q=1 every request
+// waits for the previous one (back to back); a larger q keeps that many requests queued on EP0,
+// which completes them in order.
+//
+// SPEC is a comma separated list, the direction first:
+//   in                device to host requests (default)
+//   out               host to device requests, needs r=
+//   r=REQUEST         bRequest (default GET_TEST for in)
+//   v=VALUE           wValue (default 0)
+//   i=INDEX           wIndex (default the -i interface)
+//   n=LENGTH          wLength, bytes of the data stage (default 1 for in, 0 for out)
+//   q=DEPTH           requests kept in flight (default 1)
+//   c=COUNT           requests to issue (default 10000, or until -T runs out)
+// e.g. -O in,r=0x0F,n=1 or -O out,r=0x20,v=0x1234,n=4,q=8
+
+typedef struct _UVPERF_CONTROL_SLOT {
+    OVERLAPPED Overlapped;
+    LONGLONG SubmitTime;
+    LONGLONG CompletionTime; // ns, see StampControlCompletions, 0 while in flight
+    UCHAR Data[CONTROL_MAX_LENGTH];
+} UVPERF_CONTROL_SLOT, *PUVPERF_CONTROL_SLOT;
+
+int ParseControlSpec(PUVPERF_PARAM TestParams, const char *spec) {
+    PUVPERF_CONTROL_PROFILE profile = &TestParams->ControlProfile;
+    BOOL hasRequest = FALSE, hasLength = FALSE;
+    const char *value;
+    char *end;
+    long number;
+    BOOL valid;
+
+    memset(profile, 0, sizeof(*profile));
+    profile->isIn = TRUE;
+    profile->request = GET_TEST;
+    profile->index = -1;
+    profile->depth = 1;
+
+    while (*spec) {
+        valid = TRUE;
+        end = NULL;
+
+        if (!strncmp(spec, "in", 2) && (spec[2] == ',' || !spec[2])) {
+            profile->isIn = TRUE;
+        } else if (!strncmp(spec, "out", 3) && (spec[3] == ',' || !spec[3])) {
+            profile->isIn = FALSE;
+        } else if ((value = MatchSpecKey(spec, "r"))) {
+            number = strtol(value, &end, 0);
+            profile->request = (UCHAR)number;
+            hasRequest = TRUE;
+            valid = number >= 0 && number <= 0xFF;
+        } else if ((value = MatchSpecKey(spec, "v"))) {
+            number = strtol(value, &end, 0);
+            profile->value = (USHORT)number;
+            valid = number >= 0 && number <= 0xFFFF;
+        } else if ((value = MatchSpecKey(spec, "i"))) {
+            profile->index = strtol(value, &end, 0);
+            valid = profile->index >= 0 && profile->index <= 0xFFFF;
+        } else if ((value = MatchSpecKey(spec, "n"))) {
+            profile->length = strtol(value, &end, 0);
+            hasLength = TRUE;
+            valid = profile->length >= 0 && profile->length <= CONTROL_MAX_LENGTH;
+        } else if ((value = MatchSpecKey(spec, "q"))) {
+            profile->depth = strtol(value, &end, 0);
+            valid = profile->depth >= 1 && profile->depth <= CONTROL_MAX_DEPTH;
+        } else if ((value = MatchSpecKey(spec, "c"))) {
+            profile->count = strtoll(value, &end, 0);
+            valid = profile->count > 0;
+        } else {
+            valid = FALSE;
+        }
+
+        if (end && (end == value || (*end != ',' && *end != '\0')))
+            valid = FALSE;
+
+        if (!valid) {
+            LOG_ERROR("invalid control entry '%s'\n", spec);
+            return -1;
+        }
+
+        spec = strchr(spec, ',');
+        if (!spec)
+            break;
+        spec++;
+    }
+
+    // GET_TEST is only harmless as a read; a write request has to be named explicitly.
+    if (!profile->isIn && !hasRequest) {
+        LOGERR0("control out needs a request, e.g. -O out,r=0x20\n");
+        return -1;
+    }
+
+    if (!hasLength)
+        profile->length = profile->isIn ? 1 : 0;
+
+    return 0;
+}
+
+static BOOL SubmitControlTransfer(PUVPERF_PARAM TestParams, PUVPERF_CONTROL_SLOT slot) {
+    PUVPERF_CONTROL_PROFILE profile = &TestParams->ControlProfile;
+    WINUSB_SETUP_PACKET Pkt;
+
+    Bench_VendorSetupPacket(&Pkt, profile->isIn, profile->request, profile->value,
+                            profile->index >= 0 ? (USHORT)profile->index : TestParams->intf,
+                            (USHORT)profile->length);
+
+    ResetEvent(slot->Overlapped.hEvent);
+    slot->CompletionTime = 0;
+    slot->SubmitTime = GetTimestampNs();
+    if (!K.ControlTransfer(TestParams->InterfaceHandle, Pkt, slot->Data, profile->length, NULL,
+                           &slot->Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+
+    return TRUE;
+}
+
+// Stamps the requests that have completed, called as soon as a wait returns. EP0 completes them in
+// order, so they are a run starting at head; the scan stops at the first one still in flight.
+static void StampControlCompletions(PUVPERF_CONTROL_SLOT slots, int depth, int head,
+                                    int inFlight) {
+    PUVPERF_CONTROL_SLOT slot;
+    LONGLONG now = GetTimestampNs();
+    int i;
+
+    for (i = 0; i < inFlight; i++) {
+        slot = &slots[(head + i) % depth];
+        if (!slot->CompletionTime) {
+            if (WaitForSingleObject(slot->Overlapped.hEvent, 0) != WAIT_OBJECT_0)
+                break;
+            slot->CompletionTime = now;
+        }
+    }
+}
+
+// Cancels the inFlight requests starting at head and waits for all of them, so their buffers can
+// be freed. AbortPipe does not apply to EP0, so the requests are cancelled on the device file
+// handle; when they still don't come back the device is reset. Returns FALSE if they never did.
+static BOOL AbortControlTransfers(PUVPERF_PARAM TestParams, PUVPERF_CONTROL_SLOT slots, int depth,
+                                  int head, int inFlight) {
+    HANDLE events[CONTROL_MAX_DEPTH];
+    HANDLE deviceHandle = NULL;
+    UINT size = sizeof(deviceHandle);
+    int i;
+
+    for (i = 0; i < inFlight; i++)
+        events[i] = slots[(head + i) % depth].Overlapped.hEvent;
+
+    // ERROR_NOT_FOUND: they all completed in the meantime.
+    if (K.GetProperty(TestParams->InterfaceHandle, KUSB_PROPERTY_DEVICE_FILE_HANDLE, &size,
+                      &deviceHandle) &&
+        (CancelIoEx(deviceHandle, NULL) || GetLastError() == ERROR_NOT_FOUND)) {
+        if (WaitForMultipleObjects(inFlight, events, TRUE, TestParams->timeout) == WAIT_OBJECT_0)
+            return TRUE;
+    } else {
+        LOG_WARNING("can not cancel the control requests, ec=%u\n", GetLastError());
+    }
+
+    LOGMSG0("resetting the device..\n");
+    if (!K.ResetDevice(TestParams->InterfaceHandle)) {
+        LOG_ERROR("failed resetting the device, ec=%u\n", GetLastError());
+        return FALSE;
+    }
+
+    return WaitForMultipleObjects(inFlight, events, TRUE, TestParams->timeout) == WAIT_OBJECT_0;
+}
+
+int RunControlBench(PUVPERF_PARAM TestParams) {
+    PUVPERF_CONTROL_PROFILE profile = &TestParams->ControlProfile;
+    PUVPERF_CONTROL_SLOT slots = NULL, slot;
+    PUVPERF_LATENCY_HISTOGRAM histogram = NULL;
+    LONGLONG count = profile->count;
+    LONGLONG submitted = 0, completed = 0, transferredTotal = 0;
+    LONGLONG runStartTime, completionTime, elapsed;
+    int inFlight = 0, head = 0;
+    int errorCount = 0, timeoutCount = 0, abortedCount = 0;
+    UINT transferred;
+    DWORD waitResult;
+    BOOL stop = FALSE;
+    int ret = -1;
+    int i, key;
+
+    if (!count)
+        count = TestParams->Timer ? LLONG_MAX : CONTROL_DEFAULT_COUNT;
+
+    slots = calloc(profile->depth, sizeof(UVPERF_CONTROL_SLOT));
+    histogram = calloc(1, sizeof(UVPERF_LATENCY_HISTOGRAM));
+    if (!slots || !histogram) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        goto Final;
+    }
+
+    for (i = 0; i < profile->depth; i++) {
+        slots[i].Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!slots[i].Overlapped.hEvent) {
+            LOGERR0("failed creating event!\n");
+            goto Final;
+        }
+        memset(slots[i].Data, 0xA5, sizeof(slots[i].Data));
+    }
+
+    LOG_MSG("EP0 control: vendor %s request 0x%02X (wValue 0x%04X, wIndex 0x%04X, wLength %d), "
+            "queue depth %d\n",
+            profile->isIn ? "in" : "out", profile->request, profile->value,
+            profile->index >= 0 ? profile->index : TestParams->intf, profile->length,
+            profile->depth);
+    LOGMSG0("Press 'Q' to abort\n");
+
+    runStartTime = GetTimestampNs();
+
+    while (completed < submitted || (!stop && submitted < count)) {
+        // EP0 completes requests in order, the oldest one is always next.
+        while (!stop && inFlight < profile->depth && submitted < count) {
+            slot = &slots[(head + inFlight) % profile->depth];
+            if (!SubmitControlTransfer(TestParams, slot)) {
+                LOG_ERROR("failed submitting control request, ec=%u\n", GetLastError());
+                errorCount++;
+                stop = TRUE;
+                break;
+            }
+            inFlight++;
+            submitted++;
+        }
+
+        if (!inFlight)
+            break;
+
+        slot = &slots[head];
+        if (slot->CompletionTime) {
+            waitResult = WAIT_OBJECT_0;
+        } else {
+            waitResult = WaitForSingleObject(slot->Overlapped.hEvent, TestParams->timeout);
+            if (waitResult == WAIT_OBJECT_0)
+                StampControlCompletions(slots, profile->depth, head, inFlight);
+        }
+        if (waitResult != WAIT_OBJECT_0) {
+            LOG_ERROR("Timeout on control request #%I64d\n", completed + 1);
+            timeoutCount++;
+
+            // Pull the queued requests back, their buffers are about to be freed.
+            if (!AbortControlTransfers(TestParams, slots, profile->depth, head, inFlight)) {
+                LOGERR0("control requests did not abort, leaking their buffers\n");
+                slots = NULL;
+                goto Final;
+            }
+
+            abortedCount = inFlight;
+            completed += inFlight;
+            inFlight = 0;
+            break;
+        }
+
+        completionTime = slot->CompletionTime ? slot->CompletionTime : GetTimestampNs();
+        if (K.GetOverlappedResult(TestParams->InterfaceHandle, &slot->Overlapped, &transferred,
+                                  FALSE)) {
+            RecordLatency(histogram, completionTime - slot->SubmitTime);
+            transferredTotal += transferred;
+        } else {
+            LOG_ERROR("control request #%I64d failed, ec=%u\n", completed + 1, GetLastError());
+            if (++errorCount > TestParams->retry)
+                stop = TRUE;
+        }
+
+        completed++;
+        inFlight--;
+        head = (head + 1) % profile->depth;
+
+        // Checked outside the timed window, and not on every request.
+        if ((completed & 0xFF) == 0) {
+            if (_kbhit()) {
+                key = _getch();
+                if (key == 'Q' || key == 'q') {
+                    LOG_VERBOSE("User Aborted\n");
+                    TestParams->isUserAborted = TRUE;
+                    TestParams->isCancelled = TRUE;
+                    stop = TRUE;
+                }
+            }
+            if (TestParams->Timer &&
+                completionTime - runStartTime >= TestParams->Timer * 1000000000LL)
+                stop = TRUE;
+        }
+    }
+
+    elapsed = GetTimestampNs() - runStartTime;
+
+    ShowLatencyHistogram("Control Transfer Latency", histogram);
+    if (elapsed > 0) {
+        LOG_MSG("\tTransactions/s :  %.1f\n", histogram->Count / (elapsed / 1000000000.0));
+        LOG_MSG("\tData Mbps/sec  :  %.3f\n",
+                transferredTotal * 8 / (elapsed / 1000000000.0) / 1000 / 1000);
+    }
+    LOG_MSG("\tErrors  :  %d, timeouts %d, aborted %d\n", errorCount, timeoutCount,
+            abortedCount);
+    LOG_MSG("\n");
+    ret = 0;
+
+Final:
+    if (slots) {
+        for (i = 0; i < profile->depth; i++) {
+            if (slots[i].Overlapped.hEvent)
+                CloseHandle(slots[i].Overlapped.hEvent);
+        }
+        free(slots);
+    }
+    free(histogram);
+    return ret;
+}
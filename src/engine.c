@@ -0,0 +1,204 @@
+#include <windows.h>
+
+#include "log.h"
+#include "k.h"
+#include "engine.h"
+#include "transfer_p.h"
+#include "usb_transfer.h"
+
+// Single-threaded event loop (-E). Instead of one TransferThread per endpoint, EngineThread keeps
+// every endpoint's ring full, sleeps once on all of their completions and then reaps everything
+// that finished in a single pass.
+
+static ULONGLONG FileTimeToULongLong(FILETIME *fileTime) {
+    return ((ULONGLONG)fileTime->dwHighDateTime << 32) | fileTime->dwLowDateTime;
+}
+
+static BOOL GetCpuTimes(ULONGLONG *kernelTime, ULONGLONG *userTime) {
+    FILETIME creationTime, exitTime, kernel, user;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernel, &user))
+        return FALSE;
+
+    *kernelTime = FileTimeToULongLong(&kernel);
+    *userTime = FileTimeToULongLong(&user);
+    return TRUE;
+}
+
+// Blocks until at least one transfer of any endpoint completes or msToWait elapses. A pipe
+// completes its transfers in submit order, so waiting on each endpoint's oldest in-flight handle
+// is enough, and every endpoint gets a slot however deep the rings are.
+static void EngineWait(PUVPERF_PARAM TestParams, DWORD msToWait) {
+    HANDLE waitEvents[MAX_TRANSFER_PARAMS];
+    DWORD waitCount = 0;
+    PUVPERF_TRANSFER_PARAM transferParam;
+    int i, j, handleIndex;
+
+    // libusb completions are delivered from its event handling, which polls every endpoint's
+    // file descriptors at once.
+    if (TestParams->Backend == BACKEND_LIBUSB) {
+        UsbHandleEvents(TestParams, msToWait);
+        return;
+    }
+
+    for (i = 0; i < TestParams->transferParamCount; i++) {
+        transferParam = TestParams->TransferParams[i];
+        if (!transferParam->isRunning)
+            continue;
+
+        handleIndex = transferParam->transferHandleWaitIndex;
+        for (j = 0; j < TestParams->bufferCount; j++) {
+            if (transferParam->TransferHandles[handleIndex].InUse) {
+                waitEvents[waitCount++] =
+                    transferParam->TransferHandles[handleIndex].Overlapped.hEvent;
+                break;
+            }
+            INC_ROLL(handleIndex, TestParams->bufferCount);
+        }
+    }
+
+    if (!waitCount) {
+        Sleep(msToWait);
+        return;
+    }
+
+    WaitForMultipleObjects(waitCount, waitEvents, FALSE, msToWait);
+}
+
+// Reaps every transfer of transferParam that has already completed and resubmits it. Returns the
+// number of completions, or -1 once the endpoint has to stop.
+static int EngineReap(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_TRANSFER_HANDLE handle;
+    int ret, reaped = 0;
+
+    do {
+        ret = TransferAsyncEx(transferParam, &handle, 0);
+        if (!handle && ret >= 0)
+            break;
+
+        if (!TransferComplete(transferParam, (handle && ret >= 0) ? handle->Data : NULL,
+                              ret))
+            return -1;
+
+        reaped++;
+    } while (!transferParam->TestParams->isCancelled);
+
+    return reaped;
+}
+
+DWORD EngineThread(PUVPERF_PARAM TestParams) {
+    DWORD lastCompletionTick[MAX_TRANSFER_PARAMS];
+    PUVPERF_TRANSFER_PARAM transferParam;
+    int i, reaped, runningCount;
+
+    for (i = 0; i < TestParams->transferParamCount; i++) {
+        TestParams->TransferParams[i]->isRunning = TRUE;
+        lastCompletionTick[i] = GetTickCount();
+    }
+
+    while (!TestParams->isCancelled) {
+        runningCount = 0;
+
+        for (i = 0; i < TestParams->transferParamCount; i++) {
+            transferParam = TestParams->TransferParams[i];
+            if (!transferParam->isRunning)
+                continue;
+
+            reaped = EngineReap(transferParam);
+            if (reaped > 0) {
+                lastCompletionTick[i] = GetTickCount();
+            } else if (!reaped &&
+                       GetTickCount() - lastCompletionTick[i] >= (DWORD)TestParams->timeout) {
+                // Nothing came back within the transfer timeout. Counted as a timeout directly,
+                // not as a failed transfer, and without adding an empty transfer to the stats.
+                if (TestParams->isUserAborted || !TransferTimedOut(transferParam))
+                    reaped = -1;
+                lastCompletionTick[i] = GetTickCount();
+            }
+
+            if (reaped < 0) {
+                CancelTransfers(transferParam);
+                transferParam->isRunning = FALSE;
+                continue;
+            }
+
+            runningCount++;
+        }
+
+        if (!runningCount)
+            break;
+
+        EngineWait(TestParams, ENGINE_WAIT_MS);
+        TestParams->EngineWakeups++;
+    }
+
+    for (i = 0; i < TestParams->transferParamCount; i++) {
+        transferParam = TestParams->TransferParams[i];
+        if (transferParam->isRunning) {
+            CancelTransfers(transferParam);
+            transferParam->isRunning = FALSE;
+        }
+    }
+
+    return 0;
+}
+
+void StartCpuUsage(PUVPERF_PARAM TestParams) {
+    if (!GetCpuTimes(&TestParams->StartKernelTime, &TestParams->StartUserTime)) {
+        TestParams->StartKernelTime = 0;
+        TestParams->StartUserTime = 0;
+    }
+}
+
+// Process CPU time (user + kernel) in seconds since StartCpuUsage.
+DOUBLE GetCpuSeconds(PUVPERF_PARAM TestParams) {
+    ULONGLONG kernelTime, userTime;
+
+    if (!GetCpuTimes(&kernelTime, &userTime))
+        return 0;
+
+    return ((kernelTime - TestParams->StartKernelTime) + (userTime - TestParams->StartUserTime)) /
+           10000000.0;
+}
+
+// Prints the process CPU time and the number of times the transfer thread(s) went to sleep and
+// were woken up again, both normalized per GB moved. Each wakeup costs a pair of context
+// switches, so transfers per wakeup shows how well completions are batched.
+void ShowCpuUsage(PUVPERF_PARAM TestParams) {
+    ULONGLONG kernelTime, userTime;
+    LONGLONG totalTransferred = 0, totalTransfers = 0, wakeups = 0;
+    DOUBLE cpuSeconds, gigaBytes;
+    int i;
+
+    if (!GetCpuTimes(&kernelTime, &userTime)) {
+        LOG_ERROR("GetProcessTimes failed. ErrorCode: %08Xh\n", GetLastError());
+        return;
+    }
+
+    kernelTime -= TestParams->StartKernelTime;
+    userTime -= TestParams->StartUserTime;
+    cpuSeconds = (kernelTime + userTime) / 10000000.0;
+
+    for (i = 0; i < TestParams->transferParamCount; i++) {
+        totalTransferred += TestParams->TransferParams[i]->Stats.TotalTransferred;
+        totalTransfers += TestParams->TransferParams[i]->Stats.Packets;
+        wakeups += TestParams->TransferParams[i]->Wakeups;
+    }
+    if (TestParams->useEventLoop)
+        wakeups = TestParams->EngineWakeups;
+
+    gigaBytes = totalTransferred / 1000.0 / 1000.0 / 1000.0;
+
+    LOG_MSG("CPU Usage (%s)\n",
+            TestParams->useEventLoop ? "event loop" : "thread per endpoint");
+    LOG_MSG("\tCPU Time        :  %.3f sec (user %.3f, kernel %.3f)\n", cpuSeconds,
+            userTime / 10000000.0, kernelTime / 10000000.0);
+    LOG_MSG("\tWakeups         :  %I64d\n", wakeups);
+    if (gigaBytes > 0) {
+        LOG_MSG("\tCPU Time / GB   :  %.3f sec\n", cpuSeconds / gigaBytes);
+        LOG_MSG("\tWakeups / GB    :  %.0f\n", wakeups / gigaBytes);
+    }
+    if (wakeups)
+        LOG_MSG("\tTransfers/Wakeup:  %.2f\n", (DOUBLE)totalTransfers / wakeups);
+    LOG_MSG("\n");
+}
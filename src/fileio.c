@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "fileio.h"
+#include "latency.h"
 
 void FileIOOpen(PUVPERF_PARAM TestParams) {
     time_t now = time(NULL);
@@ -24,6 +26,28 @@ void FileIOOpen(PUVPERF_PARAM TestParams) {
     }
 }
 
+// Opens ../log/uvperf_<name>_EpXX_<date>_<time>.<extension> for transferParam's endpoint, name
+// carries the extension (e.g. "frames.csv" for uvperf_frames_EpXX_<date>_<time>.csv). fileName
+// (MAX_PATH) receives the path. Returns NULL, after logging, when the file can't be opened.
+FILE *FileIOOpenEndpointFile(PUVPERF_TRANSFER_PARAM transferParam, const char *name,
+                             const char *mode, char *fileName) {
+    char timeString[32];
+    time_t now = time(NULL);
+    const char *extension = strrchr(name, '.');
+    FILE *file;
+
+    strftime(timeString, sizeof(timeString), "%Y%m%d_%H%M%S", localtime(&now));
+    snprintf(fileName, MAX_PATH, "../log/uvperf_%.*s_Ep%02X_%s%s",
+             (int)(extension ? extension - name : strlen(name)), name, transferParam->Ep.PipeId,
+             timeString, extension ? extension : "");
+
+    file = fopen(fileName, mode);
+    if (!file)
+        LOG_ERROR("failed opening %s\n", fileName);
+
+    return file;
+}
+
 void FileIOLog(PUVPERF_PARAM TestParams) {
     if (!TestParams->fileIO) {
         return;
@@ -35,6 +59,76 @@ void FileIOLog(PUVPERF_PARAM TestParams) {
     ShowParams(TestParams);
 }
 
+// Dumps the iso packet timeline of transferParam, oldest packet first, to
+// ../log/uvperf_iso_EpXX_<date>_<time>.bin
+void FileIOIsoTimeline(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM transferParam) {
+    UVPERF_ISO_TIMELINE_HEADER header;
+    char fileName[MAX_PATH];
+    LONGLONG first;
+    FILE *file;
+
+    if (!transferParam->IsoTimeline || !transferParam->isoTimelineCount)
+        return;
+
+    file = FileIOOpenEndpointFile(transferParam, "iso.bin", "wb", fileName);
+    if (!file)
+        return;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, "UVIT", sizeof(header.Magic));
+    header.Version = ISO_TIMELINE_VERSION;
+    header.RecordSize = sizeof(UVPERF_ISO_PACKET_RECORD);
+    header.PacketSize = transferParam->Ep.MaximumBytesPerInterval;
+    header.RecordCount = min(transferParam->isoTimelineCount, TestParams->isoTimelineSize);
+    header.DroppedCount = transferParam->isoTimelineCount - header.RecordCount;
+    header.StartTime = transferParam->Stats.StartTick;
+    header.PipeId = transferParam->Ep.PipeId;
+    fwrite(&header, sizeof(header), 1, file);
+
+    // Once the ring has wrapped, the oldest record is the next one to be overwritten.
+    first = transferParam->isoTimelineCount % TestParams->isoTimelineSize;
+    if (header.DroppedCount) {
+        fwrite(&transferParam->IsoTimeline[first], sizeof(UVPERF_ISO_PACKET_RECORD),
+               TestParams->isoTimelineSize - first, file);
+    }
+    fwrite(transferParam->IsoTimeline, sizeof(UVPERF_ISO_PACKET_RECORD),
+           header.DroppedCount ? first : header.RecordCount, file);
+
+    fclose(file);
+    LOG_MSG("Ep0x%02X: %I64d iso packets written to %s\n", transferParam->Ep.PipeId,
+            header.RecordCount, fileName);
+}
+
+// Writes the submit to completion latency histogram of transferParam as CSV, one row per
+// non-empty bucket, to ../log/uvperf_latency_EpXX_<date>_<time>.csv
+void FileIOLatency(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_LATENCY_HISTOGRAM latency = transferParam->Latency;
+    char fileName[MAX_PATH];
+    LONGLONG count = 0;
+    FILE *file;
+    int bucket;
+
+    if (!TestParams->fileIO || !latency || !latency->Count)
+        return;
+
+    file = FileIOOpenEndpointFile(transferParam, "latency.csv", "w", fileName);
+    if (!file)
+        return;
+
+    // Bucket upper bounds, so a row reads "count transfers took at most latency_ns".
+    fprintf(file, "latency_ns,count,percentile\n");
+    for (bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+        if (!latency->Buckets[bucket])
+            continue;
+        count += latency->Buckets[bucket];
+        fprintf(file, "%I64d,%I64d,%.4f\n", GetLatencyBucketValue(bucket),
+                latency->Buckets[bucket], count * 100.0 / latency->Count);
+    }
+
+    fclose(file);
+    LOG_MSG("Ep0x%02X: latency histogram written to %s\n", transferParam->Ep.PipeId, fileName);
+}
+
 void FileIOClose(PUVPERF_PARAM TestParams) {
     if (TestParams->fileIO) {
         // if (TestParams->BufferFile != INVALID_HANDLE_VALUE) {
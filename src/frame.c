@@ -0,0 +1,319 @@
+#include <windows.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "k.h"
+#include "frame.h"
+#include "latency.h"
+#include "timestamp.h"
+#include "transfer_p.h"
+#include "fileio.h"
+
+// Frame segmentation (-F SPEC). Every endpoint moves application sized frames (e.g. 16 MB video
+// frames) instead of single -l/-w transfers: each frame is split into -l/-w sized segments that
+// go through the async ring like any other transfer, so up to -b segments of one or several
+// frames are in flight at once. The frame is reassembled on the completion side; it is done once
+// all of its segments have been reaped and records its throughput from the first segment's
+// submission to the last segment's completion.
+//
+// SPEC is the frame size (K/M suffixes allowed), optionally followed by the zero length packet
+// policy for OUT frames:
+//   zlp=never         a frame ends with its last segment
+//   zlp=auto          frames that are a multiple of wMaxPacketSize end with a zero length packet,
+//                     otherwise the device can't tell where the frame ends (default)
+//   zlp=always        every frame ends with a zero length packet
+// An IN segment that comes back short (a short or zero length packet from the device) ends its
+// frame early and submission starts the next frame. Segments of the old frame that were already
+// in flight behind the short one hold data the device sent after the frame ended; they are
+// discarded rather than counted in either frame.
+// e.g. -F 16M or -F 1048576,zlp=always
+
+int ParseFrameSpec(PUVPERF_PARAM TestParams, const char *spec) {
+    const char *value;
+    char *end;
+    LONGLONG frameSize;
+
+    frameSize = strtol(spec, &end, 0);
+    if (*end == 'K' || *end == 'k') {
+        frameSize *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        frameSize *= 1024 * 1024;
+        end++;
+    }
+
+    if (end == spec || frameSize < 1 || frameSize > INT_MAX || (*end != ',' && *end != '\0')) {
+        LOG_ERROR("invalid frame size '%s'\n", spec);
+        return -1;
+    }
+
+    TestParams->frameSize = (int)frameSize;
+    TestParams->zlpPolicy = ZlpAuto;
+
+    if (*end == ',') {
+        value = end + 1;
+        if (!strcmp(value, "zlp=never")) {
+            TestParams->zlpPolicy = ZlpNever;
+        } else if (!strcmp(value, "zlp=auto")) {
+            TestParams->zlpPolicy = ZlpAuto;
+        } else if (!strcmp(value, "zlp=always")) {
+            TestParams->zlpPolicy = ZlpAlways;
+        } else {
+            LOG_ERROR("invalid frame entry '%s'\n", value);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int CreateFrame(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_PARAM TestParams = transferParam->TestParams;
+    PUVPERF_FRAME frame;
+    char fileName[MAX_PATH];
+
+    if (!HasVariableTransferLength(transferParam)) {
+        LOG_WARNING("Ep0x%02X is isochronous, running without frames\n", transferParam->Ep.PipeId);
+        return 0;
+    }
+
+    frame = calloc(1, sizeof(UVPERF_FRAME));
+    if (!frame) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+    transferParam->Frame = frame;
+
+    frame->FrameSize = TestParams->frameSize;
+    frame->SegmentSize = GetTransferLength(transferParam);
+    frame->AppendZlp =
+        USB_ENDPOINT_DIRECTION_OUT(transferParam->Ep.PipeId) &&
+        (TestParams->zlpPolicy == ZlpAlways ||
+         (TestParams->zlpPolicy == ZlpAuto && transferParam->Ep.MaximumPacketSize &&
+          !(frame->FrameSize % transferParam->Ep.MaximumPacketSize)));
+    frame->SubmitSequence = 1; // 0 marks a handle that carries no segment
+    frame->MinFrameBps = -1;
+
+    if (frame->SegmentSize < 1) {
+        LOG_ERROR("Ep0x%02X: frames need a %s length\n", transferParam->Ep.PipeId,
+                  TRANSFER_DISPLAY(transferParam, "read", "write"));
+        return -1;
+    }
+
+    // Every in-flight segment can belong to a different frame, plus the one being submitted.
+    frame->slotCount = TestParams->bufferCount + 1;
+    frame->Records = calloc(frame->slotCount, sizeof(UVPERF_FRAME_RECORD));
+    frame->FrameTime = calloc(1, sizeof(UVPERF_LATENCY_HISTOGRAM));
+    if (!frame->Records || !frame->FrameTime) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+
+    if (TestParams->fileIO) {
+        frame->FrameFile = FileIOOpenEndpointFile(transferParam, "frames.csv", "w", fileName);
+        if (frame->FrameFile)
+            fprintf(frame->FrameFile, "frame,start_ns,segments,bytes,duration_us,mbps,status\n");
+    }
+
+    return 0;
+}
+
+void FreeFrame(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_FRAME frame = transferParam->Frame;
+
+    if (!frame)
+        return;
+
+    if (frame->FrameFile)
+        fclose(frame->FrameFile);
+    free(frame->FrameTime);
+    free(frame->Records);
+    free(frame);
+    transferParam->Frame = NULL;
+}
+
+static void NextSubmitFrame(PUVPERF_FRAME frame) {
+    frame->SubmitSequence++;
+    frame->SubmitOffset = 0;
+    frame->ZlpPending = FALSE;
+}
+
+// Returns the length of the next segment and assigns it to handle, 0 for a zero length packet.
+// Returns -1 while the frame record it would start is still owned by an older frame; submission
+// has to wait for a completion then.
+int NextFrameSegment(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle) {
+    PUVPERF_FRAME frame = transferParam->Frame;
+    PUVPERF_FRAME_RECORD record = &frame->Records[frame->SubmitSequence % frame->slotCount];
+    int length;
+
+    // The device ended the frame early, or one of its segments failed.
+    if (frame->SubmitOffset && record->Closed) {
+        NextSubmitFrame(frame);
+        record = &frame->Records[frame->SubmitSequence % frame->slotCount];
+    }
+
+    if (!frame->SubmitOffset) {
+        if (record->InUse)
+            return -1;
+
+        memset(record, 0, sizeof(*record));
+        record->Sequence = frame->SubmitSequence;
+        record->StartTime = GetTimestampNs();
+        record->InUse = TRUE;
+    }
+
+    if (frame->ZlpPending) {
+        length = 0;
+        frame->ZlpPending = FALSE;
+        record->Closed = TRUE;
+    } else {
+        length = min(frame->SegmentSize, frame->FrameSize - frame->SubmitOffset);
+        frame->SubmitOffset += length;
+        if (frame->SubmitOffset == frame->FrameSize) {
+            if (frame->AppendZlp)
+                frame->ZlpPending = TRUE;
+            else
+                record->Closed = TRUE;
+        }
+    }
+
+    handle->FrameSequence = record->Sequence;
+    handle->FrameSegment = record->Submitted++;
+
+    if (record->Closed)
+        NextSubmitFrame(frame);
+
+    return length;
+}
+
+// endTime is used when no segment of the frame was counted, e.g. a failed or flushed frame.
+static void FinishFrame(PUVPERF_FRAME frame, PUVPERF_FRAME_RECORD record, LONGLONG endTime) {
+    LONGLONG duration;
+    DOUBLE bps = 0;
+
+    record->InUse = FALSE;
+
+    if (record->EndTime)
+        endTime = record->EndTime;
+    duration = endTime - record->StartTime;
+
+    if (record->Failed) {
+        frame->FailedCount++;
+    } else if (duration > 0) {
+        bps = record->Transferred / (duration / 1000000000.0);
+        if (frame->MinFrameBps < 0 || bps < frame->MinFrameBps)
+            frame->MinFrameBps = bps;
+        if (bps > frame->MaxFrameBps)
+            frame->MaxFrameBps = bps;
+        frame->FrameBpsSum += bps;
+        RecordLatency(frame->FrameTime, duration);
+        frame->FrameCount++;
+        if (record->Terminated)
+            frame->TerminatedCount++;
+    }
+
+    if (frame->FrameFile) {
+        fprintf(frame->FrameFile, "%I64d,%I64d,%d,%I64d,%.1f,%.3f,%s\n", record->Sequence,
+                record->StartTime, record->Submitted, record->Transferred, duration / 1000.0,
+                bps * 8 / 1000 / 1000,
+                record->Failed ? "failed" : record->Terminated ? "short" : "ok");
+    }
+}
+
+// Accounts a reaped segment (ret < 0 when it failed) against its frame.
+void FrameSegmentDone(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle,
+                      int ret) {
+    PUVPERF_FRAME frame = transferParam->Frame;
+    PUVPERF_FRAME_RECORD record;
+
+    if (!frame || !handle->FrameSequence)
+        return;
+
+    record = &frame->Records[handle->FrameSequence % frame->slotCount];
+    if (!record->InUse || record->Sequence != handle->FrameSequence) {
+        handle->FrameSequence = 0;
+        return;
+    }
+    handle->FrameSequence = 0;
+
+    record->Completed++;
+    if (record->Terminated && handle->FrameSegment > record->LastSegment) {
+        // Submitted behind the short segment that ended the frame.
+        frame->DiscardedSegments++;
+        if (ret > 0)
+            frame->DiscardedBytes += ret;
+    } else if (ret < 0) {
+        record->Failed = TRUE;
+        record->Closed = TRUE;
+    } else {
+        record->Transferred += ret;
+        if (handle->CompletionTime > record->EndTime)
+            record->EndTime = handle->CompletionTime;
+        if (USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId) && ret < handle->DataMaxLength &&
+            !record->Closed) {
+            record->Terminated = TRUE;
+            record->Closed = TRUE;
+            record->LastSegment = handle->FrameSegment;
+        }
+    }
+
+    if (record->Closed && record->Completed == record->Submitted)
+        FinishFrame(frame, record, GetTimestampNs());
+}
+
+// Drops every frame still in flight after CancelTransfers or AbortTransfers; submission restarts
+// with a new frame.
+void FlushFrames(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_FRAME frame = transferParam->Frame;
+    int i;
+
+    if (!frame)
+        return;
+
+    for (i = 0; i < frame->slotCount; i++) {
+        if (frame->Records[i].InUse) {
+            frame->Records[i].Failed = TRUE;
+            FinishFrame(frame, &frame->Records[i], GetTimestampNs());
+        }
+    }
+
+    for (i = 0; i < transferParam->TestParams->bufferCount; i++)
+        transferParam->TransferHandles[i].FrameSequence = 0;
+
+    if (frame->SubmitOffset || frame->ZlpPending)
+        NextSubmitFrame(frame);
+}
+
+void ShowFrames(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_FRAME frame = transferParam->Frame;
+    PUVPERF_LATENCY_HISTOGRAM frameTime;
+
+    if (!frame)
+        return;
+
+    LOG_MSG("\tFrames %I64d of %d bytes in %d byte segments%s\n", frame->FrameCount,
+            frame->FrameSize, frame->SegmentSize,
+            frame->AppendZlp ? ", zero length packet appended" : "");
+    if (frame->TerminatedCount || frame->FailedCount) {
+        LOG_MSG("\tFrames ended short %I64d, failed %I64d\n", frame->TerminatedCount,
+                frame->FailedCount);
+    }
+    if (frame->DiscardedSegments) {
+        LOG_MSG("\tSegments discarded after a short frame %I64d (%I64d bytes)\n",
+                frame->DiscardedSegments, frame->DiscardedBytes);
+    }
+
+    if (!frame->FrameCount)
+        return;
+
+    frameTime = frame->FrameTime;
+    LOG_MSG("\tFrame Mbps/sec (min/avg/max) %.2f/%.2f/%.2f\n", frame->MinFrameBps * 8 / 1000 / 1000,
+            frame->FrameBpsSum / frame->FrameCount * 8 / 1000 / 1000,
+            frame->MaxFrameBps * 8 / 1000 / 1000);
+    LOG_MSG("\tFrame time us (min/p50/p99/max) %.1f/%.1f/%.1f/%.1f\n", frameTime->Min / 1000.0,
+            GetLatencyPercentile(frameTime, 50.0) / 1000.0,
+            GetLatencyPercentile(frameTime, 99.0) / 1000.0, frameTime->Max / 1000.0);
+}
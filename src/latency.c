@@ -0,0 +1,226 @@
+#include <windows.h>
+#include <conio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "k.h"
+#include "latency.h"
+#include "transfer_p.h"
+#include "timestamp.h"
+
+// Latency histograms, used for the per-transfer submit to completion latency of every endpoint
+// and by the round trip latency mode (-P COUNT).
+//
+// Round trip mode writes writelength bytes to the OUT pipe, reads the echo back from the IN pipe
+// and records the time from the write submit to the read completion. Only one transfer is in
+// flight at any time, either synchronously (-m0) or through the async ring with a queue depth of
+// one (-m1).
+
+static int GetLatencyBucket(LONGLONG latency) {
+    int shift = 0;
+
+    // The top bit above the sub-bucket range selects the power of two, the next
+    // LATENCY_SUB_BUCKET_BITS bits the sub-bucket within it.
+    while ((latency >> shift) >= 2 * LATENCY_SUB_BUCKET_COUNT)
+        shift++;
+
+    if (latency < LATENCY_SUB_BUCKET_COUNT)
+        return (int)latency;
+
+    return (shift + 1) * LATENCY_SUB_BUCKET_COUNT +
+           (int)((latency >> shift) - LATENCY_SUB_BUCKET_COUNT);
+}
+
+// Highest latency counted in bucket.
+LONGLONG GetLatencyBucketValue(int bucket) {
+    int shift = bucket / LATENCY_SUB_BUCKET_COUNT - 1;
+    LONGLONG subBucket = bucket % LATENCY_SUB_BUCKET_COUNT;
+
+    if (shift < 0)
+        return subBucket;
+
+    return ((LATENCY_SUB_BUCKET_COUNT + subBucket + 1) << shift) - 1;
+}
+
+void ResetLatencyHistogram(PUVPERF_LATENCY_HISTOGRAM histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void RecordLatency(PUVPERF_LATENCY_HISTOGRAM histogram, LONGLONG latency) {
+    if (latency < 0)
+        latency = 0;
+    if (latency >= (1LL << LATENCY_MAX_BITS))
+        latency = (1LL << LATENCY_MAX_BITS) - 1;
+
+    if (!histogram->Count || latency < histogram->Min)
+        histogram->Min = latency;
+    if (latency > histogram->Max)
+        histogram->Max = latency;
+
+    histogram->Buckets[GetLatencyBucket(latency)]++;
+    histogram->Sum += latency;
+    histogram->Count++;
+}
+
+// Returns the latency (ns) below which percentile percent of the samples fall, rounded up to the
+// bucket resolution and never beyond the largest sample.
+LONGLONG GetLatencyPercentile(PUVPERF_LATENCY_HISTOGRAM histogram, DOUBLE percentile) {
+    LONGLONG rank, count = 0;
+    int bucket;
+
+    if (!histogram->Count)
+        return 0;
+
+    rank = (LONGLONG)(histogram->Count * percentile / 100.0 + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+        count += histogram->Buckets[bucket];
+        if (count >= rank)
+            return min(GetLatencyBucketValue(bucket), histogram->Max);
+    }
+
+    return histogram->Max;
+}
+
+void ShowLatencyHistogram(const char *name, PUVPERF_LATENCY_HISTOGRAM histogram) {
+    if (!histogram->Count) {
+        LOG_MSG("%s: no samples\n", name);
+        return;
+    }
+
+    LOG_MSG("%s (%I64d samples, us)\n", name, histogram->Count);
+    LOG_MSG("\tMin     :  %.3f\n", histogram->Min / 1000.0);
+    LOG_MSG("\tAverage :  %.3f\n", histogram->Sum / histogram->Count / 1000.0);
+    LOG_MSG("\tp50     :  %.3f\n", GetLatencyPercentile(histogram, 50.0) / 1000.0);
+    LOG_MSG("\tp99     :  %.3f\n", GetLatencyPercentile(histogram, 99.0) / 1000.0);
+    LOG_MSG("\tp99.9   :  %.3f\n", GetLatencyPercentile(histogram, 99.9) / 1000.0);
+    LOG_MSG("\tMax     :  %.3f\n", histogram->Max / 1000.0);
+}
+
+// One transfer on transferParam; *data points at the bytes that were sent or received.
+static int PingPongTransfer(PUVPERF_TRANSFER_PARAM transferParam, PUCHAR *data) {
+    PUVPERF_TRANSFER_HANDLE handle;
+    int ret;
+
+    if (transferParam->TestParams->TransferMode == TRANSFER_MODE_SYNC) {
+        *data = transferParam->TransferHandles[0].Data;
+        return TransferSync(transferParam);
+    }
+
+    ret = TransferAsync(transferParam, &handle);
+    *data = handle ? handle->Data : NULL;
+    return ret;
+}
+
+int RunPingPong(PUVPERF_PARAM TestParams) {
+    PUVPERF_TRANSFER_PARAM transferParams[MAX_TRANSFER_PARAMS];
+    PUVPERF_TRANSFER_PARAM inTest = NULL, outTest = NULL;
+    PUVPERF_LATENCY_HISTOGRAM histogram = NULL;
+    PUCHAR outData, inData;
+    LONGLONG startTime, endTime, runStartTime;
+    LONGLONG mismatchCount = 0;
+    int transferParamCount;
+    int outRet, inRet;
+    int ret = -1;
+    int i, key;
+
+    // Every round trip waits for its own echo, so there is never more than one transfer per
+    // direction to queue.
+    TestParams->bufferCount = 1;
+    TestParams->TestType = TestTypeLoop;
+
+    transferParamCount = CreateTransferParams(TestParams, transferParams);
+    if (transferParamCount <= 0)
+        return -1;
+
+    for (i = 0; i < transferParamCount; i++) {
+        if (!inTest && USB_ENDPOINT_DIRECTION_IN(transferParams[i]->Ep.PipeId))
+            inTest = transferParams[i];
+        if (!outTest && USB_ENDPOINT_DIRECTION_OUT(transferParams[i]->Ep.PipeId))
+            outTest = transferParams[i];
+    }
+
+    if (!inTest || !outTest) {
+        LOGERR0("Round trip latency needs an IN and an OUT endpoint\n");
+        goto Final;
+    }
+    if (inTest->Ep.PipeType == UsbdPipeTypeIsochronous ||
+        outTest->Ep.PipeType == UsbdPipeTypeIsochronous) {
+        LOGERR0("Round trip latency needs bulk or interrupt endpoints\n");
+        goto Final;
+    }
+
+    histogram = malloc(sizeof(*histogram));
+    if (!histogram) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        goto Final;
+    }
+    ResetLatencyHistogram(histogram);
+
+    LOG_MSG("Round trip latency: %d x %d bytes, Ep0x%02X -> Ep0x%02X, %s\n",
+            TestParams->pingPongCount, TestParams->writelength, outTest->Ep.PipeId,
+            inTest->Ep.PipeId,
+            TestParams->TransferMode == TRANSFER_MODE_SYNC ? "sync" : "async");
+    LOGMSG0("Press 'Q' to abort\n");
+
+    outTest->isRunning = inTest->isRunning = TRUE;
+    runStartTime = GetTimestampNs();
+
+    for (i = 0; i < TestParams->pingPongCount && !TestParams->isCancelled; i++) {
+        inRet = 0;
+        inData = NULL;
+
+        startTime = GetTimestampNs();
+        outRet = PingPongTransfer(outTest, &outData);
+        if (outRet >= 0)
+            inRet = PingPongTransfer(inTest, &inData);
+        endTime = GetTimestampNs();
+
+        if (!TransferComplete(outTest, outData, outRet))
+            break;
+        if (outRet >= 0 && !TransferComplete(inTest, inData, inRet))
+            break;
+
+        if (outRet >= 0 && inRet >= 0) {
+            RecordLatency(histogram, endTime - startTime);
+            if (inRet != outRet || (inData && outData && memcmp(inData, outData, inRet)))
+                mismatchCount++;
+        }
+
+        // Checked outside the timed window, and not on every round trip.
+        if ((i & 0xFF) == 0xFF) {
+            if (_kbhit()) {
+                key = _getch();
+                if (key == 'Q' || key == 'q') {
+                    LOG_VERBOSE("User Aborted\n");
+                    TestParams->isUserAborted = TRUE;
+                    TestParams->isCancelled = TRUE;
+                }
+            }
+            if (TestParams->Timer &&
+                endTime - runStartTime >= TestParams->Timer * 1000000000LL)
+                break;
+        }
+    }
+
+    CancelTransfers(outTest);
+    CancelTransfers(inTest);
+    outTest->isRunning = inTest->isRunning = FALSE;
+
+    ShowLatencyHistogram("Round Trip Latency", histogram);
+    LOG_MSG("\tErrors  :  %d, timeouts %d\n",
+            outTest->Stats.TotalErrorCount + inTest->Stats.TotalErrorCount,
+            outTest->Stats.TotalTimeoutCount + inTest->Stats.TotalTimeoutCount);
+    LOG_MSG("\tEcho mismatches :  %I64d\n", mismatchCount);
+    LOG_MSG("\n");
+    ret = 0;
+
+Final:
+    free(histogram);
+    for (i = 0; i < transferParamCount; i++)
+        FreeTransferParam(&transferParams[i]);
+    return ret;
+}
@@ -7,22 +7,42 @@ void ShowUsage() {
     LOG_MSG("Version : V1.1.1\n");
     LOG_MSG("\n");
     LOG_MSG(
-        "Usage: uvperf -v VID -p PID -i INTERFACE -a AltInterface -e ENDPOINT -m TRANSFERMODE "
-        "-T TIMER -t TIMEOUT -f FileIO -b BUFFERCOUNT-l READLENGTH -w WRITELENGTH -r REPEAT -S \n");
+        "Usage: uvperf -v VID -p PID -i INTERFACE -a AltInterface -e ENDPOINT -A -m TRANSFERMODE "
+        "-T TIMER -t TIMEOUT -f FileIO -b BUFFERCOUNT-l READLENGTH -w WRITELENGTH -r REPEAT -S -u "
+        "-E -H -I RECORDS -o PERCENT -s SPEC -x FILE -P COUNT -B MBPS -G PROFILE -C CPUS "
+        "-Y SCHED -M CPU -J EVERY -F FRAME -K -O SPEC\n");
     LOG_MSG("\t-v VID           USB Vendor ID\n");
     LOG_MSG("\t-p PID           USB Product ID\n");
     LOG_MSG("\t-i INTERFACE     USB Interface\n");
     LOG_MSG("\t-a AltInterface  USB Alternate Interface\n");
-    LOG_MSG("\t-e ENDPOINT      USB Endpoint\n");
-    LOG_MSG("\t-m TRANSFER      0 = isochronous, 1 = bulk\n");
+    LOG_MSG("\t-e ENDPOINT      USB Endpoint, repeat to run several endpoints at once\n");
+    LOG_MSG("\t-A               Run every bulk/iso endpoint of the device's interfaces at once\n");
+    LOG_MSG("\t-m TRANSFER      0 = sync, 1 = async (-b > 1, -E and iso force async)\n");
     LOG_MSG("\t-T TIMER         Timer in seconds\n");
     LOG_MSG("\t-t TIMEOUT       USB Transfer Timeout\n");
     LOG_MSG("\t-f FileIO        Use file I/O, default : FALSE\n");
-    LOG_MSG("\t-b BUFFERCOUNT   Number of buffers to use\n");
+    LOG_MSG("\t-b BUFFERCOUNT   Number of outstanding transfers (queue depth)\n");
     LOG_MSG("\t-l READLENGTH    Length of read transfers\n");
     LOG_MSG("\t-w WRITELENGTH   Length of write transfers\n");
     LOG_MSG("\t-r REPEAT        Number of transfers to perform\n");
     LOG_MSG("\t-S               Show transfer data, default : FALSE\n");
+    LOG_MSG("\t-u               Run pipe I/O through libusb-1.0, default : libusbK\n");
+    LOG_MSG("\t-E               Service all endpoints from one event loop thread\n");
+    LOG_MSG("\t-H               Back the transfer buffer pool with large pages\n");
+    LOG_MSG("\t-I RECORDS       Record the last RECORDS iso packets to ../log/uvperf_iso_*.bin\n");
+    LOG_MSG("\t-o PERCENT       Tune -b/-l/-w, report the smallest setting within PERCENT of peak\n");
+    LOG_MSG("\t-s SPEC          Sweep alt setting/mode/-b/-l, e.g. a=0-2,m=0/1,b=1-32,l=4096-65536\n");
+    LOG_MSG("\t-x FILE          Sweep results file, .json for JSON, CSV otherwise\n");
+    LOG_MSG("\t-P COUNT         Measure COUNT OUT -> IN echo round trips, reports latency percentiles\n");
+    LOG_MSG("\t-B MBPS          Pace every endpoint's submissions to MBPS with a token bucket\n");
+    LOG_MSG("\t-G PROFILE       Bursty workload, e.g. onoff,n=32,off=50 or poisson,r=200,seed=7\n");
+    LOG_MSG("\t-C CPUS          Pin transfer thread i to the i-th CPU of CPUS, e.g. 2,3 or 4-7\n");
+    LOG_MSG("\t-Y SCHED         normal, high or rt (realtime, needs administrator)\n");
+    LOG_MSG("\t-M CPU           Pin the display/main thread to CPU\n");
+    LOG_MSG("\t-J EVERY         Halt the endpoint after every EVERY-th transfer\n");
+    LOG_MSG("\t-F FRAME         Move FRAME sized frames in -l/-w segments, e.g. 16M,zlp=auto\n");
+    LOG_MSG("\t-K               Measure interrupt IN polling against bInterval\n");
+    LOG_MSG("\t-O SPEC          EP0 vendor request benchmark, e.g. in,n=1 or out,r=0x20,q=8\n");
     LOG_MSG("\n");
     LOG_MSG("Example:\n");
     LOG_MSG("uvperf -v 0x1004 -p 0xa000 -i 0 -a 0 -e 0x81 -m 0 -t 1000 -l 1024 -r 1000 -R\n");
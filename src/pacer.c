@@ -0,0 +1,120 @@
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "pacer.h"
+#include "latency.h"
+#include "timestamp.h"
+
+// Rate paced transfers (-B MBPS). Before every submission, each transfer of the async ring
+// included, the transfer thread takes its length out of a token bucket that refills at the
+// target rate. When the bucket is short the
+// thread sleeps on a waitable timer until just before the release time and busy waits the rest,
+// so the release is not bound to the Sleep granularity.
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+// burstBytes caps how far the bucket may fill up, i.e. how much a late thread may catch up in
+// one go. Returns 0 or -1.
+int InitPacer(PUVPERF_PACER pacer, DOUBLE bytesPerSec, int burstBytes) {
+    memset(pacer, 0, sizeof(*pacer));
+
+    pacer->BytesPerNs = bytesPerSec / 1000000000.0;
+    pacer->BurstBytes = burstBytes;
+
+    pacer->Error = calloc(1, sizeof(UVPERF_LATENCY_HISTOGRAM));
+    if (!pacer->Error) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+
+    // High resolution timers need Windows 10 1803 or later.
+    pacer->Timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                          TIMER_ALL_ACCESS);
+    pacer->SpinNs = PACER_SPIN_NS;
+    if (!pacer->Timer) {
+        pacer->Timer = CreateWaitableTimer(NULL, TRUE, NULL);
+        pacer->SpinNs = PACER_COARSE_SPIN_NS;
+    }
+
+    return 0;
+}
+
+void FreePacer(PUVPERF_PACER pacer) {
+    if (pacer->Timer) {
+        CloseHandle(pacer->Timer);
+        pacer->Timer = NULL;
+    }
+    free(pacer->Error);
+    pacer->Error = NULL;
+}
+
+static void PacerRefill(PUVPERF_PACER pacer, LONGLONG now) {
+    pacer->Tokens += (now - pacer->LastRefill) * pacer->BytesPerNs;
+    if (pacer->Tokens > pacer->BurstBytes)
+        pacer->Tokens = pacer->BurstBytes;
+    pacer->LastRefill = now;
+}
+
+// Sleeps on the pacer's timer until SpinNs before releaseTime and busy waits the rest. Returns the
+// time of the release, or 0 when the test was cancelled while waiting.
+LONGLONG PacerSleepUntil(PUVPERF_PACER pacer, PUVPERF_PARAM TestParams, LONGLONG releaseTime) {
+    LONGLONG now, remaining;
+    LARGE_INTEGER dueTime;
+
+    while ((remaining = releaseTime - GetTimestampNs()) > pacer->SpinNs) {
+        if (TestParams->isCancelled)
+            return 0;
+
+        // Relative due time in 100ns units.
+        remaining = min(remaining - pacer->SpinNs, PACER_MAX_WAIT_MS * 1000000LL);
+        dueTime.QuadPart = -(remaining / 100);
+        if (!pacer->Timer || !SetWaitableTimer(pacer->Timer, &dueTime, 0, NULL, NULL, FALSE))
+            break;
+        WaitForSingleObject(pacer->Timer, INFINITE);
+    }
+
+    while ((now = GetTimestampNs()) < releaseTime)
+        YieldProcessor();
+
+    return now;
+}
+
+// Waits until bytes may be submitted on transferParam and takes them from the bucket. Returns
+// FALSE when the test was cancelled while waiting.
+BOOL PacerWait(PUVPERF_TRANSFER_PARAM transferParam, int bytes) {
+    PUVPERF_PACER pacer = &transferParam->Pacer;
+    LONGLONG now = GetTimestampNs();
+    LONGLONG releaseTime;
+
+    // The first transfer goes out immediately and starts the schedule.
+    if (!pacer->LastRefill) {
+        pacer->LastRefill = now;
+        pacer->Tokens = bytes;
+    }
+
+    PacerRefill(pacer, now);
+
+    if (pacer->Tokens >= bytes) {
+        if (pacer->Tokens >= pacer->BurstBytes)
+            pacer->BehindCount++;
+        pacer->Tokens -= bytes;
+        return TRUE;
+    }
+
+    releaseTime = now + (LONGLONG)((bytes - pacer->Tokens) / pacer->BytesPerNs);
+
+    now = PacerSleepUntil(pacer, transferParam->TestParams, releaseTime);
+    if (!now)
+        return FALSE;
+
+    RecordLatency(pacer->Error, now - releaseTime);
+    pacer->PacedCount++;
+
+    PacerRefill(pacer, now);
+    pacer->Tokens -= bytes;
+    return TRUE;
+}
@@ -1,7 +1,14 @@
+#include <string.h>
+
 #include "log.h"
 #include "param.h"
+#include "timestamp.h"
 
 void ShowParams(PUVPERF_PARAM TestParams) {
+    char cpuList[MAX_TRANSFER_PARAMS * 4 + 1];
+    size_t length;
+    int i;
+
     if (!TestParams)
         return;
 
@@ -11,15 +18,55 @@ void ShowParams(PUVPERF_PARAM TestParams) {
     LOG_MSG("\tInterface:     :  %d\n", TestParams->intf);
     LOG_MSG("\tAlt Interface: :  %d\n", TestParams->altf);
     LOG_MSG("\tEndpoint:      :  0x%02X\n", TestParams->endpoint);
-    LOG_MSG("\tTransfer mode  :  %s\n", TestParams->TransferMode ? "Isochronous" : "Bulk");
+    LOG_MSG("\tTransfer mode  :  %s\n",
+            TestParams->TransferMode == TRANSFER_MODE_ASYNC ? "Asynchronous" : "Synchronous");
+    LOG_MSG("\tBackend        :  %s\n",
+            TestParams->Backend == BACKEND_LIBUSB ? "libusb-1.0" : "libusbK");
     LOG_MSG("\tTimeout:       :  %d\n", TestParams->timeout);
     LOG_MSG("\tRead Length:   :  %d\n", TestParams->readlenth);
     LOG_MSG("\tWrite Length:  :  %d\n", TestParams->writelength);
     LOG_MSG("\tRepeat:        :  %d\n", TestParams->repeat);
+    LOG_MSG("\tScheduling     :  %s (priority class 0x%X, thread priority %d)\n",
+            TestParams->scheduling == SchedulingRealtime ? "realtime"
+            : TestParams->scheduling == SchedulingHigh   ? "high"
+                                                         : "normal",
+            TestParams->priorityClass, TestParams->priority);
+    strcpy(cpuList, TestParams->cpuCount ? "" : "any");
+    for (i = 0; i < TestParams->cpuCount; i++) {
+        length = strlen(cpuList);
+        snprintf(cpuList + length, sizeof(cpuList) - length, i ? ",%d" : "%d",
+                 TestParams->cpus[i]);
+    }
+    LOG_MSG("\tTransfer CPUs  :  %s\n", cpuList);
+    if (TestParams->displayCpu >= 0)
+        LOG_MSG("\tDisplay CPU    :  %d\n", TestParams->displayCpu);
+    else
+        LOG_MSG("\tDisplay CPU    :  any\n");
+    if (TimestampClock.Source == ClockSourceTsc) {
+        LOG_MSG("\tClock source   :  TSC %.3f MHz (calibration %.1f ppm, %I64d ns per read)\n",
+                TimestampClock.TscHz / 1000000.0, TimestampClock.CalibrationPpm,
+                TimestampClock.ReadCostNs);
+    } else {
+        LOG_MSG("\tClock source   :  CLOCK_MONOTONIC (%s, %I64d ns per read)\n",
+                !TimestampClock.InvariantTsc ? "no invariant TSC"
+                : TimestampClock.TscHz       ? "TSC calibration unstable"
+                                             : "TSC calibration failed",
+                TimestampClock.ReadCostNs);
+    }
     LOG_MSG("\n");
 }
  
 
+// Returns the value of a "key=value" entry of a comma separated option spec (-G, -O), or NULL
+// when entry is not key.
+const char *MatchSpecKey(const char *entry, const char *key) {
+    size_t keyLength = strlen(key);
+
+    if (strncmp(entry, key, keyLength) || entry[keyLength] != '=')
+        return NULL;
+    return entry + keyLength + 1;
+}
+
 int GetDeviceParam(PUVPERF_PARAM TestParams) {
     char id[MAX_PATH];
     KLST_DEVINFO_HANDLE deviceInfo = NULL;
@@ -76,6 +123,59 @@ void SetParamsDefaults(PUVPERF_PARAM TestParms) {
     TestParms->bufferCount = 1;
     TestParms->ShowTransfer = FALSE;
     TestParms->UseRawIO = 0xFF;
+    TestParms->Backend = BACKEND_LIBUSBK;
+    TestParms->displayCpu = -1;
+}
+
+// Moves the process to the -Y priority class and pins the calling (display) thread to -M CPU.
+// Without the increase base priority privilege Windows quietly grants HIGH_PRIORITY_CLASS for
+// REALTIME_PRIORITY_CLASS, so the class actually granted is read back for ShowParams.
+int SetProcessPlacement(PUVPERF_PARAM TestParams) {
+    static const DWORD priorityClasses[] = {NORMAL_PRIORITY_CLASS, HIGH_PRIORITY_CLASS,
+                                            REALTIME_PRIORITY_CLASS};
+    static const int threadPriorities[] = {THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_HIGHEST,
+                                           THREAD_PRIORITY_TIME_CRITICAL};
+    DWORD_PTR processMask, systemMask;
+    int i;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        LOG_ERROR("failed getting process affinity ec=%u\n", GetLastError());
+        return -1;
+    }
+    for (i = 0; i < TestParams->cpuCount; i++) {
+        if (!(processMask & ((DWORD_PTR)1 << TestParams->cpus[i]))) {
+            LOG_ERROR("CPU %d is not available to this process\n", TestParams->cpus[i]);
+            return -1;
+        }
+        if (TestParams->cpus[i] == TestParams->displayCpu)
+            LOG_WARNING("CPU %d runs both a transfer thread and the display\n",
+                        TestParams->displayCpu);
+    }
+    if (TestParams->displayCpu >= 0 &&
+        !(processMask & ((DWORD_PTR)1 << TestParams->displayCpu))) {
+        LOG_ERROR("CPU %d is not available to this process\n", TestParams->displayCpu);
+        return -1;
+    }
+
+    if (TestParams->scheduling != SchedulingNormal &&
+        !SetPriorityClass(GetCurrentProcess(), priorityClasses[TestParams->scheduling])) {
+        LOG_ERROR("failed setting priority class ec=%u\n", GetLastError());
+        return -1;
+    }
+    TestParams->priority = threadPriorities[TestParams->scheduling];
+    TestParams->priorityClass = GetPriorityClass(GetCurrentProcess());
+    if (TestParams->scheduling == SchedulingRealtime &&
+        TestParams->priorityClass != REALTIME_PRIORITY_CLASS)
+        LOG_WARNING("realtime priority class not granted, run as administrator\n");
+
+    if (TestParams->displayCpu >= 0 &&
+        !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << TestParams->displayCpu)) {
+        LOG_ERROR("failed pinning display thread to CPU %d ec=%u\n", TestParams->displayCpu,
+                  GetLastError());
+        return -1;
+    }
+
+    return 0;
 }
 
 
@@ -0,0 +1,139 @@
+#include <windows.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "k.h"
+#include "polling.h"
+#include "latency.h"
+#include "transfer_p.h"
+
+// Interrupt polling accuracy (-K). Every interrupt IN endpoint keeps -b single report transfers
+// (wMaxPacketSize each) queued, so the host controller has a transfer ready at every service
+// interval, and records the time between consecutive completions against the period bInterval
+// asks for. A gap of several periods counts the periods in between as missed. Other endpoints run
+// as usual, so a saturating bulk test can run next to it (-e 0x81 -e 0x82 -K) to show how much it
+// disturbs the polling.
+//
+// Arrivals are the completion stamps of the backend (see ReapTransfer), so how long the transfer
+// thread takes to reap a report does not move it. A gap in which the ring had run empty, because
+// the next transfer was submitted after the previous report arrived, is not the host
+// controller's doing: it is counted as starved, and only the periods after that submission can
+// be missed.
+
+// Period of bInterval in ns: frames (1 ms) at low and full speed, 2^(bInterval-1) microframes
+// (125 us) at high speed and above.
+static LONGLONG GetPollingPeriodNs(PUVPERF_TRANSFER_PARAM transferParam) {
+    UINT interval = transferParam->Ep.Interval;
+    UCHAR speed = GetDeviceSpeed(transferParam->TestParams);
+
+    if (speed == LowSpeed || speed == FullSpeed)
+        return max(interval, 1) * 1000000LL;
+
+    interval = min(max(interval, 1), 16);
+    return (1LL << (interval - 1)) * 125000LL;
+}
+
+int CreatePolling(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_POLLING polling;
+
+    if (ENDPOINT_TYPE(transferParam) != USB_ENDPOINT_TYPE_INTERRUPT ||
+        !USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId))
+        return 0;
+
+    if (!transferParam->Ep.MaximumPacketSize) {
+        LOG_WARNING("MaximumPacketSize=0 for EP%02Xh, not measuring its polling\n",
+                    transferParam->Ep.PipeId);
+        return 0;
+    }
+
+    polling = calloc(1, sizeof(UVPERF_POLLING));
+    if (!polling) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+    transferParam->Polling = polling;
+
+    polling->InterArrival = calloc(1, sizeof(UVPERF_LATENCY_HISTOGRAM));
+    polling->Jitter = calloc(1, sizeof(UVPERF_LATENCY_HISTOGRAM));
+    if (!polling->InterArrival || !polling->Jitter) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+
+    polling->PeriodNs = GetPollingPeriodNs(transferParam);
+
+    return 0;
+}
+
+void FreePolling(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_POLLING polling = transferParam->Polling;
+
+    if (!polling)
+        return;
+
+    free(polling->InterArrival);
+    free(polling->Jitter);
+    free(polling);
+    transferParam->Polling = NULL;
+}
+
+// Called for every report the endpoint delivered, submitTime and arrival are those of its
+// transfer. Reports complete in submission order, so that transfer was the next one the host
+// could poll from the later of submitTime and the previous arrival.
+void RecordPollingArrival(PUVPERF_TRANSFER_PARAM transferParam, LONGLONG submitTime,
+                          LONGLONG arrival) {
+    PUVPERF_POLLING polling = transferParam->Polling;
+    LONGLONG interArrival, periods;
+
+    if (!polling)
+        return;
+
+    polling->Reports++;
+    if (polling->LastArrival && submitTime > polling->LastArrival) {
+        polling->StarvedReports++;
+
+        // The first poll after the submit may be up to a period away.
+        periods = (arrival - submitTime) / polling->PeriodNs;
+        if (periods > 1)
+            polling->MissedIntervals += periods - 1;
+    } else if (polling->LastArrival) {
+        interArrival = arrival - polling->LastArrival;
+        RecordLatency(polling->InterArrival, interArrival);
+        RecordLatency(polling->Jitter, llabs(interArrival - polling->PeriodNs));
+
+        // Nearest whole number of periods; anything past the first one went unserviced.
+        periods = (interArrival + polling->PeriodNs / 2) / polling->PeriodNs;
+        if (periods > 1)
+            polling->MissedIntervals += periods - 1;
+    }
+    polling->LastArrival = arrival;
+}
+
+// A cancelled ring leaves a gap that is not the device's doing.
+void ResetPollingArrival(PUVPERF_TRANSFER_PARAM transferParam) {
+    if (transferParam->Polling)
+        transferParam->Polling->LastArrival = 0;
+}
+
+void ShowPolling(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_POLLING polling = transferParam->Polling;
+    PUVPERF_LATENCY_HISTOGRAM interArrival, jitter;
+
+    if (!polling || !polling->InterArrival->Count)
+        return;
+
+    interArrival = polling->InterArrival;
+    jitter = polling->Jitter;
+    LOG_MSG("\tPolling period %.3f ms (bInterval %u), %I64d reports\n",
+            polling->PeriodNs / 1000000.0, transferParam->Ep.Interval, polling->Reports);
+    LOG_MSG("\tInter-arrival us (min/avg/max) %.1f/%.1f/%.1f\n", interArrival->Min / 1000.0,
+            interArrival->Sum / interArrival->Count / 1000.0, interArrival->Max / 1000.0);
+    LOG_MSG("\tJitter us (p50/p99/p99.9/max) %.1f/%.1f/%.1f/%.1f\n",
+            GetLatencyPercentile(jitter, 50.0) / 1000.0,
+            GetLatencyPercentile(jitter, 99.0) / 1000.0,
+            GetLatencyPercentile(jitter, 99.9) / 1000.0, jitter->Max / 1000.0);
+    LOG_MSG("\tMissed %I64d intervals (%.2f%%)\n", polling->MissedIntervals,
+            polling->MissedIntervals * 100.0 / (polling->MissedIntervals + polling->Reports));
+    if (polling->StarvedReports)
+        LOG_MSG("\tRing ran empty before %I64d reports, raise -b\n", polling->StarvedReports);
+}
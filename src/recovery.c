@@ -0,0 +1,278 @@
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "k.h"
+#include "recovery.h"
+#include "transfer_p.h"
+#include "usb_transfer.h"
+#include "benchmark.h"
+#include "timestamp.h"
+
+// Stall recovery. A failed transfer (other than a timeout) opens an incident and takes the first
+// recovery step; every further failure before data flows again escalates to the next step:
+//
+//   reset pipe -> re-claim interface -> give up
+//
+// Each step first flushes the whole ring with AbortTransfers, so the next TransferAsync resubmits
+// bufferCount fresh transfers. The incident is closed by the first transfer that returns data,
+// which gives the time the stream was down. -J EVERY halts the endpoint on the device after every
+// EVERY-th good completion, so the transfers behind it fail with a real stall and the steps run
+// against a device that is otherwise healthy; those incidents are reported as injected.
+// Isochronous endpoints have no halt feature and are left alone.
+//
+// The reset pipe step clears the halt and resets the pipe in one go: WinUsb_ResetPipe and
+// libusb_clear_halt both send CLEAR_FEATURE(ENDPOINT_HALT) and reset the host side of the pipe,
+// neither can do one without the other.
+
+static const char *RecoveryStepString[] = {"none", "reset pipe", "re-claim", "failed"};
+
+static PUVPERF_RECOVERY_INCIDENT CurrentIncident(PUVPERF_RECOVERY recovery) {
+    return recovery->incidentCount <= RECOVERY_MAX_INCIDENTS
+               ? &recovery->Incidents[recovery->incidentCount - 1]
+               : &recovery->Overflow;
+}
+
+int CreateRecovery(PUVPERF_TRANSFER_PARAM transferParam) {
+    transferParam->Recovery = calloc(1, sizeof(UVPERF_RECOVERY));
+    if (!transferParam->Recovery) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+void FreeRecovery(PUVPERF_TRANSFER_PARAM transferParam) {
+    free(transferParam->Recovery);
+    transferParam->Recovery = NULL;
+}
+
+// Halts the endpoint after every -J EVERY-th good completion (ret >= 0).
+void InjectStall(PUVPERF_TRANSFER_PARAM transferParam, int ret) {
+    PUVPERF_RECOVERY recovery = transferParam->Recovery;
+    int every = transferParam->TestParams->injectStallEvery;
+    BOOL success;
+
+    if (!every || ret < 0 || !recovery || recovery->Step != RecoveryIdle || recovery->Flushing ||
+        recovery->InjectPending || transferParam->Ep.PipeType == UsbdPipeTypeIsochronous)
+        return;
+
+    if (++recovery->InjectCount % every)
+        return;
+
+    success = transferParam->TestParams->Backend == BACKEND_LIBUSB
+                  ? UsbSetHalt(transferParam)
+                  : Bench_SetEndpointHalt(transferParam->InterfaceHandle,
+                                          transferParam->Ep.PipeId);
+    if (!success) {
+        LOG_WARNING("Ep0x%02X: can not inject a stall, ec=%u\n", transferParam->Ep.PipeId,
+                    GetLastError());
+        return;
+    }
+
+    recovery->InjectPending = TRUE;
+}
+
+// Re-claiming the interface aborts the transfers of every endpoint on it. InterfaceReclaims is
+// odd while it runs, so those endpoints can tell the aborts from a stall of their own, see
+// ReclaimedBySibling.
+static BOOL ReclaimInterface(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_PARAM TestParams = transferParam->TestParams;
+    UCHAR number = transferParam->InterfaceNumber;
+    UCHAR altSetting = transferParam->AltSetting;
+    BOOL success;
+
+    InterlockedIncrement(&TestParams->InterfaceReclaims[number]);
+
+    if (TestParams->Backend == BACKEND_LIBUSB) {
+        success = UsbReclaimInterface(TestParams, number, altSetting);
+    } else {
+        K.ReleaseInterface(transferParam->InterfaceHandle, number, FALSE);
+        success = K.ClaimInterface(transferParam->InterfaceHandle, number, FALSE) &&
+                  K.SetAltInterface(transferParam->InterfaceHandle, number, FALSE, altSetting);
+    }
+
+    transferParam->Recovery->ReclaimsSeen =
+        InterlockedIncrement(&TestParams->InterfaceReclaims[number]);
+    return success;
+}
+
+// TRUE when another endpoint re-claimed this endpoint's interface since it last looked, which
+// aborted this ring as well. Waits for a re-claim still in progress, so the resubmitted
+// transfers go to the restored interface.
+static BOOL ReclaimedBySibling(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_RECOVERY recovery = transferParam->Recovery;
+    volatile LONG *reclaims =
+        &transferParam->TestParams->InterfaceReclaims[transferParam->InterfaceNumber];
+    LONG count;
+
+    while (((count = *reclaims) & 1) && !transferParam->TestParams->isCancelled)
+        Sleep(1);
+
+    if (count == recovery->ReclaimsSeen)
+        return FALSE;
+
+    recovery->ReclaimsSeen = count;
+    return TRUE;
+}
+
+static BOOL RunRecoveryStep(PUVPERF_TRANSFER_PARAM transferParam, UVPERF_RECOVERY_STEP step) {
+    PUVPERF_PARAM TestParams = transferParam->TestParams;
+    UINT frameNumber;
+    BOOL success;
+
+    switch (step) {
+    case RecoveryResetPipe:
+        // Both clear the halt on the device and reset the host side of the pipe, data toggle
+        // included.
+        success = TestParams->Backend == BACKEND_LIBUSB
+                      ? UsbClearHalt(transferParam)
+                      : K.ResetPipe(transferParam->InterfaceHandle, transferParam->Ep.PipeId);
+        break;
+    case RecoveryReclaim:
+        success = ReclaimInterface(transferParam);
+        break;
+    default:
+        return FALSE;
+    }
+
+    // The schedule fell behind the bus while the pipe was down.
+    if (success && transferParam->Ep.PipeType == UsbdPipeTypeIsochronous &&
+        TestParams->Backend == BACKEND_LIBUSBK && !TestParams->UseIsoAsap &&
+        K.GetCurrentFrameNumber(TestParams->InterfaceHandle, &frameNumber)) {
+        transferParam->frameNumber = frameNumber + ISO_SCHEDULE_LEAD_FRAMES;
+    }
+
+    return success;
+}
+
+// Called for a failed transfer (ret < 0). Flushes the ring and takes the next recovery step.
+// Returns FALSE once every step has failed.
+BOOL RecoverTransferParam(PUVPERF_TRANSFER_PARAM transferParam, int ret) {
+    PUVPERF_RECOVERY recovery = transferParam->Recovery;
+    PUVPERF_RECOVERY_INCIDENT incident;
+
+    if (!recovery || recovery->Flushing)
+        return TRUE;
+
+    if (ReclaimedBySibling(transferParam)) {
+        LOG_WARNING("Ep0x%02X: aborted by a re-claim of interface %d, resubmitting..\n",
+                    transferParam->Ep.PipeId, transferParam->InterfaceNumber);
+        recovery->Flushing = TRUE;
+        AbortTransfers(transferParam);
+        recovery->Flushing = FALSE;
+        return TRUE;
+    }
+
+    if (recovery->Step == RecoveryIdle) {
+        // Past RECOVERY_MAX_INCIDENTS the incident is still run and counted, just not kept.
+        recovery->incidentCount++;
+        incident = CurrentIncident(recovery);
+        memset(incident, 0, sizeof(*incident));
+        incident->Cause = labs(ret);
+        incident->Injected = recovery->InjectPending;
+        incident->StartTime = GetTimestampNs();
+    } else {
+        incident = CurrentIncident(recovery);
+    }
+    recovery->InjectPending = FALSE;
+
+    incident->LostTransfers++;
+    incident->LostBytes += GetTransferLength(transferParam);
+
+    for (;;) {
+        recovery->Step++;
+        incident->Step = recovery->Step;
+        if (recovery->Step == RecoveryFailed) {
+            LOG_ERROR("Ep0x%02X: recovery failed, %d transfers lost\n", transferParam->Ep.PipeId,
+                      incident->LostTransfers);
+            return FALSE;
+        }
+
+        LOG_WARNING("Ep0x%02X: %s after error %u, %s..\n", transferParam->Ep.PipeId,
+                    incident->Injected ? "injected stall" : "stall", incident->Cause,
+                    RecoveryStepString[recovery->Step]);
+
+        recovery->Flushing = TRUE;
+        incident->LostBytes += AbortTransfers(transferParam);
+        recovery->Flushing = FALSE;
+
+        if (RunRecoveryStep(transferParam, recovery->Step))
+            return TRUE;
+
+        // A step that can't even be issued is skipped.
+        LOG_WARNING("Ep0x%02X: %s failed, ec=%u\n", transferParam->Ep.PipeId,
+                    RecoveryStepString[recovery->Step], GetLastError());
+    }
+}
+
+// Called for every transfer that did not fail; the first one with data closes the incident.
+void RecoveryTransferDone(PUVPERF_TRANSFER_PARAM transferParam, int ret) {
+    PUVPERF_RECOVERY recovery = transferParam->Recovery;
+    PUVPERF_RECOVERY_INCIDENT incident;
+
+    if (!recovery || recovery->Step == RecoveryIdle || recovery->Flushing || ret <= 0)
+        return;
+
+    recovery->Step = RecoveryIdle;
+    incident = CurrentIncident(recovery);
+    incident->RecoveredTime = GetTimestampNs();
+    LOG_MSG("Ep0x%02X: recovered by %s in %.3f ms, %I64d bytes lost\n", transferParam->Ep.PipeId,
+            RecoveryStepString[incident->Step],
+            (incident->RecoveredTime - incident->StartTime) / 1000000.0, incident->LostBytes);
+}
+
+void ShowRecovery(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_RECOVERY recovery = transferParam->Recovery;
+    PUVPERF_RECOVERY_INCIDENT incident;
+    LONGLONG recoveryTime, minTime = 0, maxTime = 0, sumTime = 0, lostBytes = 0;
+    int i, recoveredCount = 0, injectedCount = 0;
+    int count;
+
+    if (!recovery || !recovery->incidentCount)
+        return;
+
+    count = min(recovery->incidentCount, RECOVERY_MAX_INCIDENTS);
+    for (i = 0; i < count; i++) {
+        incident = &recovery->Incidents[i];
+        lostBytes += incident->LostBytes;
+        if (incident->Injected)
+            injectedCount++;
+        if (!incident->RecoveredTime)
+            continue;
+
+        recoveryTime = incident->RecoveredTime - incident->StartTime;
+        if (!recoveredCount || recoveryTime < minTime)
+            minTime = recoveryTime;
+        if (recoveryTime > maxTime)
+            maxTime = recoveryTime;
+        sumTime += recoveryTime;
+        recoveredCount++;
+    }
+
+    // Injected incidents are stalls -J caused on an otherwise healthy device.
+    LOG_MSG("\tStall Incidents %d (%d injected), %d recovered, %I64d bytes lost\n",
+            recovery->incidentCount, injectedCount, recoveredCount, lostBytes);
+    if (recoveredCount) {
+        LOG_MSG("\tRecovery ms (min/avg/max) %.3f/%.3f/%.3f\n", minTime / 1000000.0,
+                sumTime / recoveredCount / 1000000.0, maxTime / 1000000.0);
+    }
+
+    for (i = 0; i < count; i++) {
+        incident = &recovery->Incidents[i];
+        if (incident->RecoveredTime) {
+            LOG_MSG("\t  #%d error %u%s, %s, %.3f ms, %d transfers / %I64d bytes lost\n", i + 1,
+                    incident->Cause, incident->Injected ? " (injected)" : "",
+                    RecoveryStepString[incident->Step],
+                    (incident->RecoveredTime - incident->StartTime) / 1000000.0,
+                    incident->LostTransfers, incident->LostBytes);
+        } else {
+            LOG_MSG("\t  #%d error %u%s, %s, not recovered, %d transfers / %I64d bytes lost\n",
+                    i + 1, incident->Cause, incident->Injected ? " (injected)" : "",
+                    RecoveryStepString[incident->Step], incident->LostTransfers,
+                    incident->LostBytes);
+        }
+    }
+}
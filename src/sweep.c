@@ -0,0 +1,289 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "k.h"
+#include "sweep.h"
+#include "tuner.h"
+#include "transfer_p.h"
+#include "usb_transfer.h"
+#include "benchmark.h"
+
+// Sweep mode (-s SPEC). Runs every combination of alt setting, transfer mode, queue depth and
+// transfer length on the already opened interface handle and writes one row per point to a CSV
+// or JSON file (-x FILE).
+//
+// SPEC is a comma separated list of KEY=VALUES entries:
+//   a  alt setting           b  buffer count (-b)
+//   m  0 = sync, 1 = async   l  transfer length (-l and -w)
+// VALUES is either a list (1/4/16) or a range FROM-TO, which doubles for b and l and counts up
+// by one for a and m. Keys that are left out keep the value given on the command line. Every
+// b and l value has to lie within the limits the tuner (-o) uses. Sync points only use one
+// buffer, so they run once per length instead of once per b value.
+
+static int ParseSweepRange(const char *values, BOOL doubling, PUVPERF_SWEEP_RANGE range) {
+    char *end;
+    long from, to;
+
+    range->count = 0;
+
+    from = strtol(values, &end, 0);
+    if (end == values)
+        return -1;
+
+    if (*end == '-') {
+        to = strtol(end + 1, &end, 0);
+        if (to < from || (doubling && from < 1))
+            return -1;
+
+        while (from <= to && range->count < SWEEP_MAX_VALUES) {
+            range->values[range->count++] = from;
+            from = doubling ? from * 2 : from + 1;
+        }
+    } else {
+        range->values[range->count++] = from;
+        while (*end == '/' && range->count < SWEEP_MAX_VALUES) {
+            values = end + 1;
+            range->values[range->count++] = strtol(values, &end, 0);
+            if (end == values)
+                return -1;
+        }
+    }
+
+    return (*end == '\0' || *end == ',') ? 0 : -1;
+}
+
+int ParseSweepSpec(PUVPERF_PARAM TestParams, const char *spec, PUVPERF_SWEEP sweep) {
+    PUVPERF_SWEEP_RANGE range;
+    BOOL doubling;
+    int minValue, maxValue;
+    int i;
+
+    // Unswept parameters keep their command line value.
+    sweep->altSettings.values[0] = TestParams->altf;
+    sweep->altSettings.count = 1;
+    sweep->transferModes.values[0] = TestParams->TransferMode == TRANSFER_MODE_ASYNC;
+    sweep->transferModes.count = 1;
+    sweep->bufferCounts.values[0] = TestParams->bufferCount;
+    sweep->bufferCounts.count = 1;
+    sweep->lengths.values[0] = max(TestParams->readlenth, TestParams->writelength);
+    sweep->lengths.count = 1;
+
+    while (*spec) {
+        switch (spec[0]) {
+        case 'a':
+            range = &sweep->altSettings;
+            doubling = FALSE;
+            minValue = 0;
+            maxValue = 255;
+            break;
+        case 'm':
+            range = &sweep->transferModes;
+            doubling = FALSE;
+            minValue = 0;
+            maxValue = 1;
+            break;
+        case 'b':
+            range = &sweep->bufferCounts;
+            doubling = TRUE;
+            minValue = 1;
+            maxValue = TUNE_MAX_BUFFER_COUNT;
+            break;
+        case 'l':
+            range = &sweep->lengths;
+            doubling = TRUE;
+            minValue = 1;
+            maxValue = TUNE_MAX_LENGTH;
+            break;
+        default:
+            range = NULL;
+            break;
+        }
+
+        if (!range || spec[1] != '=' || ParseSweepRange(spec + 2, doubling, range) < 0) {
+            LOG_ERROR("invalid sweep entry '%s'\n", spec);
+            return -1;
+        }
+
+        for (i = 0; i < range->count; i++) {
+            if (range->values[i] < minValue || range->values[i] > maxValue) {
+                LOG_ERROR("sweep %c value %d is out of range, %c is %d to %d\n", spec[0],
+                          range->values[i], spec[0], minValue, maxValue);
+                return -1;
+            }
+        }
+
+        spec = strchr(spec, ',');
+        if (!spec)
+            break;
+        spec++;
+    }
+
+    for (i = 0; i < sweep->transferModes.count; i++) {
+        // The row would be labelled sync but run the event loop's asynchronous transfers.
+        if (!sweep->transferModes.values[i] && TestParams->useEventLoop) {
+            LOGERR0("sweep m=0 (sync) can not run with -E, the event loop is async only\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Switches the open interface to altSetting and reloads its pipes.
+static int SelectAltSetting(PUVPERF_PARAM TestParams, int altSetting) {
+    UCHAR pipeIndex = 0;
+
+    if (altSetting == TestParams->altf)
+        return 0;
+
+    if (!K.QueryInterfaceSettings(TestParams->InterfaceHandle, (UCHAR)altSetting,
+                                  &TestParams->InterfaceDescriptor) ||
+        !K.SetCurrentAlternateSetting(TestParams->InterfaceHandle, (UCHAR)altSetting)) {
+        LOG_ERROR("can not find alt interface %02X\n", altSetting);
+        return -1;
+    }
+
+    if (TestParams->Backend == BACKEND_LIBUSB && UsbSetAltSetting(TestParams, altSetting) < 0)
+        return -1;
+
+    memset(&TestParams->PipeInformation, 0, sizeof(TestParams->PipeInformation));
+    while (K.QueryPipeEx(TestParams->InterfaceHandle, (UCHAR)altSetting, pipeIndex,
+                         &TestParams->PipeInformation[pipeIndex])) {
+        pipeIndex++;
+    }
+
+    if (TestParams->allEndpoints)
+        Bench_SelectAllPipes(TestParams);
+
+    TestParams->altf = altSetting;
+    return 0;
+}
+
+static void WriteSweepPoint(FILE *file, BOOL json, int pointIndex, PUVPERF_TUNE_POINT point) {
+    if (json) {
+        fprintf(file,
+                "%s  {\"alt\": %d, \"mode\": \"%s\", \"buffers\": %d, \"length\": %d, "
+                "\"mbps\": %.2f, \"transfers_per_sec\": %.1f, \"errors\": %d, "
+                "\"timeouts\": %d, \"cpu_sec\": %.3f, \"ok\": %s}",
+                pointIndex ? ",\n" : "", point->altSetting,
+                point->transferMode == TRANSFER_MODE_ASYNC ? "async" : "sync", point->bufferCount,
+                point->length, (point->bps * 8) / 1000 / 1000, point->transfersPerSec,
+                point->errorCount, point->timeoutCount, point->cpuSeconds,
+                point->failed ? "false" : "true");
+    } else {
+        fprintf(file, "%d,%s,%d,%d,%.2f,%.1f,%d,%d,%.3f,%d\n", point->altSetting,
+                point->transferMode == TRANSFER_MODE_ASYNC ? "async" : "sync", point->bufferCount,
+                point->length, (point->bps * 8) / 1000 / 1000, point->transfersPerSec,
+                point->errorCount, point->timeoutCount, point->cpuSeconds, !point->failed);
+    }
+    fflush(file);
+}
+
+int RunSweep(PUVPERF_PARAM TestParams) {
+    UVPERF_SWEEP sweep;
+    UVPERF_TUNE_POINT point;
+    DWORD msToMeasure = TestParams->Timer ? TestParams->Timer * 1000 : TUNE_MEASURE_MS;
+    char fileName[MAX_PATH];
+    FILE *file;
+    BOOL json;
+    int altIndex, modeIndex, bufferIndex, lengthIndex;
+    int pointIndex = 0, pointCount = 0;
+    int savedAltSetting = TestParams->altf;
+    int savedBufferCount = TestParams->bufferCount;
+    int savedReadLength = TestParams->readlenth;
+    int savedWriteLength = TestParams->writelength;
+    int savedBufferLength = TestParams->bufferlength;
+    UVPERF_TRANSFER_MODE savedTransferMode = TestParams->TransferMode;
+    BOOL savedVerify = TestParams->verify;
+
+    if (ParseSweepSpec(TestParams, TestParams->sweepSpec, &sweep) < 0)
+        return -1;
+
+    if (TestParams->sweepFileName[0]) {
+        strcpy(fileName, TestParams->sweepFileName);
+    } else {
+        time_t now = time(NULL);
+        strftime(fileName, sizeof(fileName), "../log/uvperf_sweep_%Y%m%d_%H%M%S.csv",
+                 localtime(&now));
+    }
+    json = strlen(fileName) > 5 && !_stricmp(fileName + strlen(fileName) - 5, ".json");
+
+    file = fopen(fileName, "w");
+    if (!file) {
+        LOG_ERROR("failed opening %s\n", fileName);
+        return -1;
+    }
+    fprintf(file, json ? "[\n"
+                       : "alt,mode,buffers,length,mbps,transfers_per_sec,errors,timeouts,cpu_sec,"
+                         "ok\n");
+
+    // Data isn't verified while sweeping, only throughput counts.
+    TestParams->verify = FALSE;
+
+    for (modeIndex = 0; modeIndex < sweep.transferModes.count; modeIndex++)
+        pointCount += sweep.transferModes.values[modeIndex] ? sweep.bufferCounts.count : 1;
+    pointCount *= sweep.altSettings.count * sweep.lengths.count;
+
+    LOG_MSG("Sweeping %d points, %u ms each, results in %s\n", pointCount, msToMeasure,
+            fileName);
+    LOG_MSG("%4s %6s %8s %10s %12s %12s %8s %8s\n", "Alt", "Mode", "Buffers", "Length", "Mbps",
+            "Transfers/s", "Errors", "CPU sec");
+
+    // Alt settings are the outer loop, switching them is the most expensive step.
+    for (altIndex = 0; altIndex < sweep.altSettings.count; altIndex++) {
+        if (SelectAltSetting(TestParams, sweep.altSettings.values[altIndex]) < 0)
+            continue;
+
+        for (modeIndex = 0; modeIndex < sweep.transferModes.count; modeIndex++) {
+            for (bufferIndex = 0; bufferIndex < sweep.bufferCounts.count; bufferIndex++) {
+                // A sync transfer uses a single buffer, b does not apply to it.
+                if (bufferIndex && !sweep.transferModes.values[modeIndex])
+                    break;
+
+                for (lengthIndex = 0; lengthIndex < sweep.lengths.count; lengthIndex++) {
+                    if (TestParams->isUserAborted)
+                        goto Done;
+
+                    TestParams->TransferMode = sweep.transferModes.values[modeIndex]
+                                                   ? TRANSFER_MODE_ASYNC
+                                                   : TRANSFER_MODE_SYNC;
+                    TestParams->bufferCount = sweep.transferModes.values[modeIndex]
+                                                  ? sweep.bufferCounts.values[bufferIndex]
+                                                  : 1;
+                    TestParams->bufferlength = sweep.lengths.values[lengthIndex];
+                    TestParams->readlenth = sweep.lengths.values[lengthIndex];
+                    TestParams->writelength = sweep.lengths.values[lengthIndex];
+
+                    MeasureTransferParams(TestParams, msToMeasure, &point);
+                    WriteSweepPoint(file, json, pointIndex++, &point);
+
+                    LOG_MSG("%4d %6s %8d %10d %12.2f %12.1f %8d %8.3f\n", point.altSetting,
+                            point.transferMode == TRANSFER_MODE_ASYNC ? "async" : "sync",
+                            point.bufferCount, point.length, (point.bps * 8) / 1000 / 1000,
+                            point.transfersPerSec, point.errorCount + point.timeoutCount,
+                            point.cpuSeconds);
+                }
+            }
+        }
+    }
+
+Done:
+    if (json)
+        fprintf(file, "\n]\n");
+    fclose(file);
+
+    SelectAltSetting(TestParams, savedAltSetting);
+    TestParams->bufferCount = savedBufferCount;
+    TestParams->readlenth = savedReadLength;
+    TestParams->writelength = savedWriteLength;
+    TestParams->bufferlength = savedBufferLength;
+    TestParams->TransferMode = savedTransferMode;
+    TestParams->verify = savedVerify;
+
+    LOG_MSG("%d points written to %s\n", pointIndex, fileName);
+    return 0;
+}
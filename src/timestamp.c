@@ -0,0 +1,102 @@
+#include <windows.h>
+#include <math.h>
+#include <string.h>
+
+#include "timestamp.h"
+
+// Timestamps taken in the transfer hot path. When the CPU has an invariant TSC (constant rate,
+// keeps counting in deep C-states, synchronised across cores) GetTimestampNs scales __rdtsc()
+// instead of going through clock_gettime; the scale is measured once at startup against
+// QueryPerformanceCounter. Otherwise, or when the calibration is not stable, it falls back to
+// clock_gettime(CLOCK_MONOTONIC).
+
+UVPERF_TIMESTAMP_CLOCK TimestampClock;
+
+#if TIMESTAMP_HAS_TSC
+static BOOL HasInvariantTsc(void) {
+    int regs[4];
+
+    __cpuid(regs, 0x80000000);
+    if ((unsigned int)regs[0] < 0x80000007)
+        return FALSE;
+
+    // CPUID.80000007H:EDX[8]
+    __cpuid(regs, 0x80000007);
+    return (regs[3] & (1 << 8)) != 0;
+}
+
+// Reads the TSC and the performance counter at (nearly) the same instant: the counter read is
+// bracketed by two TSC reads and the tightest of a few tries is kept.
+static void ReadClockPair(ULONGLONG *tsc, LONGLONG *counter) {
+    ULONGLONG before, after, best = ~0ULL;
+    LARGE_INTEGER now;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        before = __rdtsc();
+        QueryPerformanceCounter(&now);
+        after = __rdtsc();
+
+        if (after - before < best) {
+            best = after - before;
+            *tsc = before + best / 2;
+            *counter = now.QuadPart;
+        }
+    }
+}
+
+// TSC rate in Hz over one calibration window, 0 on failure.
+static DOUBLE CalibrateTsc(LONGLONG counterFrequency) {
+    ULONGLONG tscStart, tscEnd;
+    LONGLONG counterStart, counterEnd;
+
+    ReadClockPair(&tscStart, &counterStart);
+    Sleep(TIMESTAMP_CALIBRATION_MS);
+    ReadClockPair(&tscEnd, &counterEnd);
+
+    if (counterEnd <= counterStart || tscEnd <= tscStart)
+        return 0;
+
+    return (DOUBLE)(tscEnd - tscStart) * counterFrequency / (DOUBLE)(counterEnd - counterStart);
+}
+#endif
+
+// Picks the clock source, once at startup before any transfer thread runs.
+void InitTimestampClock(void) {
+    LONGLONG start;
+    int i;
+#if TIMESTAMP_HAS_TSC
+    LARGE_INTEGER frequency;
+    DOUBLE first, second;
+#endif
+
+    memset(&TimestampClock, 0, sizeof(TimestampClock));
+    TimestampClock.Source = ClockSourceMonotonic;
+
+#if TIMESTAMP_HAS_TSC
+    TimestampClock.InvariantTsc = HasInvariantTsc();
+    if (TimestampClock.InvariantTsc && QueryPerformanceFrequency(&frequency)) {
+        // Two windows; a rate that moves between them means the TSC cannot be trusted here
+        // (e.g. a hypervisor that does not pass it through).
+        first = CalibrateTsc(frequency.QuadPart);
+        second = CalibrateTsc(frequency.QuadPart);
+
+        if (first > 0 && second > 0) {
+            TimestampClock.TscHz = (first + second) / 2;
+            TimestampClock.CalibrationPpm = fabs(first - second) / TimestampClock.TscHz * 1e6;
+
+            if (TimestampClock.CalibrationPpm <= TIMESTAMP_CALIBRATION_PPM) {
+                TimestampClock.NsPerTsc = 1000000000.0 / TimestampClock.TscHz;
+                TimestampClock.NsBase = GetMonotonicNs();
+                TimestampClock.TscBase = __rdtsc();
+                TimestampClock.Source = ClockSourceTsc;
+            }
+        }
+    }
+#endif
+
+    start = GetTimestampNs();
+    for (i = 0; i < TIMESTAMP_COST_SAMPLES; i++)
+        GetTimestampNs();
+    TimestampClock.ReadCostNs = (GetTimestampNs() - start) / TIMESTAMP_COST_SAMPLES;
+}
@@ -4,6 +4,17 @@
 #include "log.h"
 #include "k.h"
 #include "transfer_p.h" 
+#include "usb_transfer.h"
+#include "buffer_pool.h"
+#include "engine.h"
+#include "latency.h"
+#include "timestamp.h"
+#include "pacer.h"
+#include "workload.h"
+#include "recovery.h"
+#include "frame.h"
+#include "polling.h"
+#include "benchmark.h"
 
 
 void AppendLoopBuffer(PUVPERF_PARAM TestParams, unsigned char *buffer, unsigned int length) {
@@ -87,9 +98,16 @@ int VerifyData(PUVPERF_TRANSFER_PARAM transferParam, BYTE *data, INT dataLength)
 int TransferSync(PUVPERF_TRANSFER_PARAM transferParam) {
     unsigned int trasnferred;
     BOOL success;
+    LONGLONG submitTime = GetTimestampNs();
+    int ret;
+
+    if (transferParam->TestParams->Backend == BACKEND_LIBUSB) {
+        ret = UsbTransferSync(transferParam);
+        goto Final;
+    }
 
     if (transferParam->Ep.PipeId & USB_ENDPOINT_DIRECTION_MASK) {
-        success = K.ReadPipe(transferParam->TestParams->InterfaceHandle,
+        success = K.ReadPipe(transferParam->InterfaceHandle,
                              transferParam->Ep.PipeId,
                              transferParam->Buffer,
                              transferParam->TestParams->readlenth,
@@ -99,7 +117,7 @@ int TransferSync(PUVPERF_TRANSFER_PARAM transferParam) {
         AppendLoopBuffer(transferParam->TestParams,
                          transferParam->Buffer,
                          transferParam->TestParams->writelength);
-        success = K.WritePipe(transferParam->TestParams->InterfaceHandle,
+        success = K.WritePipe(transferParam->InterfaceHandle,
                              transferParam->Ep.PipeId,
                               transferParam->Buffer,
                               transferParam->TestParams->writelength,
@@ -107,16 +125,89 @@ int TransferSync(PUVPERF_TRANSFER_PARAM transferParam) {
                               NULL);
     }
 
-    return success ? (int)trasnferred : -labs(GetLastError());
+    ret = success ? (int)trasnferred : -labs(GetLastError());
+
+Final:
+    if (ret >= 0)
+        RecordLatency(transferParam->Latency, GetTimestampNs() - submitTime);
+    return ret;
 }
 
+// The -l/-w length of transferParam's direction.
+int GetTransferLength(PUVPERF_TRANSFER_PARAM transferParam) {
+    return USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId)
+               ? transferParam->TestParams->readlenth
+               : transferParam->TestParams->writelength;
+}
+
+// Isochronous handles are set up for a fixed number of packets, so every transfer on them has to
+// be GetTransferLength long. Workload sizes and frame segments need the other pipe types.
+BOOL HasVariableTransferLength(PUVPERF_TRANSFER_PARAM transferParam) {
+    return transferParam->Ep.PipeType != UsbdPipeTypeIsochronous;
+}
+
+// Speed of the device under test, queried once.
+UCHAR GetDeviceSpeed(PUVPERF_PARAM TestParams) {
+    UINT length = sizeof(UCHAR);
+    UCHAR speed;
+
+    if (!TestParams->deviceSpeed) {
+        if (K.QueryDeviceInformation(TestParams->InterfaceHandle, DEVICE_SPEED, &length, &speed)) {
+            TestParams->deviceSpeed = speed;
+        } else {
+            LOG_WARNING("can not query the device speed, assuming high speed\n");
+            TestParams->deviceSpeed = HighSpeed;
+        }
+    }
+
+    return (UCHAR)TestParams->deviceSpeed;
+}
+
+// userState is the PUVPERF_TRANSFER_HANDLE whose packets are enumerated; results are collected in
+// its IsochResults.
 BOOL WINAPI IsoTransferCb(_in unsigned int packetIndex, _ref unsigned int *offset,
                           _ref unsigned int *length, _ref unsigned int *status,
                           _in void *userState) {
-    BENCHMARK_ISOCH_RESULTS *isochResults = (BENCHMARK_ISOCH_RESULTS *)userState;
+    PUVPERF_TRANSFER_HANDLE handle = (PUVPERF_TRANSFER_HANDLE)userState;
+    BENCHMARK_ISOCH_RESULTS *isochResults = &handle->IsochResults;
+
+    if (USB_ENDPOINT_DIRECTION_OUT(handle->TransferParam->Ep.PipeId)) {
+        // Packets past the submitted data were never sent.
+        if (*offset >= (unsigned int)handle->DataMaxLength)
+            return TRUE;
+
+        // libusb reports what each write packet actually carried. libusbK only updates the
+        // status of write packets (WinUSB neither), so there a packet that completed is taken to
+        // have carried the part of the submitted data that falls into it.
+        if (handle->TransferParam->TestParams->Backend == BACKEND_LIBUSBK && !*status) {
+            *length = min(handle->TransferParam->Ep.MaximumBytesPerInterval,
+                          handle->DataMaxLength - *offset);
+        }
+    }
 
-    UNREFERENCED_PARAMETER(packetIndex);
-    UNREFERENCED_PARAMETER(offset);
+    if (handle->TransferParam->IsoTimeline) {
+        PUVPERF_TRANSFER_PARAM transferParam = handle->TransferParam;
+        PUVPERF_ISO_PACKET_RECORD record =
+            &transferParam->IsoTimeline[transferParam->isoTimelineCount %
+                                        transferParam->TestParams->isoTimelineSize];
+
+        record->Timestamp = handle->CompletionTime;
+        record->FrameNumber = 0;
+        record->Microframe = 0;
+        if (handle->StartFrame) {
+            // Packet i goes out i service intervals after the transfer's start frame.
+            ULONGLONG microframe = handle->StartFrame * 8ULL +
+                                   (ULONGLONG)packetIndex * transferParam->isoPacketMicroframes;
+
+            record->FrameNumber = (UINT)(microframe / 8);
+            if (GetDeviceSpeed(transferParam->TestParams) >= HighSpeed)
+                record->Microframe = (USHORT)(microframe % 8);
+        }
+        record->Status = *status;
+        record->Length = *length;
+        record->PacketIndex = (USHORT)packetIndex;
+        transferParam->isoTimelineCount++;
+    }
 
     if (*status)
         isochResults->BadPackets++;
@@ -131,56 +222,259 @@ BOOL WINAPI IsoTransferCb(_in unsigned int packetIndex, _ref unsigned int *offse
     return TRUE;
 }
 
+// Waits for any in-flight libusbK transfer and returns its handle index, or -1 on timeout.
+// WaitForMultipleObjects is limited to MAXIMUM_WAIT_OBJECTS events, so deeper rings wait on the
+// first MAXIMUM_WAIT_OBJECTS in-use handles from transferHandleWaitIndex; the starting point
+// rotates with every reap so no handle is starved.
+static int WaitForAnyTransfer(PUVPERF_TRANSFER_PARAM transferParam, DWORD msToWait) {
+    HANDLE waitEvents[MAXIMUM_WAIT_OBJECTS];
+    int waitIndexes[MAXIMUM_WAIT_OBJECTS];
+    DWORD waitCount = 0;
+    DWORD waitResult;
+    int handleIndex = transferParam->transferHandleWaitIndex;
+    int i;
+
+    for (i = 0; i < transferParam->TestParams->bufferCount && waitCount < MAXIMUM_WAIT_OBJECTS;
+         i++) {
+        if (transferParam->TransferHandles[handleIndex].InUse) {
+            waitEvents[waitCount] = transferParam->TransferHandles[handleIndex].Overlapped.hEvent;
+            waitIndexes[waitCount] = handleIndex;
+            waitCount++;
+        }
+        INC_ROLL(handleIndex, transferParam->TestParams->bufferCount);
+    }
+
+    if (!waitCount) {
+        SetLastError(ERROR_NO_MORE_ITEMS);
+        return -1;
+    }
+
+    waitResult = WaitForMultipleObjects(waitCount, waitEvents, FALSE, msToWait);
+    if (waitResult >= WAIT_OBJECT_0 + waitCount) {
+        if (waitResult == WAIT_TIMEOUT)
+            SetLastError(ERROR_SEM_TIMEOUT);
+        return -1;
+    }
+
+    handleIndex = waitIndexes[waitResult - WAIT_OBJECT_0];
+    transferParam->TransferHandles[handleIndex].CompletionTime = GetTimestampNs();
+    return handleIndex;
+}
+
+// Isochronous OUT data has to be scheduled before the bus reaches its frame. An underrun is the
+// queue draining below one outstanding transfer: once handle is reaped nothing is left on the
+// schedule, and the device sees empty frames until the next submit. Transfers complete in the
+// order they were scheduled, so a transfer still pending means the most recently submitted one.
+// With a queue depth of 1 the schedule drains after every transfer by design; there is no
+// underrun to measure.
+static void CheckIsoUnderrun(PUVPERF_TRANSFER_PARAM transferParam,
+                             PUVPERF_TRANSFER_HANDLE handle) {
+    PUVPERF_TRANSFER_HANDLE lastHandle =
+        &transferParam->TransferHandles[transferParam->lastSubmittedIndex];
+    UINT frameNumber;
+
+    if (transferParam->TestParams->bufferCount < 2)
+        return;
+
+    // Called before handle is taken off outstandingTransferCount.
+    if (transferParam->outstandingTransferCount > 1 && lastHandle != handle &&
+        lastHandle->InUse && WaitForSingleObject(lastHandle->Overlapped.hEvent, 0) != WAIT_OBJECT_0)
+        return;
+
+    transferParam->Stats.isoUnderrunCount++;
+
+    // frameNumber now points into the past; move the schedule back ahead of the bus or every
+    // following transfer is late as well.
+    if (transferParam->TestParams->Backend == BACKEND_LIBUSBK &&
+        !transferParam->TestParams->UseIsoAsap &&
+        K.GetCurrentFrameNumber(transferParam->InterfaceHandle, &frameNumber)) {
+        transferParam->frameNumber = frameNumber + ISO_SCHEDULE_LEAD_FRAMES;
+    }
+}
+
+// Collects the result of a finished (or cancelled) transfer and releases its handle. Returns the
+// bytes transferred or a negative error.
+static int ReapTransfer(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle) {
+    UINT transferred;
+    BOOL success;
+    int ret;
+
+    // The completion path stamps CompletionTime: UsbTransferCb on the libusb event thread, or
+    // WaitForAnyTransfer as soon as the overlapped event wakes it. Only reaps that bypass both,
+    // such as cancelled transfers, are stamped here.
+    if (!handle->CompletionTime)
+        handle->CompletionTime = GetTimestampNs();
+
+    if (transferParam->TestParams->Backend == BACKEND_LIBUSB) {
+        success = UsbGetTransferResult(transferParam, handle, &transferred);
+    } else {
+        success = K.GetOverlappedResult(transferParam->InterfaceHandle,
+                                        &handle->Overlapped, &transferred, FALSE);
+    }
+
+    if (!success) {
+        if (!transferParam->TestParams->isUserAborted) {
+            ret = WinError(0);
+        } else
+            ret = -labs(GetLastError());
+
+        // The transfer is finished even though it failed; hand it back for resubmission.
+        handle->ReturnCode = ret;
+        handle->InUse = FALSE;
+        transferParam->outstandingTransferCount--;
+        FrameSegmentDone(transferParam, handle, ret);
+        return ret;
+    }
+
+    if (transferParam->Ep.PipeType == UsbdPipeTypeIsochronous) {
+        // The libusb backend has already enumerated the packets.
+        if (transferParam->TestParams->Backend == BACKEND_LIBUSBK) {
+            memset(&handle->IsochResults, 0, sizeof(handle->IsochResults));
+            IsochK_EnumPackets(handle->IsochHandle, &IsoTransferCb, 0, handle);
+        }
+        transferParam->Stats.IsochResults.TotalPackets += handle->IsochResults.TotalPackets;
+        transferParam->Stats.IsochResults.GoodPackets += handle->IsochResults.GoodPackets;
+        transferParam->Stats.IsochResults.BadPackets += handle->IsochResults.BadPackets;
+        transferParam->Stats.IsochResults.Length += handle->IsochResults.Length;
+        transferred = handle->IsochResults.Length;
+
+        if (USB_ENDPOINT_DIRECTION_OUT(transferParam->Ep.PipeId))
+            CheckIsoUnderrun(transferParam, handle);
+    } else {
+        if ((int)transferred < handle->DataMaxLength)
+            transferParam->shortTransferCount++;
+        // A zero length packet that was asked for, e.g. the end of a -F frame, is not one.
+        if (!transferred && handle->DataMaxLength)
+            transferParam->zeroLengthCount++;
+    }
+
+    handle->ReturnCode = ret = (int)transferred;
+
+    RecordLatency(transferParam->Latency, handle->CompletionTime - handle->SubmitTime);
+
+    transferParam->Stats.QueueDepthTotal += transferParam->outstandingTransferCount;
+    transferParam->Stats.QueueDepthSamples++;
+    if (transferParam->outstandingTransferCount > transferParam->Stats.MaxQueueDepth)
+        transferParam->Stats.MaxQueueDepth = transferParam->outstandingTransferCount;
+
+    // Mark this handle has no longer InUse.
+    handle->InUse = FALSE;
+
+    // When transfers ir successfully submitted, OutstandingTransferCount goes up; when
+    // they are completed it goes down.
+    //
+    transferParam->outstandingTransferCount--;
+
+    FrameSegmentDone(transferParam, handle, ret);
+    RecordPollingArrival(transferParam, handle->SubmitTime, handle->CompletionTime);
+
+    return ret;
+}
+
 int TransferAsync(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE *handleRef) {
+    return TransferAsyncEx(transferParam, handleRef, transferParam->TestParams->timeout);
+}
+
+// Same as TransferAsync but waits at most msToWait for a completion. With msToWait == 0 it only
+// refills the ring and reaps a transfer that has already completed; when none has, it returns 0
+// with *handleRef set to NULL.
+int TransferAsyncEx(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE *handleRef,
+                    DWORD msToWait) {
     int ret = 0;
     BOOL success;
     PUVPERF_TRANSFER_HANDLE handle = NULL;
     DWORD transferErrorCode;
+    BOOL frameHeld = FALSE;
+    int length;
 
     *handleRef = NULL;
 
     // Submit transfers until the maximum number of outstanding transfer(s) is reached.
     while (transferParam->outstandingTransferCount < transferParam->TestParams->bufferCount) {
-        // Get the next available benchmark transfer handle.
-        *handleRef = handle =
-            &transferParam->TransferHandles[transferParam->transferHandleNextIndex];
+        // A workload profile picks the length of every submission and holds them between
+        // bursts.
+        if (transferParam->Workload) {
+            if (!transferParam->Workload->SubmitBudget)
+                break;
+            transferParam->Workload->SubmitBudget--;
+            length = NextWorkloadLength(transferParam);
+        } else if (transferParam->Polling) {
+            // One report per transfer, so every completion is one service interval.
+            length = min(transferParam->Ep.MaximumPacketSize,
+                         transferParam->TestParams->bufferlength);
+        } else {
+            length = GetTransferLength(transferParam);
+        }
+
+        // Get the next available benchmark transfer handle. Transfers are reaped out of order,
+        // so skip any handle that is still in flight.
+        while (transferParam->TransferHandles[transferParam->transferHandleNextIndex].InUse)
+            INC_ROLL(transferParam->transferHandleNextIndex,
+                     transferParam->TestParams->bufferCount);
+
+        handle = &transferParam->TransferHandles[transferParam->transferHandleNextIndex];
+
+        // Frames cut every submission out of the frame being sent.
+        if (transferParam->Frame) {
+            length = NextFrameSegment(transferParam, handle);
+            if (length < 0) {
+                frameHeld = TRUE;
+                handle = NULL;
+                break;
+            }
+        }
+
+        // -B takes every submission from the bucket, the ring prefill included.
+        if (transferParam->TestParams->targetMbps > 0 && !PacerWait(transferParam, length)) {
+            ret = -ERROR_OPERATION_ABORTED;
+            if (transferParam->Frame)
+                FrameSegmentDone(transferParam, handle, ret);
+            goto Final;
+        }
+
+        *handleRef = handle;
 
         // If a libusb-win32 transfer context hasn't been setup for this benchmark transfer
         // handle, do it now.
         //
         if (!handle->Overlapped.hEvent) {
             handle->Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-            // Data buffer(s) are located at the end of the transfer param.
-            handle->Data = transferParam->Buffer + (transferParam->transferHandleNextIndex *
-                                                    transferParam->TestParams->allocBufferSize);
         } else {
             // re-initialize and re-use the overlapped
             ResetEvent(handle->Overlapped.hEvent);
         }
 
-        if (transferParam->Ep.PipeId & USB_ENDPOINT_DIRECTION_MASK) {
-            handle->DataMaxLength = transferParam->TestParams->readlenth;
+        handle->CompletionTime = 0;
+        handle->SubmitTime = GetTimestampNs();
+
+        if (transferParam->TestParams->Backend == BACKEND_LIBUSB) {
+            if (USB_ENDPOINT_DIRECTION_OUT(transferParam->Ep.PipeId))
+                AppendLoopBuffer(transferParam->TestParams, handle->Data, length);
+            handle->DataMaxLength = length;
+            success = UsbSubmitTransfer(transferParam, handle);
+        } else if (transferParam->Ep.PipeId & USB_ENDPOINT_DIRECTION_MASK) {
+            handle->DataMaxLength = length;
             if (transferParam->Ep.PipeType == UsbdPipeTypeIsochronous) {
+                handle->StartFrame = transferParam->frameNumber;
                 success = K.IsochReadPipe(handle->IsochHandle, handle->DataMaxLength,
                                           &transferParam->frameNumber, 0, &handle->Overlapped);
             } else {
                 success =
-                    K.ReadPipe(transferParam->TestParams->InterfaceHandle, transferParam->Ep.PipeId,
+                    K.ReadPipe(transferParam->InterfaceHandle, transferParam->Ep.PipeId,
                                handle->Data, handle->DataMaxLength, NULL, &handle->Overlapped);
             }
         }
 
-        // Isochronous write pipe -> doesn't need right now
         else {
-            AppendLoopBuffer(transferParam->TestParams, handle->Data,
-                             transferParam->TestParams->writelength);
-            handle->DataMaxLength = transferParam->TestParams->writelength;
+            AppendLoopBuffer(transferParam->TestParams, handle->Data, length);
+            handle->DataMaxLength = length;
             if (transferParam->Ep.PipeType == UsbdPipeTypeIsochronous) {
+                handle->StartFrame = transferParam->frameNumber;
                 success = K.IsochWritePipe(handle->IsochHandle, handle->DataMaxLength,
                                            &transferParam->frameNumber, 0, &handle->Overlapped);
             } else {
                 success =
-                    K.WritePipe(transferParam->TestParams->InterfaceHandle, transferParam->Ep.PipeId,
+                    K.WritePipe(transferParam->InterfaceHandle, transferParam->Ep.PipeId,
                                 handle->Data, handle->DataMaxLength, NULL, &handle->Overlapped);
             }
         }
@@ -196,11 +490,13 @@ int TransferAsync(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE
         handle->ReturnCode = ret = -labs(transferErrorCode);
         if (ret < 0) {
             handle->InUse = FALSE;
+            FrameSegmentDone(transferParam, handle, ret);
             goto Final;
         }
 
         // Mark this handle has InUse.
         handle->InUse = TRUE;
+        transferParam->lastSubmittedIndex = handle->Index;
 
         // When transfers ir successfully submitted, OutstandingTransferCount goes up; when
         // they are completed it goes down.
@@ -211,74 +507,56 @@ int TransferAsync(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE
         INC_ROLL(transferParam->transferHandleNextIndex, transferParam->TestParams->bufferCount);
     }
 
-    // If the number of outstanding transfers has reached the limit, wait for the
-    // oldest outstanding transfer to complete.
+    // If the number of outstanding transfers has reached the limit, a workload burst has
+    // submitted all of its transfers, or the next frame has no free record, wait for whichever
+    // outstanding transfer completes first.
     //
-    if (transferParam->outstandingTransferCount == transferParam->TestParams->bufferCount) {
-        UINT transferred;
-        // TransferHandleWaitIndex is the index of the oldest outstanding transfer.
-        *handleRef = handle =
-            &transferParam->TransferHandles[transferParam->transferHandleWaitIndex];
+    if (transferParam->outstandingTransferCount == transferParam->TestParams->bufferCount ||
+        (transferParam->Workload && transferParam->outstandingTransferCount &&
+         !transferParam->Workload->SubmitBudget) ||
+        (frameHeld && transferParam->outstandingTransferCount)) {
+        int handleIndex;
 
         // Only wait, cancelling & freeing is handled by the caller.
-        if (WaitForSingleObject(handle->Overlapped.hEvent, transferParam->TestParams->timeout) !=
-            WAIT_OBJECT_0) {
-            if (!transferParam->TestParams->isUserAborted) {
-                ret = WinError(0);
-            } else
-                ret = -labs(GetLastError());
+        if (transferParam->TestParams->Backend == BACKEND_LIBUSB) {
+            handleIndex = UsbWaitForCompletion(transferParam, msToWait);
+        } else {
+            handleIndex = WaitForAnyTransfer(transferParam, msToWait);
+        }
 
-            handle->ReturnCode = ret;
+        if (handleIndex < 0 && !msToWait) {
+            *handleRef = NULL;
+            ret = 0;
             goto Final;
         }
 
-        if (!K.GetOverlappedResult(transferParam->TestParams->InterfaceHandle, &handle->Overlapped,
-                                   &transferred, FALSE)) {
+        if (handleIndex < 0) {
             if (!transferParam->TestParams->isUserAborted) {
                 ret = WinError(0);
             } else
                 ret = -labs(GetLastError());
 
+            // TransferHandleWaitIndex is where the next wait starts scanning.
+            *handleRef = handle =
+                &transferParam->TransferHandles[transferParam->transferHandleWaitIndex];
             handle->ReturnCode = ret;
             goto Final;
         }
 
-        if (transferParam->Ep.PipeType == UsbdPipeTypeIsochronous &&
-            transferParam->Ep.PipeId & 0x80) {
-            // iso read pipe
-            memset(&handle->IsochResults, 0, sizeof(handle->IsochResults));
-            IsochK_EnumPackets(handle->IsochHandle, &IsoTransferCb, 0, &handle->IsochResults);
-            transferParam->IsochResults.TotalPackets += handle->IsochResults.TotalPackets;
-            transferParam->IsochResults.GoodPackets += handle->IsochResults.GoodPackets;
-            transferParam->IsochResults.BadPackets += handle->IsochResults.BadPackets;
-            transferParam->IsochResults.Length += handle->IsochResults.Length;
-            transferred = handle->IsochResults.Length;
-        }
+        *handleRef = handle = &transferParam->TransferHandles[handleIndex];
+        if (msToWait)
+            transferParam->Wakeups++;
 
-        // Isochronous write pipe -> doesn't need right now
-        else if (transferParam->Ep.PipeType == UsbdPipeTypeIsochronous) {
-            // iso write pipe
-            transferred = handle->DataMaxLength;
+        ret = ReapTransfer(transferParam, handle);
 
-            transferParam->IsochResults.TotalPackets += transferParam->numberOFIsoPackets;
-            transferParam->IsochResults.GoodPackets += transferParam->numberOFIsoPackets;
+        // Resubmit the reaped handle first and start the next wait scan just after it, so
+        // every in-flight handle gets its turn.
+        transferParam->transferHandleNextIndex = handleIndex;
+        if (ret >= 0) {
+            transferParam->transferHandleWaitIndex = handleIndex;
+            INC_ROLL(transferParam->transferHandleWaitIndex,
+                     transferParam->TestParams->bufferCount);
         }
-
-        handle->ReturnCode = ret = (DWORD)transferred;
-
-        if (ret < 0)
-            goto Final;
-
-        // Mark this handle has no longer InUse.
-        handle->InUse = FALSE;
-
-        // When transfers ir successfully submitted, OutstandingTransferCount goes up; when
-        // they are completed it goes down.
-        //
-        transferParam->outstandingTransferCount--;
-
-        // Move TransferHandleWaitIndex to the oldest outstanding transfer.
-        INC_ROLL(transferParam->transferHandleWaitIndex, transferParam->TestParams->bufferCount);
     }
 
 Final:
@@ -292,6 +570,15 @@ void VerifyLoopData() {
 
 
 
+// Streams the endpoint supports, the companion descriptor holds the exponent.
+static int GetMaxStreams(PUVPERF_TRANSFER_PARAM transferParam) {
+    if (!transferParam->HasEpCompanionDescriptor ||
+        !transferParam->EpCompanionDescriptor.bmAttributes.Bulk.MaxStreams)
+        return 0;
+
+    return 1 << transferParam->EpCompanionDescriptor.bmAttributes.Bulk.MaxStreams;
+}
+
 void FreeTransferParam(PUVPERF_TRANSFER_PARAM *transferParamRef) {
     PUVPERF_TRANSFER_PARAM pTransferParam;
     int i;
@@ -299,27 +586,42 @@ void FreeTransferParam(PUVPERF_TRANSFER_PARAM *transferParamRef) {
         return;
     pTransferParam = *transferParamRef;
 
-    if (pTransferParam->TestParams) {
+    if (pTransferParam->TestParams && pTransferParam->TransferHandles) {
         for (i = 0; i < pTransferParam->TestParams->bufferCount; i++) {
             if (pTransferParam->TransferHandles[i].IsochHandle) {
                 IsochK_Free(pTransferParam->TransferHandles[i].IsochHandle);
             }
+            UsbFreeTransfer(&pTransferParam->TransferHandles[i]);
         }
     }
+    free(pTransferParam->TransferHandles);
+    pTransferParam->TransferHandles = NULL;
+    UsbFreeCompletionQueue(pTransferParam);
+    FreeBufferPool(&pTransferParam->BufferPool);
+    free(pTransferParam->IsoTimeline);
+    free(pTransferParam->Latency);
+    FreePacer(&pTransferParam->Pacer);
+    FreeWorkload(pTransferParam);
+    FreeRecovery(pTransferParam);
+    FreeFrame(pTransferParam);
+    FreePolling(pTransferParam);
+
     if (pTransferParam->ThreadHandle) {
         CloseHandle(pTransferParam->ThreadHandle);
         pTransferParam->ThreadHandle = NULL;
     }
 
-    free(pTransferParam);
+    _aligned_free(pTransferParam);
 
     *transferParamRef = NULL;
 }
 
 PUVPERF_TRANSFER_PARAM CreateTransferParam(PUVPERF_PARAM TestParam, int endpointID) {
     PUVPERF_TRANSFER_PARAM transferParam = NULL;
+    PUVPERF_ASSOCIATED_INTERFACE associated = NULL;
     int pipeIndex, bufferIndex;
     int allocSize;
+    UCHAR associatedPipeIndex;
 
     PWINUSB_PIPE_INFORMATION_EX pipeInfo = NULL;
 
@@ -340,6 +642,15 @@ PUVPERF_TRANSFER_PARAM CreateTransferParam(PUVPERF_PARAM TestParam, int endpoint
         }
     }
 
+    // -A and -e may run pipes on the other interfaces of a composite device.
+    if (!pipeInfo && (endpointID & USB_ENDPOINT_ADDRESS_MASK)) {
+        associated = Bench_FindAssociatedPipe(TestParam, endpointID, &associatedPipeIndex);
+        if (associated) {
+            pipeIndex = associatedPipeIndex;
+            pipeInfo = &associated->PipeInformation[pipeIndex];
+        }
+    }
+
     if (!pipeInfo) {
         LOG_ERROR("failed locating EP0x%02X\n", endpointID);
         goto Final;
@@ -352,19 +663,100 @@ PUVPERF_TRANSFER_PARAM CreateTransferParam(PUVPERF_PARAM TestParam, int endpoint
 
     TestParam->bufferlength = max(TestParam->bufferlength, TestParam->readlenth);
     TestParam->bufferlength = max(TestParam->bufferlength, TestParam->writelength);
+    if (TestParam->workloadSpec)
+        TestParam->bufferlength = max(TestParam->bufferlength, TestParam->WorkloadProfile.maxSize);
 
-    allocSize = sizeof(UVPERF_TRANSFER_PARAM) + (TestParam->bufferlength * TestParam->bufferCount);
-    transferParam = (PUVPERF_TRANSFER_PARAM)malloc(allocSize);
+    // malloc only guarantees 16 bytes, Stats needs its cache line alignment.
+    allocSize = sizeof(UVPERF_TRANSFER_PARAM);
+    transferParam = (PUVPERF_TRANSFER_PARAM)_aligned_malloc(allocSize, CACHE_LINE_SIZE);
 
     if (transferParam) {
         UINT numIsoPackets;
         memset(transferParam, 0, allocSize);
         transferParam->TestParams = TestParam;
+        transferParam->Cpu = -1;
+
+        // Data buffers live in their own page aligned, pre-faulted and locked pool.
+        TestParam->allocBufferSize =
+            CreateBufferPool(&transferParam->BufferPool, TestParam->bufferlength,
+                             TestParam->bufferCount, TestParam->useLargePages);
+        if (TestParam->allocBufferSize < 0) {
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+        transferParam->Buffer = transferParam->BufferPool.Data;
+
+        // The handle ring is sized from bufferCount so deep queues are not capped.
+        transferParam->TransferHandles =
+            calloc(TestParam->bufferCount, sizeof(UVPERF_TRANSFER_HANDLE));
+        if (!transferParam->TransferHandles) {
+            LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+
+        // Each handle gets its own page aligned slice of the buffer pool.
+        for (bufferIndex = 0; bufferIndex < TestParam->bufferCount; bufferIndex++) {
+            transferParam->TransferHandles[bufferIndex].TransferParam = transferParam;
+            transferParam->TransferHandles[bufferIndex].Index = bufferIndex;
+            transferParam->TransferHandles[bufferIndex].Data =
+                transferParam->Buffer + (bufferIndex * transferParam->BufferPool.Stride);
+        }
+
+        if (TestParam->Backend == BACKEND_LIBUSB && UsbInitCompletionQueue(transferParam) < 0) {
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+
+        transferParam->Latency = calloc(1, sizeof(UVPERF_LATENCY_HISTOGRAM));
+        if (!transferParam->Latency) {
+            LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+
+        // The bucket holds one ring of transfers, enough to catch up after a late completion.
+        if (TestParam->targetMbps > 0 &&
+            InitPacer(&transferParam->Pacer, TestParam->targetMbps * 1000 * 1000 / 8,
+                      TestParam->bufferCount * TestParam->bufferlength) < 0) {
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
 
         memcpy(&transferParam->Ep, pipeInfo, sizeof(transferParam->Ep));
+        if (associated) {
+            transferParam->InterfaceHandle = associated->InterfaceHandle;
+            transferParam->InterfaceNumber = associated->InterfaceDescriptor.bInterfaceNumber;
+            transferParam->AltSetting = associated->InterfaceDescriptor.bAlternateSetting;
+        } else {
+            transferParam->InterfaceHandle = TestParam->InterfaceHandle;
+            transferParam->InterfaceNumber = TestParam->InterfaceDescriptor.bInterfaceNumber;
+            transferParam->AltSetting = TestParam->InterfaceDescriptor.bAlternateSetting;
+        }
+
+        if (TestParam->workloadSpec && CreateWorkload(transferParam) < 0) {
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+
+        if (CreateRecovery(transferParam) < 0) {
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+
+        if (TestParam->frameSize && CreateFrame(transferParam) < 0) {
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+
+        if (TestParam->measurePolling && CreatePolling(transferParam) < 0) {
+            FreeTransferParam(&transferParam);
+            goto Final;
+        }
+
         transferParam->HasEpCompanionDescriptor = K.GetSuperSpeedPipeCompanionDescriptor(
-            TestParam->InterfaceHandle, TestParam->InterfaceDescriptor.bAlternateSetting,
-            (UCHAR)pipeIndex, &transferParam->EpCompanionDescriptor);
+            transferParam->InterfaceHandle, transferParam->AltSetting, (UCHAR)pipeIndex,
+            &transferParam->EpCompanionDescriptor);
 
         if (ENDPOINT_TYPE(transferParam) == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
             transferParam->TestParams->TransferMode = TRANSFER_MODE_ASYNC;
@@ -391,17 +783,44 @@ PUVPERF_TRANSFER_PARAM CreateTransferParam(PUVPERF_PARAM TestParam, int endpoint
                 goto Final;
             }
 
+            // bInterval is an exponent for isochronous endpoints at every speed, counted in
+            // frames at full speed and in microframes above.
+            transferParam->isoPacketMicroframes =
+                1U << (min(max(transferParam->Ep.Interval, 1), 16) - 1);
+            if (GetDeviceSpeed(TestParam) < HighSpeed)
+                transferParam->isoPacketMicroframes *= 8;
+
+            if (TestParam->isoTimelineSize > 0) {
+                transferParam->IsoTimeline =
+                    calloc(TestParam->isoTimelineSize, sizeof(UVPERF_ISO_PACKET_RECORD));
+                if (!transferParam->IsoTimeline) {
+                    LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+                    FreeTransferParam(&transferParam);
+                    goto Final;
+                }
+            }
+
+            // Write transfers only send as many packets as writelength fills.
+            if (USB_ENDPOINT_DIRECTION_OUT(transferParam->Ep.PipeId)) {
+                if (TestParam->writelength <= 0) {
+                    LOG_ERROR("Write length must be at least one packet for isochronous pipe "
+                              "0x%02X\n",
+                              transferParam->Ep.PipeId);
+                    FreeTransferParam(&transferParam);
+                    goto Final;
+                }
+                transferParam->numberOFIsoPackets =
+                    (TestParam->writelength + transferParam->Ep.MaximumBytesPerInterval - 1) /
+                    transferParam->Ep.MaximumBytesPerInterval;
+            }
+
             for (bufferIndex = 0; bufferIndex < transferParam->TestParams->bufferCount;
                  bufferIndex++) {
                 transferParam->TransferHandles[bufferIndex].Overlapped.hEvent =
                     CreateEvent(NULL, TRUE, FALSE, NULL);
 
-                // Data buffer(s) are located at the end of the transfer param.
-                transferParam->TransferHandles[bufferIndex].Data =
-                    transferParam->Buffer + (bufferIndex * transferParam->TestParams->bufferlength);
-
                 if (!IsochK_Init(&transferParam->TransferHandles[bufferIndex].IsochHandle,
-                                 TestParam->InterfaceHandle, transferParam->Ep.PipeId,
+                                 transferParam->InterfaceHandle, transferParam->Ep.PipeId,
                                  numIsoPackets, transferParam->TransferHandles[bufferIndex].Data,
                                  transferParam->TestParams->bufferlength)) {
                     DWORD ec = GetLastError();
@@ -424,14 +843,32 @@ PUVPERF_TRANSFER_PARAM CreateTransferParam(PUVPERF_PARAM TestParam, int endpoint
                     FreeTransferParam(&transferParam);
                     goto Final;
                 }
+
+                if (!IsochK_SetNumberOfPackets(
+                        transferParam->TransferHandles[bufferIndex].IsochHandle,
+                        transferParam->numberOFIsoPackets)) {
+                    DWORD ec = GetLastError();
+
+                    LOG_ERROR("IsochK_SetNumberOfPackets failed for isochronous pipe %02X\n",
+                              transferParam->Ep.PipeId);
+                    LOG_ERROR("- ErrorCode = %u (%s)\n", ec, strerror(ec));
+                    FreeTransferParam(&transferParam);
+                    goto Final;
+                }
             }
         }
 
-        transferParam->ThreadHandle =
-            CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)TransferThread, transferParam,
-                         CREATE_SUSPENDED, &transferParam->ThreadId);
+        // In event loop mode EngineThread services every endpoint instead, in ping-pong mode
+        // RunPingPong does.
+        if (!TestParam->useEventLoop && !TestParam->pingPongCount) {
+            transferParam->ThreadHandle = CreateThread(
+                NULL, 0,
+                (LPTHREAD_START_ROUTINE)(transferParam->Workload ? WorkloadThread : TransferThread),
+                transferParam, CREATE_SUSPENDED, &transferParam->ThreadId);
+        }
 
-        if (!transferParam->ThreadHandle) {
+        if (!TestParam->useEventLoop && !TestParam->pingPongCount &&
+            !transferParam->ThreadHandle) {
             LOGERR0("failed creating thread!\n");
             FreeTransferParam(&transferParam);
             goto Final;
@@ -479,286 +916,622 @@ Final:
     return transferParam;
 }
 
-void GetAverageBytesSec(PUVPERF_TRANSFER_PARAM transferParam, DOUBLE *byteps) {
-    DWORD elapsedSeconds = 0.0;
-    if (!transferParam)
+// Creates the transfer params of a run: every -e/-A endpoint in its own direction, otherwise the
+// In and/or Out pipe of -e as selected by the test type. Returns the number of transfer params
+// or -1, in which case none are left allocated.
+int CreateTransferParams(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM *transferParams) {
+    int transferParamCount = 0;
+    int i;
+
+    if (TestParams->endpointCount > 1 || TestParams->allEndpoints) {
+        for (i = 0; i < TestParams->endpointCount; i++) {
+            LOG_VERBOSE("CreateTransferParam for Ep0x%02X\n", TestParams->endpoints[i]);
+            transferParams[transferParamCount] =
+                CreateTransferParam(TestParams, TestParams->endpoints[i]);
+            if (!transferParams[transferParamCount])
+                goto Error;
+            transferParamCount++;
+        }
+    } else {
+        if (TestParams->TestType & TestTypeIn) {
+            LOG_VERBOSE("CreateTransferParam for InTest\n");
+            transferParams[transferParamCount] = CreateTransferParam(
+                TestParams, TestParams->endpoint | USB_ENDPOINT_DIRECTION_MASK);
+            if (!transferParams[transferParamCount]) {
+                LOGERR0("Failed to create transfer param for InTest\n");
+                goto Error;
+            }
+            transferParamCount++;
+        }
+
+        if (TestParams->TestType & TestTypeOut) {
+            LOG_VERBOSE("CreateTransferParam for OutTest\n");
+            transferParams[transferParamCount] =
+                CreateTransferParam(TestParams, TestParams->endpoint & 0x0F);
+            if (!transferParams[transferParamCount])
+                goto Error;
+            transferParamCount++;
+        }
+    }
+
+    for (i = 0; i < transferParamCount && TestParams->cpuCount; i++)
+        transferParams[i]->Cpu = TestParams->cpus[i % TestParams->cpuCount];
+
+    return transferParamCount;
+
+Error:
+    while (transferParamCount > 0)
+        FreeTransferParam(&transferParams[--transferParamCount]);
+    return -1;
+}
+
+// Gives a (suspended) transfer thread the -Y thread priority and pins it to cpu, unless cpu is -1.
+static void PlaceThread(PUVPERF_PARAM TestParams, HANDLE thread, int cpu) {
+    SetThreadPriority(thread, TestParams->priority);
+    if (cpu >= 0 && !SetThreadAffinityMask(thread, (DWORD_PTR)1 << cpu))
+        LOG_WARNING("failed pinning thread to CPU %d, ec=%u\n", cpu, GetLastError());
+}
+
+// Applies the pipe policies, schedules the first isochronous frame and starts the transfer
+// thread(s), or the event loop with -E.
+int StartTransferParams(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM *transferParams,
+                        int transferParamCount) {
+    UCHAR bIsoAsap;
+    long ec;
+    int i;
+
+    for (i = 0; i < transferParamCount; i++) {
+        if (TestParams->fixedIsoPackets &&
+            USB_ENDPOINT_DIRECTION_OUT(transferParams[i]->Ep.PipeId)) {
+            if (!K.SetPipePolicy(transferParams[i]->InterfaceHandle,
+                                 transferParams[i]->Ep.PipeId, ISO_NUM_FIXED_PACKETS, 2,
+                                 &TestParams->fixedIsoPackets)) {
+                ec = GetLastError();
+                LOG_ERROR("SetPipePolicy:ISO_NUM_FIXED_PACKETS failed. ErrorCode=0x%08X, "
+                          "message : %s\n",
+                          ec, strerror(ec));
+                return -1;
+            }
+        }
+        if (TestParams->UseRawIO != 0xFF) {
+            if (!K.SetPipePolicy(transferParams[i]->InterfaceHandle,
+                                 transferParams[i]->Ep.PipeId, RAW_IO, 1,
+                                 &TestParams->UseRawIO)) {
+                ec = GetLastError();
+                LOG_ERROR("SetPipePolicy:RAW_IO failed. ErrorCode=%08Xh message : %s\n", ec,
+                          strerror(ec));
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < transferParamCount; i++) {
+        if (transferParams[i]->Ep.PipeType == UsbdPipeTypeIsochronous)
+            break;
+    }
+    if (i < transferParamCount) {
+        UINT frameNumber;
+        LOG_VERBOSE("GetCurrentFrameNumber\n");
+        if (!K.GetCurrentFrameNumber(TestParams->InterfaceHandle, &frameNumber)) {
+            ec = GetLastError();
+            LOG_ERROR("GetCurrentFrameNumber Failed. ErrorCode=%u, message : %s", ec, strerror(ec));
+            return -1;
+        }
+        frameNumber += TestParams->bufferCount * 2;
+        for (i = 0; i < transferParamCount; i++) {
+            transferParams[i]->frameNumber = frameNumber;
+            frameNumber++;
+        }
+    }
+
+    bIsoAsap = (UCHAR)TestParams->UseIsoAsap;
+    for (i = 0; i < transferParamCount; i++)
+        K.SetPipePolicy(transferParams[i]->InterfaceHandle, transferParams[i]->Ep.PipeId,
+                        ISO_ALWAYS_START_ASAP, 1, &bIsoAsap);
+
+    TestParams->TransferParams = transferParams;
+    TestParams->transferParamCount = transferParamCount;
+    StartCpuUsage(TestParams);
+
+    if (TestParams->useEventLoop) {
+        LOG_VERBOSE("Start EngineThread\n");
+        TestParams->EngineThreadHandle = CreateThread(
+            NULL, 0, (LPTHREAD_START_ROUTINE)EngineThread, TestParams, CREATE_SUSPENDED, NULL);
+        if (!TestParams->EngineThreadHandle) {
+            LOGERR0("failed creating thread!\n");
+            return -1;
+        }
+        PlaceThread(TestParams, TestParams->EngineThreadHandle,
+                    TestParams->cpuCount ? TestParams->cpus[0] : -1);
+        ResumeThread(TestParams->EngineThreadHandle);
+    } else {
+        for (i = 0; i < transferParamCount; i++) {
+            LOG_VERBOSE("ResumeThread for Ep0x%02X\n", transferParams[i]->Ep.PipeId);
+            PlaceThread(TestParams, transferParams[i]->ThreadHandle, transferParams[i]->Cpu);
+            ResumeThread(transferParams[i]->ThreadHandle);
+        }
+    }
+
+    return 0;
+}
+
+// Cancels whatever transferParam has in flight, from any thread. libusbK aborts the whole pipe in
+// one call; cancelling a libusb transfer that is not in flight is a no-op. libusb synchronous
+// transfers can't be cancelled and run into their timeout.
+static void AbortTransferParam(PUVPERF_TRANSFER_PARAM transferParam) {
+    int i;
+
+    if (transferParam->TestParams->Backend == BACKEND_LIBUSB) {
+        for (i = 0; i < transferParam->TestParams->bufferCount; i++)
+            UsbCancelTransfer(&transferParam->TransferHandles[i]);
+    } else {
+        K.AbortPipe(transferParam->InterfaceHandle, transferParam->Ep.PipeId);
+    }
+}
+
+// Stops the transfer thread(s) once isCancelled is set. Every pipe is aborted at once instead of
+// after its thread's next transfer timeout, and all threads share one deadline.
+void StopTransferParams(PUVPERF_PARAM TestParams, PUVPERF_TRANSFER_PARAM *transferParams,
+                        int transferParamCount) {
+    HANDLE threads[MAX_TRANSFER_PARAMS + 1];
+    DWORD threadCount = 0;
+    LONGLONG stopStart = GetTimestampNs();
+    int i;
+
+    for (i = 0; i < transferParamCount; i++) {
+        AbortTransferParam(transferParams[i]);
+
+        // A thread that was never resumed (failed start) runs straight into isCancelled.
+        if (transferParams[i]->ThreadHandle) {
+            ResumeThread(transferParams[i]->ThreadHandle);
+            threads[threadCount++] = transferParams[i]->ThreadHandle;
+        }
+    }
+    if (TestParams->EngineThreadHandle)
+        threads[threadCount++] = TestParams->EngineThreadHandle;
+
+    // A thread may resubmit between the abort and seeing isCancelled, abort again until it stops.
+    while (threadCount &&
+           WaitForMultipleObjects(threadCount, threads, TRUE, STOP_DEADLINE_MS) == WAIT_TIMEOUT) {
+        for (i = 0; i < transferParamCount; i++) {
+            if (transferParams[i]->isRunning) {
+                LOG_WARNING("Aborting %s Pipe 0x%02X..\n",
+                            TRANSFER_DISPLAY(transferParams[i], "Read", "Write"),
+                            transferParams[i]->Ep.PipeId);
+                AbortTransferParam(transferParams[i]);
+            }
+        }
+    }
+
+    LOG_MSG("stopped %d thread(s) in %.1f ms\n", threadCount,
+            (GetTimestampNs() - stopStart) / 1000000.0);
+
+    if (TestParams->EngineThreadHandle) {
+        CloseHandle(TestParams->EngineThreadHandle);
+        TestParams->EngineThreadHandle = NULL;
+    }
+}
+
+// The transfer thread is the only writer of its statistics, so instead of a lock they are
+// published through StatsSequence: the writer never waits and a reader that raced an update
+// simply copies again.
+static void BeginStatsUpdate(PUVPERF_TRANSFER_PARAM transferParam) {
+    InterlockedIncrement(&transferParam->Stats.Sequence);
+}
+
+static void EndStatsUpdate(PUVPERF_TRANSFER_PARAM transferParam) {
+    InterlockedIncrement(&transferParam->Stats.Sequence);
+}
+
+// Copies the statistics of transferParam to snapshot, retrying until the copy did not race an
+// update.
+void ReadTransferStats(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_STATS snapshot) {
+    LONG sequence;
+
+    do {
+        while ((sequence = transferParam->Stats.Sequence) & 1)
+            YieldProcessor();
+        MemoryBarrier();
+        memcpy(snapshot, &transferParam->Stats, sizeof(*snapshot));
+        MemoryBarrier();
+    } while (sequence != transferParam->Stats.Sequence);
+}
+
+void GetAverageBytesSec(PUVPERF_TRANSFER_STATS stats, DOUBLE *byteps) {
+    DOUBLE elapsedSeconds = 0.0;
+    if (!stats)
         return;
 
-    if (transferParam->StartTick.tv_nsec &&
-        (transferParam->StartTick.tv_sec + transferParam->StartTick.tv_nsec / 1000000000.0) <
-            (transferParam->LastTick.tv_sec + transferParam->LastTick.tv_nsec / 1000000000.0)) {
+    if (stats->StartTick && stats->StartTick < stats->LastTick) {
 
-        elapsedSeconds =
-            (transferParam->LastTick.tv_sec - transferParam->StartTick.tv_sec) +
-            (transferParam->LastTick.tv_nsec - transferParam->StartTick.tv_nsec) / 1000000000.0;
+        elapsedSeconds = (stats->LastTick - stats->StartTick) / 1000000000.0;
 
-        *byteps = (DOUBLE)transferParam->TotalTransferred / elapsedSeconds;
-        if(transferParam->TotalTransferred == 0)
+        *byteps = (DOUBLE)stats->TotalTransferred / elapsedSeconds;
+        if(stats->TotalTransferred == 0)
             *byteps = 0;
     } else {
         *byteps = 0;
     }
 }
-void GetCurrentBytesSec(PUVPERF_TRANSFER_PARAM transferParam, DOUBLE *byteps) {
-    DWORD elapsedSeconds;
-    if (!transferParam)
+void GetCurrentBytesSec(PUVPERF_TRANSFER_STATS stats, DOUBLE *byteps) {
+    DOUBLE elapsedSeconds;
+    if (!stats)
         return;
 
-    if (transferParam->LastStartTick.tv_nsec &&
-        (transferParam->LastStartTick.tv_sec +
-         transferParam->LastStartTick.tv_nsec / 1000000000.0) <
-            (transferParam->LastTick.tv_sec + transferParam->LastTick.tv_nsec / 1000000000.0)) {
+    if (stats->LastStartTick && stats->LastStartTick < stats->LastTick) {
 
-        elapsedSeconds =
-            (transferParam->LastTick.tv_sec - transferParam->LastStartTick.tv_sec) +
-            (transferParam->LastTick.tv_nsec - transferParam->LastStartTick.tv_nsec) / 1000000000.0;
+        elapsedSeconds = (stats->LastTick - stats->LastStartTick) / 1000000000.0;
 
-        *byteps = (DOUBLE)transferParam->LastTransferred / elapsedSeconds;
+        *byteps = (DOUBLE)stats->LastTransferred / elapsedSeconds;
     } else {
         *byteps = 0;
     }
 }
 
-void ShowRunningStatus(PUVPERF_TRANSFER_PARAM readParam, PUVPERF_TRANSFER_PARAM writeParam) {
-    static UVPERF_TRANSFER_PARAM gReadParamTransferParam, gWriteParamTransferParam;
-    DOUBLE bpsReadOverall = 0;
-    DOUBLE bpsReadLastTransfer = 0;
-    DOUBLE bpsWriteOverall = 0;
-    DOUBLE bpsWriteLastTransfer = 0;
+void GetAverageQueueDepth(PUVPERF_TRANSFER_STATS stats, DOUBLE *depth) {
+    if (!stats)
+        return;
+
+    if (stats->QueueDepthSamples) {
+        *depth = (DOUBLE)stats->QueueDepthTotal / stats->QueueDepthSamples;
+    } else {
+        *depth = 0;
+    }
+}
+
+static BOOL IsRunningStats(PUVPERF_TRANSFER_STATS stats) {
+    return stats->StartTick && stats->StartTick <= stats->LastTick;
+}
+
+void ShowRunningStatus(PUVPERF_TRANSFER_PARAM *transferParams, int transferParamCount) {
+    static UVPERF_TRANSFER_STATS gTransferStats[MAX_TRANSFER_PARAMS];
+    PUVPERF_TRANSFER_PARAM transferParam;
+    PUVPERF_TRANSFER_STATS stats;
+    DOUBLE bpsOverall;
+    DOUBLE bpsLastTransfer;
+    DOUBLE queueDepth;
+    DOUBLE bpsTotalOverall = 0;
+    DOUBLE bpsTotalLastTransfer = 0;
     UINT zlp = 0;
     UINT totalPackets = 0;
     UINT totalIsoPackets = 0;
     UINT goodIsoPackets = 0;
     UINT badIsoPackets = 0;
-    UINT errorCount = 0;
-
-    // LOCK the display critical section
-    EnterCriticalSection(&DisplayCriticalSection);
-
-    if (readParam)
-        memcpy(&gReadParamTransferParam, readParam, sizeof(UVPERF_TRANSFER_PARAM));
-
-    if (writeParam)
-        memcpy(&gWriteParamTransferParam, writeParam, sizeof(UVPERF_TRANSFER_PARAM));
+    int isoUnderruns = 0;
+    int running = 0;
+    int i;
 
-    // UNLOCK the display critical section
-    LeaveCriticalSection(&DisplayCriticalSection);
+    for (i = 0; i < transferParamCount; i++)
+        ReadTransferStats(transferParams[i], &gTransferStats[i]);
 
-    if (readParam != NULL && (!gReadParamTransferParam.StartTick.tv_nsec ||
-                              (gReadParamTransferParam.StartTick.tv_sec +
-                               gReadParamTransferParam.StartTick.tv_nsec / 1000000000.0) >
-                                  (gReadParamTransferParam.LastTick.tv_sec +
-                                   gReadParamTransferParam.LastTick.tv_nsec / 1000000000.0))) {
-        LOG_MSG("Synchronizing Read %d..\n", abs(gReadParamTransferParam.Packets));
-        errorCount++;
-        if (errorCount > 5) {
-            LOGERR0("Too many errors, exiting..\n");
-            return;
+    // An endpoint still waiting for its first completion doesn't hold back the others' report.
+    for (i = 0; i < transferParamCount; i++) {
+        transferParam = transferParams[i];
+        stats = &gTransferStats[i];
+        if (!IsRunningStats(stats)) {
+            LOG_MSG("Synchronizing %s Ep0x%02X %d..\n",
+                    TRANSFER_DISPLAY(transferParam, "Read", "Write"), transferParam->Ep.PipeId,
+                    abs(stats->Packets));
+        } else {
+            running++;
         }
     }
+    if (!running)
+        return;
 
-    if (writeParam != NULL && (!gWriteParamTransferParam.StartTick.tv_nsec ||
-                               (gWriteParamTransferParam.StartTick.tv_sec +
-                                gWriteParamTransferParam.StartTick.tv_nsec / 1000000000.0) >
-                                   (gWriteParamTransferParam.LastTick.tv_sec +
-                                    gWriteParamTransferParam.LastTick.tv_nsec / 1000000000.0))) {
-        LOG_MSG("Synchronizing Write %d..\n", abs(gWriteParamTransferParam.Packets));
-        errorCount++;
-        if (errorCount > 5) {
-            LOGERR0("Too many errors, exiting..\n");
-            return;
+    for (i = 0; i < transferParamCount; i++) {
+        transferParam = transferParams[i];
+        stats = &gTransferStats[i];
+        if (!IsRunningStats(stats))
+            continue;
+
+        GetAverageBytesSec(stats, &bpsOverall);
+        GetCurrentBytesSec(stats, &bpsLastTransfer);
+        if (stats->LastTransferred == 0)
+            zlp++;
+        InterlockedExchange(&transferParam->WindowReset.Requested, TRUE);
+
+        bpsTotalOverall += bpsOverall;
+        bpsTotalLastTransfer += bpsLastTransfer;
+        totalPackets += stats->Packets;
+        totalIsoPackets += stats->IsochResults.TotalPackets;
+        goodIsoPackets += stats->IsochResults.GoodPackets;
+        badIsoPackets += stats->IsochResults.BadPackets;
+        isoUnderruns += stats->isoUnderrunCount;
+
+        // Per-endpoint breakdown when several endpoints share the host controller.
+        if (transferParamCount > 1) {
+            LOG_MSG("Ep0x%02X %-11s %-5s : Average %.2f Mbps, Current %.2f Mbps, %d Transfers\n",
+                    transferParam->Ep.PipeId,
+                    EndpointTypeDisplayString[ENDPOINT_TYPE(transferParam)],
+                    TRANSFER_DISPLAY(transferParam, "Read", "Write"),
+                    (bpsOverall * 8) / 1000 / 1000, (bpsLastTransfer * 8) / 1000 / 1000,
+                    stats->Packets);
         }
+    }
 
-    } else {
-        if (readParam) {
-            GetAverageBytesSec(&gReadParamTransferParam, &bpsReadOverall);
-            GetCurrentBytesSec(&gReadParamTransferParam, &bpsReadLastTransfer);
-            if (gReadParamTransferParam.LastTransferred == 0)
-                zlp++;
-            readParam->LastStartTick.tv_nsec = 0.0;
-            totalPackets += gReadParamTransferParam.Packets;
-            totalIsoPackets += gReadParamTransferParam.IsochResults.TotalPackets;
-            goodIsoPackets += gReadParamTransferParam.IsochResults.GoodPackets;
-            badIsoPackets += gReadParamTransferParam.IsochResults.BadPackets;
-        }
-
-        if (writeParam) {
-            GetAverageBytesSec(&gWriteParamTransferParam, &bpsWriteOverall);
-            GetCurrentBytesSec(&gWriteParamTransferParam, &bpsWriteLastTransfer);
-
-            if (gWriteParamTransferParam.LastTransferred == 0) {
-                zlp++;
-            }
+    if (transferParamCount > 1)
+        LOG_MSG("Aggregate Current %.2f Mbps\n", (bpsTotalLastTransfer * 8) / 1000 / 1000);
 
-            writeParam->LastStartTick.tv_nsec = 0.0;
-            totalPackets += gWriteParamTransferParam.Packets;
-            totalIsoPackets += gWriteParamTransferParam.IsochResults.TotalPackets;
-            goodIsoPackets += gWriteParamTransferParam.IsochResults.GoodPackets;
-            badIsoPackets += gWriteParamTransferParam.IsochResults.BadPackets;
-        }
-        if (totalIsoPackets) {
-            LOG_MSG("Average %.2f Mbps\n", ((bpsReadOverall + bpsWriteOverall) * 8) / 1000 / 1000);
-            LOG_MSG("Total %d Transfer\n", totalPackets);
-            LOG_MSG("ISO-Packets (Total/Good/Bad) : %u/%u/%u\n", totalIsoPackets, goodIsoPackets,
-                    badIsoPackets);
+    if (totalIsoPackets) {
+        LOG_MSG("Average %.2f Mbps\n", (bpsTotalOverall * 8) / 1000 / 1000);
+        LOG_MSG("Total %d Transfer\n", totalPackets);
+        LOG_MSG("ISO-Packets (Total/Good/Bad) : %u/%u/%u\n", totalIsoPackets, goodIsoPackets,
+                badIsoPackets);
+        if (isoUnderruns)
+            LOG_MSG("ISO-Underruns : %d\n", isoUnderruns);
+    } else {
+        if (zlp) {
+            LOG_MSG("Average %.2f Mbps\n", bpsTotalOverall * 8 / 1000 / 1000);
+            LOG_MSG("Transfers: %u\n", totalPackets);
+            LOG_MSG("Zero-length-transfer(s)\n", zlp);
         } else {
-            if (zlp) {
-                LOG_MSG("Average %.2f Mbps\n",
-                        (bpsReadOverall + bpsWriteOverall) * 8 / 1000 / 1000);
-                LOG_MSG("Transfers: %u\n", totalPackets);
-                LOG_MSG("Zero-length-transfer(s)\n", zlp);
-            } else {
-                LOG_MSG("Average %.2f Mbps\n",
-                        (bpsReadOverall + bpsWriteOverall) * 8 / 1000 / 1000);
-                LOG_MSG("Total %d Transfers\n", totalPackets);
-                LOG_MSG("\n");
-            }
+            LOG_MSG("Average %.2f Mbps\n", bpsTotalOverall * 8 / 1000 / 1000);
+            LOG_MSG("Total %d Transfers\n", totalPackets);
+            LOG_MSG("\n");
         }
     }
+
+    for (i = 0; i < transferParamCount; i++) {
+        transferParam = transferParams[i];
+        stats = &gTransferStats[i];
+        GetAverageQueueDepth(stats, &queueDepth);
+        if (queueDepth)
+            LOG_MSG("Ep0x%02X queue depth %.1f (max %d of %d)\n", transferParam->Ep.PipeId,
+                    queueDepth, stats->MaxQueueDepth,
+                    transferParam->TestParams->bufferCount);
+    }
 }
 
+// Accounts one timed out wait on transferParam. Returns FALSE once more than -R timeouts came in
+// a row.
+BOOL TransferTimedOut(PUVPERF_TRANSFER_PARAM transferParam) {
+    transferParam->Stats.TotalTimeoutCount++;
+    transferParam->RunningTimeoutCount++;
+    LOG_ERROR("Timeout #%d %s on EP%02Xh.. \n", transferParam->RunningTimeoutCount,
+              TRANSFER_DISPLAY(transferParam, "reading", "writing"), transferParam->Ep.PipeId);
 
-DWORD TransferThread(PUVPERF_TRANSFER_PARAM transferParam) {
-    int ret, i;
-    PUVPERF_TRANSFER_HANDLE handle;
-    unsigned char *buffer;
+    return transferParam->RunningTimeoutCount <= transferParam->TestParams->retry;
+}
 
-    transferParam->isRunning = TRUE;
+// Accounts one finished transfer (or transfer error) against transferParam. Returns FALSE once
+// the endpoint should stop: user abort, too many consecutive timeouts, or an error the recovery
+// could not clear.
+BOOL TransferComplete(PUVPERF_TRANSFER_PARAM transferParam, unsigned char *buffer, int ret) {
+    InjectStall(transferParam, ret);
 
-    while (!transferParam->TestParams->isCancelled) {
-        buffer = NULL;
-        handle = NULL;
+    if (transferParam->TestParams->verify && transferParam->TestParams->VerifyList &&
+        transferParam->TestParams->TestType == TestTypeLoop &&
+        USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId) && ret > 0) {
+        VerifyLoopData(transferParam->TestParams, buffer);
+    }
 
-        if (transferParam->TestParams->TransferMode == TRANSFER_MODE_SYNC) {
-            ret = TransferSync(transferParam);
-            if (ret >= 0)
-                buffer = transferParam->Buffer;
-        } else if (transferParam->TestParams->TransferMode == TRANSFER_MODE_ASYNC) {
-            ret = TransferAsync(transferParam, &handle);
-            if ((handle) && ret >= 0)
-                buffer = transferParam->Buffer;
-        } else {
-            LOG_ERROR("Invalid transfer mode %d\n", transferParam->TestParams->TransferMode);
-            goto Final;
-        }
+    if (ret < 0) {
+        // user pressed 'Q' or 'ctrl+c'
+        if (transferParam->TestParams->isUserAborted)
+            return FALSE;
 
-        if (transferParam->TestParams->verify && transferParam->TestParams->VerifyList &&
-            transferParam->TestParams->TestType == TestTypeLoop &&
-            USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId) && ret > 0) {
-            VerifyLoopData(transferParam->TestParams, buffer);
+        // timeout
+        if (-ret == ERROR_SEM_TIMEOUT) {
+            if (!TransferTimedOut(transferParam))
+                return FALSE;
         }
 
-        if (ret < 0) {
-            // user pressed 'Q' or 'ctrl+c'
-            if (transferParam->TestParams->isUserAborted)
-                break;
-
-            // timeout
-            if (ret == ERROR_SEM_TIMEOUT || ret == ERROR_OPERATION_ABORTED ||
-                ret == ERROR_CANCELLED) {
-                transferParam->TotalTimeoutCount++;
-                transferParam->RunningTimeoutCount++;
-                LOG_ERROR("Timeout #%d %s on EP%02Xh.. \n", transferParam->RunningTimeoutCount,
-                          TRANSFER_DISPLAY(transferParam, "reading", "writing"),
-                          transferParam->Ep.PipeId);
+        // other error, a stall or a transfer aborted by someone else (e.g. another endpoint
+        // re-claiming the interface): take the next recovery step, see recovery.c
+        else {
+            transferParam->Stats.TotalErrorCount++;
+            transferParam->RunningErrorCount++;
+            LOG_ERROR("failed %s, error #%d ret=%d\n",
+                      TRANSFER_DISPLAY(transferParam, "reading", "writing"),
+                      transferParam->RunningErrorCount, ret);
 
-                if (transferParam->RunningTimeoutCount > transferParam->TestParams->retry)
-                    break;
-            }
+            if (!RecoverTransferParam(transferParam, ret))
+                return FALSE;
+        }
 
-            // other error
-            else {
-                transferParam->TotalErrorCount++;
-                transferParam->RunningErrorCount++;
-                LOG_ERROR("failed %s, %d of %d ret=%d, error message : %s\n",
-                          TRANSFER_DISPLAY(transferParam, "reading", "writing"),
-                          transferParam->RunningErrorCount, transferParam->TestParams->retry + 1,
-                          ret, strerror(ret));
-                K.ResetPipe(transferParam->TestParams->InterfaceHandle, transferParam->Ep.PipeId);
-
-                if (transferParam->RunningErrorCount > transferParam->TestParams->retry)
-                    break;
+        ret = 0;
+    } else {
+        transferParam->RunningTimeoutCount = 0;
+        transferParam->RunningErrorCount = 0;
+        RecoveryTransferDone(transferParam, ret);
+        // log the data to the file
+        if (USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId)) {
+            // LOG_MSG("Read %d bytes\n", ret);
+            if (transferParam->TestParams->verify &&
+                transferParam->TestParams->TestType != TestTypeLoop) {
+                VerifyData(transferParam, buffer, ret);
             }
-
-            ret = 0;
         } else {
-            transferParam->RunningTimeoutCount = 0;
-            transferParam->RunningErrorCount = 0;
-            // log the data to the file
-            if (USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId)) {
-                // LOG_MSG("Read %d bytes\n", ret);
-                if (transferParam->TestParams->verify &&
-                    transferParam->TestParams->TestType != TestTypeLoop) {
-                    VerifyData(transferParam, buffer, ret);
-                }
-            } else {
-                // LOG_MSG("Wrote %d bytes\n", ret);
-                if (transferParam->TestParams->verify &&
-                    transferParam->TestParams->TestType != TestTypeLoop) {
-                    // VerifyData(transferParam, buffer, ret);
-                }
+            // LOG_MSG("Wrote %d bytes\n", ret);
+            if (transferParam->TestParams->verify &&
+                transferParam->TestParams->TestType != TestTypeLoop) {
+                // VerifyData(transferParam, buffer, ret);
             }
         }
+    }
 
-        EnterCriticalSection(&DisplayCriticalSection);
+    BeginStatsUpdate(transferParam);
 
-        if (!transferParam->StartTick.tv_nsec && transferParam->Packets >= 0) {
-            clock_gettime(CLOCK_MONOTONIC, &transferParam->StartTick);
-            transferParam->LastStartTick = transferParam->StartTick;
-            transferParam->LastTick = transferParam->StartTick;
+    if (!transferParam->Stats.StartTick && transferParam->Stats.Packets >= 0) {
+        transferParam->Stats.StartTick = GetTimestampNs();
+        transferParam->Stats.LastStartTick = transferParam->Stats.StartTick;
+        transferParam->Stats.LastTick = transferParam->Stats.StartTick;
 
-            transferParam->LastTransferred = 0;
-            transferParam->TotalTransferred = 0;
-            transferParam->Packets = 0;
-        } else {
-            if (!transferParam->LastStartTick.tv_nsec) {
-                transferParam->LastStartTick = transferParam->LastTick;
-                transferParam->LastTransferred = 0;
-            }
-            clock_gettime(CLOCK_MONOTONIC, &transferParam->LastTick);
-
-            transferParam->LastTransferred += ret;
-            transferParam->TotalTransferred += ret;
-            transferParam->Packets++;
+        transferParam->Stats.LastTransferred = 0;
+        transferParam->Stats.TotalTransferred = 0;
+        transferParam->Stats.Packets = 0;
+    } else {
+        if (transferParam->WindowReset.Requested) {
+            transferParam->WindowReset.Requested = FALSE;
+            transferParam->Stats.LastStartTick = transferParam->Stats.LastTick;
+            transferParam->Stats.LastTransferred = 0;
         }
+        transferParam->Stats.LastTick = GetTimestampNs();
 
-        LeaveCriticalSection(&DisplayCriticalSection);
+        transferParam->Stats.LastTransferred += ret;
+        transferParam->Stats.TotalTransferred += ret;
+        transferParam->Stats.Packets++;
     }
 
-Final:
+    EndStatsUpdate(transferParam);
 
-    for (i = 0; i < transferParam->TestParams->bufferCount; i++) {
-        if (transferParam->TransferHandles[i].Overlapped.hEvent) {
-            if (transferParam->TransferHandles[i].InUse) {
-                if (!K.AbortPipe(transferParam->TestParams->InterfaceHandle,
-                                 transferParam->Ep.PipeId) &&
-                    !transferParam->TestParams->isUserAborted) {
-                    ret = WinError(0);
-                    LOG_ERROR("failed cancelling transfer ret = %d, error message : %s\n", ret,
-                              strerror(ret));
-                } else {
-                    CloseHandle(transferParam->TransferHandles[i].Overlapped.hEvent);
-                    transferParam->TransferHandles[i].Overlapped.hEvent = NULL;
-                    transferParam->TransferHandles[i].InUse = FALSE;
-                }
+    return TRUE;
+}
+
+// Waits at most msToWait for any in-flight transfer of transferParam, returns its handle index.
+static int WaitForCancelledTransfer(PUVPERF_TRANSFER_PARAM transferParam, DWORD msToWait) {
+    if (transferParam->TestParams->Backend == BACKEND_LIBUSB) {
+        // Without an event thread libusb callbacks only run while this thread handles events.
+        if (!transferParam->TestParams->UsbEventThreadHandle) {
+            UsbHandleEvents(transferParam->TestParams, min(msToWait, 10));
+            msToWait = 0;
+        }
+        return UsbWaitForCompletion(transferParam, msToWait);
+    }
+
+    return WaitForAnyTransfer(transferParam, msToWait);
+}
+
+// Cancels every in-flight transfer of transferParam at once and reaps them against one overall
+// deadline. Transfers that completed before the cancellation reached them are still counted.
+// Returns the requested length of the transfers that did not complete.
+LONGLONG CancelTransfers(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_PARAM TestParams = transferParam->TestParams;
+    PUVPERF_TRANSFER_HANDLE handle;
+    LONGLONG deadline, remaining, lostBytes = 0;
+    BOOL extended = FALSE;
+    int handleIndex, ret, i;
+
+    if (transferParam->outstandingTransferCount) {
+        AbortTransferParam(transferParam);
+
+        deadline = GetTimestampNs() + CANCEL_DEADLINE_MS * 1000000LL;
+        while (transferParam->outstandingTransferCount) {
+            remaining = (deadline - GetTimestampNs()) / 1000000;
+            if (remaining < 0) {
+                if (extended)
+                    break;
+
+                // Their buffers still belong to the driver, give them the transfer timeout.
+                LOG_WARNING("Ep0x%02X: %d transfers still pending after %d ms..\n",
+                            transferParam->Ep.PipeId, transferParam->outstandingTransferCount,
+                            CANCEL_DEADLINE_MS);
+                deadline = GetTimestampNs() + TestParams->timeout * 1000000LL;
+                extended = TRUE;
+                continue;
             }
-            Sleep(0);
+
+            handleIndex = WaitForCancelledTransfer(transferParam, (DWORD)remaining);
+            if (handleIndex < 0 && GetLastError() == ERROR_NO_MORE_ITEMS)
+                break;
+            if (handleIndex < 0)
+                continue;
+
+            handle = &transferParam->TransferHandles[handleIndex];
+            ret = ReapTransfer(transferParam, handle);
+            if (ret >= 0)
+                TransferComplete(transferParam, handle->Data, ret);
+            else
+                lostBytes += handle->DataMaxLength;
         }
     }
 
-    for (i = 0; i < transferParam->TestParams->bufferCount; i++) {
+    for (i = 0; i < TestParams->bufferCount; i++) {
+        if (transferParam->TransferHandles[i].InUse)
+            lostBytes += transferParam->TransferHandles[i].DataMaxLength;
         if (transferParam->TransferHandles[i].Overlapped.hEvent) {
-            if (transferParam->TransferHandles[i].InUse) {
-                WaitForSingleObject(transferParam->TransferHandles[i].Overlapped.hEvent,
-                                    transferParam->TestParams->timeout);
-            } else {
-                WaitForSingleObject(transferParam->TransferHandles[i].Overlapped.hEvent, 0);
-            }
             CloseHandle(transferParam->TransferHandles[i].Overlapped.hEvent);
             transferParam->TransferHandles[i].Overlapped.hEvent = NULL;
         }
         transferParam->TransferHandles[i].InUse = FALSE;
     }
+    transferParam->outstandingTransferCount = 0;
+    FlushFrames(transferParam);
+    ResetPollingArrival(transferParam);
+
+    return lostBytes;
+}
+
+// Mid-run flush for recovery: cancels every in-flight transfer of transferParam and reaps each one
+// before returning, however long the driver takes, since their buffers are about to be
+// resubmitted. Unlike CancelTransfers the handles and their events stay usable. Returns the
+// requested length of the transfers that did not complete.
+LONGLONG AbortTransfers(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_TRANSFER_HANDLE handle;
+    LONGLONG deadline, lostBytes = 0;
+    int handleIndex, ret;
+
+    if (transferParam->outstandingTransferCount)
+        AbortTransferParam(transferParam);
+
+    deadline = GetTimestampNs() + CANCEL_DEADLINE_MS * 1000000LL;
+    while (transferParam->outstandingTransferCount) {
+        handleIndex = WaitForCancelledTransfer(transferParam, CANCEL_DEADLINE_MS);
+        if (handleIndex < 0 && GetLastError() == ERROR_NO_MORE_ITEMS)
+            break;
+        if (handleIndex < 0) {
+            if (GetTimestampNs() >= deadline) {
+                LOG_WARNING("Ep0x%02X: %d transfers still pending after abort, retrying..\n",
+                            transferParam->Ep.PipeId, transferParam->outstandingTransferCount);
+                AbortTransferParam(transferParam);
+                deadline = GetTimestampNs() + CANCEL_DEADLINE_MS * 1000000LL;
+            }
+            continue;
+        }
+
+        handle = &transferParam->TransferHandles[handleIndex];
+        ret = ReapTransfer(transferParam, handle);
+        if (ret >= 0)
+            TransferComplete(transferParam, handle->Data, ret);
+        else
+            lostBytes += handle->DataMaxLength;
+    }
+
+    FlushFrames(transferParam);
+    ResetPollingArrival(transferParam);
+
+    return lostBytes;
+}
+
+DWORD TransferThread(PUVPERF_TRANSFER_PARAM transferParam) {
+    int ret;
+    PUVPERF_TRANSFER_HANDLE handle;
+    unsigned char *buffer;
+
+    transferParam->isRunning = TRUE;
+
+    while (!transferParam->TestParams->isCancelled) {
+        buffer = NULL;
+        handle = NULL;
+
+        if (transferParam->TestParams->TransferMode == TRANSFER_MODE_SYNC) {
+            if (transferParam->TestParams->targetMbps > 0 &&
+                !PacerWait(transferParam, GetTransferLength(transferParam)))
+                break;
+
+            ret = TransferSync(transferParam);
+            transferParam->Wakeups++;
+            if (ret >= 0)
+                buffer = transferParam->TransferHandles[0].Data;
+        } else if (transferParam->TestParams->TransferMode == TRANSFER_MODE_ASYNC) {
+            ret = TransferAsync(transferParam, &handle);
+            if ((handle) && ret >= 0)
+                buffer = handle->Data;
+        } else {
+            LOG_ERROR("Invalid transfer mode %d\n", transferParam->TestParams->TransferMode);
+            break;
+        }
+
+        // Aborted by StopTransferParams, not a transfer error.
+        if (ret < 0 && transferParam->TestParams->isCancelled)
+            break;
+
+        if (!TransferComplete(transferParam, buffer, ret))
+            break;
+    }
+
+    CancelTransfers(transferParam);
 
     transferParam->isRunning = FALSE;
     return 0;
@@ -769,9 +1542,11 @@ void ShowTransfer(PUVPERF_TRANSFER_PARAM transferParam) {
     DOUBLE BytepsAverage;
     DOUBLE BytepsCurrent;
     DOUBLE elapsedSeconds;
+    PUVPERF_TRANSFER_STATS stats;
 
     if (!transferParam)
         return;
+    stats = &transferParam->Stats;
 
     if (transferParam->HasEpCompanionDescriptor) {
         if (transferParam->EpCompanionDescriptor.wBytesPerInterval) {
@@ -790,7 +1565,7 @@ void ShowTransfer(PUVPERF_TRANSFER_PARAM transferParam) {
                         TRANSFER_DISPLAY(transferParam, "Read", "Write"), transferParam->Ep.PipeId,
                         transferParam->Ep.MaximumBytesPerInterval,
                         transferParam->EpCompanionDescriptor.bMaxBurst + 1,
-                        transferParam->EpCompanionDescriptor.bmAttributes.Bulk.MaxStreams + 1);
+                        GetMaxStreams(transferParam));
             } else {
                 LOG_MSG("%s %s from Ep0x%02X Maximum Bytes Per Interval:%lu\n",
                         EndpointTypeDisplayString[ENDPOINT_TYPE(transferParam)],
@@ -810,33 +1585,81 @@ void ShowTransfer(PUVPERF_TRANSFER_PARAM transferParam) {
                 transferParam->Ep.MaximumPacketSize);
     }
 
-    if (transferParam->StartTick.tv_nsec) {
-        GetAverageBytesSec(transferParam, &BytepsAverage);
-        GetCurrentBytesSec(transferParam, &BytepsCurrent);
-        LOG_MSG("\tTotal %I64d Bytes\n", transferParam->TotalTransferred);
-        LOG_MSG("\tTotal %d Transfers\n", transferParam->Packets);
+    if (transferParam->Cpu >= 0)
+        LOG_MSG("\tThread pinned to CPU %d\n", transferParam->Cpu);
+
+    if (stats->StartTick) {
+        GetAverageBytesSec(stats, &BytepsAverage);
+        GetCurrentBytesSec(stats, &BytepsCurrent);
+        LOG_MSG("\tTotal %I64d Bytes\n", stats->TotalTransferred);
+        LOG_MSG("\tTotal %d Transfers\n", stats->Packets);
 
-        if (transferParam->shortTrasnferred) {
-            LOG_MSG("\tShort %d Transfers\n", transferParam->shortTrasnferred);
+        if (transferParam->shortTransferCount || transferParam->zeroLengthCount) {
+            LOG_MSG("\tShort %d Transfers, %d zero length\n", transferParam->shortTransferCount,
+                    transferParam->zeroLengthCount);
         }
 
-        if (transferParam->TotalTimeoutCount) {
-            LOG_MSG("\tTimeout %d Errors\n", transferParam->TotalTimeoutCount);
+        if (stats->TotalTimeoutCount) {
+            LOG_MSG("\tTimeout %d Errors\n", stats->TotalTimeoutCount);
         }
 
-        if (transferParam->TotalErrorCount) {
-            LOG_MSG("\tOther %d Errors\n", transferParam->TotalErrorCount);
+        if (stats->TotalErrorCount) {
+            LOG_MSG("\tOther %d Errors\n", stats->TotalErrorCount);
+        }
+
+        if (stats->IsochResults.TotalPackets) {
+            LOG_MSG("\tISO-Packets (Total/Good/Bad) %u/%u/%u\n",
+                    stats->IsochResults.TotalPackets,
+                    stats->IsochResults.GoodPackets,
+                    stats->IsochResults.BadPackets);
+            if (USB_ENDPOINT_DIRECTION_OUT(transferParam->Ep.PipeId))
+                LOG_MSG("\tISO-Underruns %d\n", stats->isoUnderrunCount);
         }
 
         LOG_MSG("\tAverage %.2f Mbps/sec\n", (BytepsAverage * 8) / 1000 / 1000);
 
-        if (transferParam->StartTick.tv_nsec &&
-            (transferParam->LastStartTick.tv_sec +
-             transferParam->LastStartTick.tv_nsec / 1000000000.0) <
-                (transferParam->LastTick.tv_sec + transferParam->LastTick.tv_nsec / 1000000000.0)) {
-            elapsedSeconds =
-                (transferParam->LastTick.tv_sec - transferParam->StartTick.tv_sec) +
-                (transferParam->LastTick.tv_nsec - transferParam->StartTick.tv_nsec) / 1000000000.0;
+        if (stats->QueueDepthSamples) {
+            DOUBLE queueDepth;
+
+            GetAverageQueueDepth(stats, &queueDepth);
+            LOG_MSG("\tQueue Depth %.1f (max %d of %d)\n", queueDepth,
+                    stats->MaxQueueDepth, transferParam->TestParams->bufferCount);
+        }
+
+        ShowFrames(transferParam);
+        ShowPolling(transferParam);
+
+        ShowWorkload(transferParam);
+        ShowRecovery(transferParam);
+
+        LOG_MSG("\tBuffer Pool %Iu bytes, %s pages%s\n", transferParam->BufferPool.Size,
+                transferParam->BufferPool.IsLargePages ? "large" : "normal",
+                transferParam->BufferPool.IsLocked ? ", locked" : "");
+
+        if (transferParam->Pacer.Error) {
+            DOUBLE targetMbps = transferParam->TestParams->targetMbps;
+            DOUBLE achievedMbps = (BytepsAverage * 8) / 1000 / 1000;
+            PUVPERF_LATENCY_HISTOGRAM error = transferParam->Pacer.Error;
+
+            LOG_MSG("\tTarget %.2f Mbps/sec, achieved %.2f Mbps/sec (%+.2f%%)\n", targetMbps,
+                    achievedMbps, (achievedMbps - targetMbps) * 100 / targetMbps);
+            LOG_MSG("\tPacing error us (p50/p99/max) %.1f/%.1f/%.1f, %I64d paced, %I64d behind\n",
+                    GetLatencyPercentile(error, 50.0) / 1000.0,
+                    GetLatencyPercentile(error, 99.0) / 1000.0, error->Max / 1000.0,
+                    transferParam->Pacer.PacedCount, transferParam->Pacer.BehindCount);
+        }
+
+        if (transferParam->Latency->Count) {
+            PUVPERF_LATENCY_HISTOGRAM latency = transferParam->Latency;
+
+            LOG_MSG("\tLatency us (min/p50/p99/p99.9/max) %.1f/%.1f/%.1f/%.1f/%.1f\n",
+                    latency->Min / 1000.0, GetLatencyPercentile(latency, 50.0) / 1000.0,
+                    GetLatencyPercentile(latency, 99.0) / 1000.0,
+                    GetLatencyPercentile(latency, 99.9) / 1000.0, latency->Max / 1000.0);
+        }
+
+        if (stats->StartTick && stats->LastStartTick < stats->LastTick) {
+            elapsedSeconds = (stats->LastTick - stats->StartTick) / 1000000000.0;
             LOG_MSG("\tElapsed Time %.2f seconds\n", elapsedSeconds);
         }
 
@@ -845,28 +1668,26 @@ void ShowTransfer(PUVPERF_TRANSFER_PARAM transferParam) {
 }
 
 
-BOOL WaitForTestTransfer(PUVPERF_TRANSFER_PARAM transferParam, UINT msToWait) {
-    DWORD exitCode;
-
-    while (transferParam) {
-        if (!transferParam->isRunning) {
-            if (GetExitCodeThread(transferParam->ThreadHandle, &exitCode)) {
-                LOG_MSG("stopped Ep0x%02X thread \tExitCode=%d\n", transferParam->Ep.PipeId,
-                        exitCode);
-                break;
-            }
+void ShowTransferSummary(PUVPERF_TRANSFER_PARAM *transferParams, int transferParamCount) {
+    DOUBLE BytepsAverage;
+    DOUBLE BytepsTotal = 0;
+    LONGLONG totalTransferred = 0;
+    int i;
 
-            LOG_ERROR("failed getting Ep0x%02X thread exit code!\n", transferParam->Ep.PipeId);
-            break;
-        }
+    for (i = 0; i < transferParamCount; i++) {
+        ShowTransfer(transferParams[i]);
 
-        LOG_MSG("waiting for Ep%02Xh thread..\n", transferParam->Ep.PipeId);
-        WaitForSingleObject(transferParam->ThreadHandle, 100);
-        if (msToWait != INFINITE) {
-            if ((msToWait - 100) == 0 || (msToWait - 100) > msToWait)
-                return FALSE;
+        if (transferParams[i]->Stats.StartTick) {
+            GetAverageBytesSec(&transferParams[i]->Stats, &BytepsAverage);
+            BytepsTotal += BytepsAverage;
+            totalTransferred += transferParams[i]->Stats.TotalTransferred;
         }
     }
 
-    return TRUE;
+    if (transferParamCount > 1) {
+        LOG_MSG("Aggregate of %d endpoints\n", transferParamCount);
+        LOG_MSG("\tTotal %I64d Bytes\n", totalTransferred);
+        LOG_MSG("\tAverage %.2f Mbps/sec\n", (BytepsTotal * 8) / 1000 / 1000);
+        LOG_MSG("\n");
+    }
 }
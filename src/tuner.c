@@ -0,0 +1,224 @@
+#include <windows.h>
+#include <conio.h>
+
+#include "log.h"
+#include "k.h"
+#include "tuner.h"
+#include "transfer_p.h"
+#include "benchmark.h"
+#include "engine.h"
+
+// Tuning mode (-o PERCENT). Sweeps the queue depth (-b) and the transfer length (-l/-w), runs a
+// short measurement for each point through the regular transfer threads and reports the
+// smallest configuration that reaches PERCENT of the peak throughput.
+
+// Isochronous lengths have to be a multiple of 8 intervals, the constraint CreateTransferParam
+// enforces. Bulk and interrupt lengths have none; they start at 8 packets as well, since shorter
+// transfers only measure per-transfer overhead. Returns the smallest length that suits every pipe
+// under test.
+static int GetPipeLengthUnit(PWINUSB_PIPE_INFORMATION_EX pipeInfo) {
+    if (pipeInfo->PipeType == UsbdPipeTypeIsochronous)
+        return pipeInfo->MaximumBytesPerInterval * 8;
+    return pipeInfo->MaximumPacketSize * 8;
+}
+
+static int GetTuneLengthUnit(PUVPERF_PARAM TestParams) {
+    PWINUSB_PIPE_INFORMATION_EX pipeInfo;
+    PUVPERF_ASSOCIATED_INTERFACE associated;
+    int unit = 0;
+    BOOL selected;
+    UCHAR pipeIndex;
+    int i, j;
+
+    for (i = 0; i < TestParams->InterfaceDescriptor.bNumEndpoints; i++) {
+        pipeInfo = &TestParams->PipeInformation[i];
+
+        if (TestParams->endpointCount > 1 || TestParams->allEndpoints) {
+            selected = FALSE;
+            for (j = 0; j < TestParams->endpointCount; j++) {
+                if (TestParams->endpoints[j] == pipeInfo->PipeId)
+                    selected = TRUE;
+            }
+        } else {
+            selected = (pipeInfo->PipeId & USB_ENDPOINT_ADDRESS_MASK) ==
+                       (TestParams->endpoint & USB_ENDPOINT_ADDRESS_MASK);
+        }
+        if (selected)
+            unit = max(unit, GetPipeLengthUnit(pipeInfo));
+    }
+
+    // Pipes on the other interfaces of a composite device.
+    for (j = 0; j < TestParams->endpointCount && TestParams->associatedInterfaceCount; j++) {
+        associated = Bench_FindAssociatedPipe(TestParams, TestParams->endpoints[j], &pipeIndex);
+        if (associated)
+            unit = max(unit, GetPipeLengthUnit(&associated->PipeInformation[pipeIndex]));
+    }
+
+    return unit;
+}
+
+// Runs the current configuration for msToMeasure and stores the aggregate throughput of all
+// endpoints in point. The first completion of every endpoint only starts its clock, so setup
+// and the initial ring fill are not part of the result.
+int MeasureTransferParams(PUVPERF_PARAM TestParams, DWORD msToMeasure, PUVPERF_TUNE_POINT point) {
+    PUVPERF_TRANSFER_PARAM transferParams[MAX_TRANSFER_PARAMS];
+    int transferParamCount;
+    DOUBLE bps;
+    DWORD startTick;
+    BOOL userAborted = FALSE;
+    int ret = 0;
+    int i;
+
+    memset(point, 0, sizeof(*point));
+    point->altSetting = TestParams->altf;
+    point->bufferCount = TestParams->bufferCount;
+    point->length = TestParams->bufferlength;
+    point->failed = TRUE;
+
+    transferParamCount = CreateTransferParams(TestParams, transferParams);
+    if (transferParamCount <= 0)
+        return -1;
+
+    // Isochronous pipes switch the test to asynchronous transfers.
+    point->transferMode = TestParams->TransferMode;
+
+    if (StartTransferParams(TestParams, transferParams, transferParamCount) < 0) {
+        ret = -1;
+        TestParams->isCancelled = TRUE;
+    }
+
+    startTick = GetTickCount();
+    while (!TestParams->isCancelled && GetTickCount() - startTick < msToMeasure) {
+        Sleep(100);
+        if (_kbhit()) {
+            int key = _getch();
+            if (key == 'Q' || key == 'q') {
+                LOG_VERBOSE("User Aborted\n");
+                userAborted = TRUE;
+                ret = -1;
+                TestParams->isCancelled = TRUE;
+            }
+        }
+        for (i = 0; i < transferParamCount; i++) {
+            if (!transferParams[i]->isRunning) {
+                ret = -1;
+                TestParams->isCancelled = TRUE;
+            }
+        }
+    }
+
+    // Stop quietly, the cancelled transfers are not errors.
+    TestParams->isUserAborted = TRUE;
+    TestParams->isCancelled = TRUE;
+    StopTransferParams(TestParams, transferParams, transferParamCount);
+
+    if (!ret) {
+        point->failed = FALSE;
+        point->cpuSeconds = GetCpuSeconds(TestParams);
+        for (i = 0; i < transferParamCount; i++) {
+            GetAverageBytesSec(&transferParams[i]->Stats, &bps);
+            point->bps += bps;
+            if (transferParams[i]->Stats.TotalTransferred) {
+                point->transfersPerSec += bps * transferParams[i]->Stats.Packets /
+                                          transferParams[i]->Stats.TotalTransferred;
+            }
+            point->errorCount += transferParams[i]->Stats.TotalErrorCount;
+            point->timeoutCount += transferParams[i]->Stats.TotalTimeoutCount;
+        }
+    }
+
+    for (i = 0; i < transferParamCount; i++)
+        FreeTransferParam(&transferParams[i]);
+
+    // isUserAborted only silenced the stop above; a 'Q' ends the whole tuning or sweep run.
+    TestParams->isUserAborted = userAborted;
+    TestParams->isCancelled = FALSE;
+    return ret;
+}
+
+int RunTuner(PUVPERF_PARAM TestParams) {
+    UVPERF_TUNE_POINT points[TUNE_MAX_POINTS];
+    PUVPERF_TUNE_POINT best = NULL;
+    DWORD msToMeasure = TestParams->Timer ? TestParams->Timer * 1000 : TUNE_MEASURE_MS;
+    DOUBLE peakBps = 0;
+    int pointCount = 0;
+    int bufferCount, length, unit;
+    int savedBufferCount = TestParams->bufferCount;
+    int savedReadLength = TestParams->readlenth;
+    int savedWriteLength = TestParams->writelength;
+    int savedBufferLength = TestParams->bufferlength;
+    UVPERF_TRANSFER_MODE savedTransferMode = TestParams->TransferMode;
+    BOOL savedVerify = TestParams->verify;
+    int i;
+
+    unit = GetTuneLengthUnit(TestParams);
+    if (!unit) {
+        LOGERR0("no pipe to tune\n");
+        return -1;
+    }
+
+    // Data isn't verified while tuning, only throughput counts.
+    TestParams->verify = FALSE;
+    TestParams->TransferMode = TRANSFER_MODE_ASYNC;
+
+    LOG_MSG("Tuning %u ms per point, within %d%% of peak\n", msToMeasure, TestParams->tunePercent);
+    LOG_MSG("%8s %10s %12s %8s\n", "Buffers", "Length", "Mbps", "Errors");
+
+    for (bufferCount = 1; bufferCount <= TUNE_MAX_BUFFER_COUNT; bufferCount *= 2) {
+        for (length = unit; length <= max(unit, TUNE_MAX_LENGTH); length *= 2) {
+            if (pointCount == TUNE_MAX_POINTS || TestParams->isUserAborted)
+                break;
+
+            TestParams->bufferCount = bufferCount;
+            TestParams->bufferlength = length;
+            TestParams->readlenth = length;
+            TestParams->writelength = length;
+
+            MeasureTransferParams(TestParams, msToMeasure, &points[pointCount]);
+            if (points[pointCount].failed) {
+                LOG_MSG("%8d %10d %12s %8s\n", bufferCount, length, "failed", "-");
+            } else {
+                LOG_MSG("%8d %10d %12.2f %8d\n", bufferCount, length,
+                        (points[pointCount].bps * 8) / 1000 / 1000,
+                        points[pointCount].errorCount + points[pointCount].timeoutCount);
+                peakBps = max(peakBps, points[pointCount].bps);
+            }
+            pointCount++;
+        }
+    }
+
+    // Smallest buffer memory within tunePercent of the peak, fewer buffers on a tie.
+    for (i = 0; i < pointCount; i++) {
+        if (points[i].failed || points[i].bps < peakBps * (100 - TestParams->tunePercent) / 100)
+            continue;
+
+        if (!best ||
+            (LONGLONG)points[i].bufferCount * points[i].length <
+                (LONGLONG)best->bufferCount * best->length ||
+            ((LONGLONG)points[i].bufferCount * points[i].length ==
+                 (LONGLONG)best->bufferCount * best->length &&
+             points[i].bufferCount < best->bufferCount)) {
+            best = &points[i];
+        }
+    }
+
+    TestParams->bufferCount = savedBufferCount;
+    TestParams->readlenth = savedReadLength;
+    TestParams->writelength = savedWriteLength;
+    TestParams->bufferlength = savedBufferLength;
+    TestParams->TransferMode = savedTransferMode;
+    TestParams->verify = savedVerify;
+
+    if (!best || peakBps <= 0) {
+        LOGERR0("tuning failed, no point transferred any data\n");
+        return -1;
+    }
+
+    LOG_MSG("\n");
+    LOG_MSG("Peak %.2f Mbps\n", (peakBps * 8) / 1000 / 1000);
+    LOG_MSG("Recommended -b %d -l %d -w %d : %.2f Mbps\n", best->bufferCount, best->length,
+            best->length, (best->bps * 8) / 1000 / 1000);
+    LOG_MSG("\n");
+
+    return 0;
+}
@@ -0,0 +1,490 @@
+#include <windows.h>
+#include <string.h>
+
+#include "libusb.h"
+
+#include "log.h"
+#include "k.h"
+#include "transfer_p.h"
+#include "usb_transfer.h"
+#include "timestamp.h"
+
+
+static DWORD UsbErrorToWinError(int usbError) {
+    switch (usbError) {
+    case LIBUSB_SUCCESS:
+        return ERROR_SUCCESS;
+    case LIBUSB_ERROR_TIMEOUT:
+        return ERROR_SEM_TIMEOUT;
+    case LIBUSB_ERROR_INTERRUPTED:
+        return ERROR_OPERATION_ABORTED;
+    case LIBUSB_ERROR_NO_MEM:
+        return ERROR_NOT_ENOUGH_MEMORY;
+    case LIBUSB_ERROR_INVALID_PARAM:
+        return ERROR_INVALID_PARAMETER;
+    case LIBUSB_ERROR_NOT_SUPPORTED:
+        return ERROR_NOT_SUPPORTED;
+    case LIBUSB_ERROR_NO_DEVICE:
+    case LIBUSB_ERROR_NOT_FOUND:
+        return ERROR_INVALID_HANDLE;
+    default:
+        return ERROR_GEN_FAILURE;
+    }
+}
+
+static DWORD UsbStatusToWinError(enum libusb_transfer_status status) {
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return ERROR_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return ERROR_SEM_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return ERROR_OPERATION_ABORTED;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return ERROR_INVALID_HANDLE;
+    default:
+        return ERROR_GEN_FAILURE;
+    }
+}
+
+// Completions are delivered on the event thread, which also stamps their completion time. The
+// handle index is queued for the transfer thread, which reaps it in completion order; the
+// handle's own event is still signalled for the cancellation path in TransferThread.
+static void LIBUSB_CALL UsbTransferCb(struct libusb_transfer *transfer) {
+    PUVPERF_TRANSFER_HANDLE handle = (PUVPERF_TRANSFER_HANDLE)transfer->user_data;
+    PUVPERF_TRANSFER_PARAM transferParam = handle->TransferParam;
+    LONG head = transferParam->completionQueueHead;
+
+    handle->CompletionTime = GetTimestampNs();
+    transferParam->CompletionQueue[head] = handle->Index;
+    MemoryBarrier();
+    INC_ROLL(head, transferParam->TestParams->bufferCount + 1);
+    transferParam->completionQueueHead = head;
+
+    SetEvent(handle->Overlapped.hEvent);
+    SetEvent(transferParam->CompletionEvent);
+}
+
+static DWORD UsbEventThread(PUVPERF_PARAM TestParams) {
+    struct timeval tv;
+
+    while (!TestParams->UsbEventThreadStop) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout_completed(TestParams->UsbContext, &tv, NULL);
+    }
+
+    return 0;
+}
+
+// TRUE when usbDevice is the device Bench_Open picked from the libusbK list. VID/PID alone can't
+// tell two identical boards apart, so the bus number and address must match as well; when
+// libusbK did not report those, the serial number decides.
+static BOOL UsbIsSelectedDevice(PUVPERF_PARAM TestParams, libusb_device *usbDevice) {
+    KLST_DEVINFO_HANDLE deviceInfo = TestParams->SelectedDeviceProfile;
+    struct libusb_device_descriptor deviceDescriptor;
+    libusb_device_handle *usbHandle;
+    char serialNumber[KLST_STRING_MAX_LEN];
+    int r;
+
+    if (libusb_get_device_descriptor(usbDevice, &deviceDescriptor) < 0 ||
+        deviceDescriptor.idVendor != TestParams->vid ||
+        deviceDescriptor.idProduct != TestParams->pid)
+        return FALSE;
+
+    if (deviceInfo->DeviceAddress > 0)
+        return libusb_get_bus_number(usbDevice) == deviceInfo->BusNumber &&
+               libusb_get_device_address(usbDevice) == deviceInfo->DeviceAddress;
+
+    if (!deviceDescriptor.iSerialNumber || libusb_open(usbDevice, &usbHandle) < 0)
+        return FALSE;
+
+    r = libusb_get_string_descriptor_ascii(usbHandle, deviceDescriptor.iSerialNumber,
+                                           (unsigned char *)serialNumber, sizeof(serialNumber));
+    libusb_close(usbHandle);
+
+    return r > 0 && strcmp(serialNumber, deviceInfo->SerialNumber) == 0;
+}
+
+// Hands interface number over from libusbK, which claimed it implicitly when its alt setting was
+// set, and selects altSetting on the libusb side.
+static int UsbClaimInterface(PUVPERF_PARAM TestParams, KUSB_HANDLE interfaceHandle, int number,
+                             int altSetting) {
+    int r;
+
+    K.ReleaseInterface(interfaceHandle, (UCHAR)number, FALSE);
+
+    r = libusb_claim_interface(TestParams->UsbHandle, number);
+    if (r < 0) {
+        LOG_ERROR("can not claim interface %02X, message : %s\n", number, libusb_strerror(r));
+        return -1;
+    }
+
+    r = libusb_set_interface_alt_setting(TestParams->UsbHandle, number, altSetting);
+    if (r < 0) {
+        LOG_ERROR("can not find alt interface %02X:%02X, message : %s\n", number, altSetting,
+                  libusb_strerror(r));
+        return -1;
+    }
+
+    return 0;
+}
+
+// The libusb backend is an alternate Windows data path: Bench_Open still selects and opens the
+// device through libusbK, which keeps EP0 and the descriptor queries. Only the pipe I/O moves to
+// libusb, on the same device and with libusb holding the only claim on the interface. It is not a
+// Linux port: device discovery, the transfer threads and their events and the console still use
+// libusbK and Win32, so uvperf does not build on Linux.
+int UsbBackendOpen(PUVPERF_PARAM TestParams) {
+    PUVPERF_ASSOCIATED_INTERFACE associated;
+    libusb_device **usbDevices;
+    ssize_t usbDeviceCount;
+    ssize_t i;
+    int r;
+
+    r = libusb_init(&TestParams->UsbContext);
+    if (r < 0) {
+        LOG_ERROR("libusb_init failed, message : %s\n", libusb_strerror(r));
+        TestParams->UsbContext = NULL;
+        return -1;
+    }
+
+    usbDeviceCount = libusb_get_device_list(TestParams->UsbContext, &usbDevices);
+    if (usbDeviceCount < 0) {
+        LOG_ERROR("can not list devices with libusb, message : %s\n",
+                  libusb_strerror((int)usbDeviceCount));
+        goto Error;
+    }
+
+    for (i = 0; i < usbDeviceCount; i++) {
+        if (UsbIsSelectedDevice(TestParams, usbDevices[i])) {
+            r = libusb_open(usbDevices[i], &TestParams->UsbHandle);
+            if (r < 0)
+                TestParams->UsbHandle = NULL;
+            break;
+        }
+    }
+    libusb_free_device_list(usbDevices, 1);
+
+    if (!TestParams->UsbHandle) {
+        LOG_ERROR("can not open vid : 0x%04X, pid : 0x%04X device with libusb\n", TestParams->vid,
+                  TestParams->pid);
+        goto Error;
+    }
+
+    if (UsbClaimInterface(TestParams, TestParams->InterfaceHandle, TestParams->intf,
+                          TestParams->altf) < 0)
+        goto Error;
+
+    for (i = 0; i < TestParams->associatedInterfaceCount; i++) {
+        associated = &TestParams->AssociatedInterfaces[i];
+        if (UsbClaimInterface(TestParams, associated->InterfaceHandle,
+                              associated->InterfaceDescriptor.bInterfaceNumber,
+                              associated->InterfaceDescriptor.bAlternateSetting) < 0)
+            goto Error;
+    }
+
+    // In event loop mode EngineThread handles libusb events itself.
+    if (!TestParams->useEventLoop) {
+        TestParams->UsbEventThreadStop = FALSE;
+        TestParams->UsbEventThreadHandle = CreateThread(
+            NULL, 0, (LPTHREAD_START_ROUTINE)UsbEventThread, TestParams, 0, NULL);
+        if (!TestParams->UsbEventThreadHandle) {
+            LOGERR0("failed creating thread!\n");
+            goto Error;
+        }
+    }
+
+    return 0;
+
+Error:
+    UsbBackendClose(TestParams);
+    return -1;
+}
+
+int UsbSetAltSetting(PUVPERF_PARAM TestParams, int altSetting) {
+    int r = libusb_set_interface_alt_setting(TestParams->UsbHandle, TestParams->intf, altSetting);
+
+    if (r < 0) {
+        LOG_ERROR("can not find alt interface %02X, message : %s\n", altSetting,
+                  libusb_strerror(r));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Clears a halted endpoint on the device and resets the host side of the pipe.
+BOOL UsbClearHalt(PUVPERF_TRANSFER_PARAM transferParam) {
+    int r = libusb_clear_halt(transferParam->TestParams->UsbHandle, transferParam->Ep.PipeId);
+
+    if (r < 0) {
+        LOG_ERROR("can not clear halt on Ep0x%02X, message : %s\n", transferParam->Ep.PipeId,
+                  libusb_strerror(r));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Halts the endpoint on the device (SET_FEATURE(ENDPOINT_HALT)), for -J.
+BOOL UsbSetHalt(PUVPERF_TRANSFER_PARAM transferParam) {
+    int r = libusb_control_transfer(transferParam->TestParams->UsbHandle,
+                                    LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_ENDPOINT,
+                                    LIBUSB_REQUEST_SET_FEATURE, USB_FEATURE_ENDPOINT_HALT,
+                                    transferParam->Ep.PipeId, NULL, 0,
+                                    transferParam->TestParams->timeout);
+
+    if (r < 0) {
+        LOG_ERROR("can not halt Ep0x%02X, message : %s\n", transferParam->Ep.PipeId,
+                  libusb_strerror(r));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Releases and re-claims interface number and restores its alternate setting.
+BOOL UsbReclaimInterface(PUVPERF_PARAM TestParams, int number, int altSetting) {
+    int r;
+
+    libusb_release_interface(TestParams->UsbHandle, number);
+    r = libusb_claim_interface(TestParams->UsbHandle, number);
+    if (r < 0) {
+        LOG_ERROR("can not claim interface %02X, message : %s\n", number, libusb_strerror(r));
+        return FALSE;
+    }
+
+    r = libusb_set_interface_alt_setting(TestParams->UsbHandle, number, altSetting);
+    if (r < 0) {
+        LOG_ERROR("can not find alt interface %02X:%02X, message : %s\n", number, altSetting,
+                  libusb_strerror(r));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void UsbBackendClose(PUVPERF_PARAM TestParams) {
+    int i;
+
+    if (TestParams->UsbEventThreadHandle) {
+        TestParams->UsbEventThreadStop = TRUE;
+        libusb_interrupt_event_handler(TestParams->UsbContext);
+        WaitForSingleObject(TestParams->UsbEventThreadHandle, INFINITE);
+        CloseHandle(TestParams->UsbEventThreadHandle);
+        TestParams->UsbEventThreadHandle = NULL;
+    }
+
+    if (TestParams->UsbHandle) {
+        for (i = 0; i < TestParams->associatedInterfaceCount; i++) {
+            libusb_release_interface(
+                TestParams->UsbHandle,
+                TestParams->AssociatedInterfaces[i].InterfaceDescriptor.bInterfaceNumber);
+        }
+        libusb_release_interface(TestParams->UsbHandle, TestParams->intf);
+        libusb_close(TestParams->UsbHandle);
+        TestParams->UsbHandle = NULL;
+    }
+
+    if (TestParams->UsbContext) {
+        libusb_exit(TestParams->UsbContext);
+        TestParams->UsbContext = NULL;
+    }
+}
+
+// Handles pending libusb events on the calling thread, polling the backend's file descriptors
+// for at most msToWait. Completion callbacks run from here.
+int UsbHandleEvents(PUVPERF_PARAM TestParams, DWORD msToWait) {
+    struct timeval tv;
+
+    tv.tv_sec = msToWait / 1000;
+    tv.tv_usec = (msToWait % 1000) * 1000;
+
+    return libusb_handle_events_timeout_completed(TestParams->UsbContext, &tv, NULL);
+}
+
+int UsbInitCompletionQueue(PUVPERF_TRANSFER_PARAM transferParam) {
+    transferParam->CompletionQueue =
+        malloc((transferParam->TestParams->bufferCount + 1) * sizeof(int));
+    if (!transferParam->CompletionQueue) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+
+    transferParam->completionQueueHead = 0;
+    transferParam->completionQueueTail = 0;
+    transferParam->CompletionEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!transferParam->CompletionEvent) {
+        LOGERR0("failed creating completion event!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void UsbFreeCompletionQueue(PUVPERF_TRANSFER_PARAM transferParam) {
+    if (transferParam->CompletionEvent) {
+        CloseHandle(transferParam->CompletionEvent);
+        transferParam->CompletionEvent = NULL;
+    }
+
+    free(transferParam->CompletionQueue);
+    transferParam->CompletionQueue = NULL;
+}
+
+// Pops the next completed handle index, waiting up to msToWait for one to arrive.
+int UsbWaitForCompletion(PUVPERF_TRANSFER_PARAM transferParam, DWORD msToWait) {
+    LONG tail;
+    int handleIndex;
+
+    while (transferParam->completionQueueTail == transferParam->completionQueueHead) {
+        if (WaitForSingleObject(transferParam->CompletionEvent, msToWait) != WAIT_OBJECT_0) {
+            SetLastError(ERROR_SEM_TIMEOUT);
+            return -1;
+        }
+    }
+
+    MemoryBarrier();
+    tail = transferParam->completionQueueTail;
+    handleIndex = transferParam->CompletionQueue[tail];
+    INC_ROLL(tail, transferParam->TestParams->bufferCount + 1);
+    transferParam->completionQueueTail = tail;
+
+    return handleIndex;
+}
+
+// Synchronous transfers run on the first handle's buffer, the start of the buffer pool.
+int UsbTransferSync(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUCHAR data = transferParam->TransferHandles[0].Data;
+    int transferred = 0;
+    int length;
+    int r;
+
+    if (transferParam->Ep.PipeId & USB_ENDPOINT_DIRECTION_MASK) {
+        length = transferParam->TestParams->readlenth;
+    } else {
+        length = transferParam->TestParams->writelength;
+        AppendLoopBuffer(transferParam->TestParams, data, length);
+    }
+
+    if (ENDPOINT_TYPE(transferParam) == USB_ENDPOINT_TYPE_INTERRUPT) {
+        r = libusb_interrupt_transfer(transferParam->TestParams->UsbHandle,
+                                      transferParam->Ep.PipeId, data, length, &transferred,
+                                      transferParam->TestParams->timeout);
+    } else {
+        r = libusb_bulk_transfer(transferParam->TestParams->UsbHandle, transferParam->Ep.PipeId,
+                                 data, length, &transferred, transferParam->TestParams->timeout);
+    }
+
+    return r == LIBUSB_SUCCESS ? transferred : -labs(UsbErrorToWinError(r));
+}
+
+BOOL UsbSubmitTransfer(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle) {
+    PUVPERF_PARAM TestParams = transferParam->TestParams;
+    struct libusb_transfer *transfer = handle->UsbTransfer;
+    int numIsoPackets = 0;
+    int r;
+
+    if (ENDPOINT_TYPE(transferParam) == USB_ENDPOINT_TYPE_ISOCHRONOUS)
+        numIsoPackets = transferParam->numberOFIsoPackets;
+
+    if (!transfer) {
+        transfer = handle->UsbTransfer = libusb_alloc_transfer(numIsoPackets);
+        if (!transfer) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+    }
+
+    switch (ENDPOINT_TYPE(transferParam)) {
+    case USB_ENDPOINT_TYPE_ISOCHRONOUS:
+        if (USB_ENDPOINT_DIRECTION_IN(transferParam->Ep.PipeId)) {
+            libusb_fill_iso_transfer(transfer, TestParams->UsbHandle, transferParam->Ep.PipeId,
+                                     handle->Data,
+                                     numIsoPackets * transferParam->Ep.MaximumBytesPerInterval,
+                                     numIsoPackets, UsbTransferCb, handle, TestParams->timeout);
+            libusb_set_iso_packet_lengths(transfer, transferParam->Ep.MaximumBytesPerInterval);
+        } else {
+            // Split the write data into full packets, the last one carries the remainder.
+            int remaining = handle->DataMaxLength;
+            int packetIndex;
+
+            libusb_fill_iso_transfer(transfer, TestParams->UsbHandle, transferParam->Ep.PipeId,
+                                     handle->Data, handle->DataMaxLength, numIsoPackets,
+                                     UsbTransferCb, handle, TestParams->timeout);
+            for (packetIndex = 0; packetIndex < numIsoPackets; packetIndex++) {
+                transfer->iso_packet_desc[packetIndex].length =
+                    min(remaining, (int)transferParam->Ep.MaximumBytesPerInterval);
+                remaining -= transfer->iso_packet_desc[packetIndex].length;
+            }
+        }
+        break;
+    case USB_ENDPOINT_TYPE_INTERRUPT:
+        libusb_fill_interrupt_transfer(transfer, TestParams->UsbHandle, transferParam->Ep.PipeId,
+                                       handle->Data, handle->DataMaxLength, UsbTransferCb, handle,
+                                       TestParams->timeout);
+        break;
+    default:
+        libusb_fill_bulk_transfer(transfer, TestParams->UsbHandle, transferParam->Ep.PipeId,
+                                  handle->Data, handle->DataMaxLength, UsbTransferCb, handle,
+                                  TestParams->timeout);
+        break;
+    }
+
+    r = libusb_submit_transfer(transfer);
+    if (r < 0) {
+        SetLastError(UsbErrorToWinError(r));
+        return FALSE;
+    }
+
+    SetLastError(ERROR_SUCCESS);
+    return TRUE;
+}
+
+BOOL UsbGetTransferResult(PUVPERF_TRANSFER_PARAM transferParam, PUVPERF_TRANSFER_HANDLE handle,
+                          UINT *transferred) {
+    struct libusb_transfer *transfer = handle->UsbTransfer;
+    int packetIndex;
+
+    *transferred = 0;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        SetLastError(UsbStatusToWinError(transfer->status));
+        return FALSE;
+    }
+
+    if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        *transferred = transfer->actual_length;
+        return TRUE;
+    }
+
+    // libusb leaves actual_length at 0 for isochronous transfers; walk the packets the same
+    // way IsochK_EnumPackets does for the libusbK backend.
+    memset(&handle->IsochResults, 0, sizeof(handle->IsochResults));
+    for (packetIndex = 0; packetIndex < transfer->num_iso_packets; packetIndex++) {
+        struct libusb_iso_packet_descriptor *packet = &transfer->iso_packet_desc[packetIndex];
+        unsigned int offset = packetIndex * transferParam->Ep.MaximumBytesPerInterval;
+        unsigned int length = packet->actual_length;
+        unsigned int status = UsbStatusToWinError(packet->status);
+
+        IsoTransferCb(packetIndex, &offset, &length, &status, handle);
+    }
+    *transferred = handle->IsochResults.Length;
+
+    return TRUE;
+}
+
+BOOL UsbCancelTransfer(PUVPERF_TRANSFER_HANDLE handle) {
+    if (!handle->UsbTransfer)
+        return FALSE;
+
+    return libusb_cancel_transfer(handle->UsbTransfer) == LIBUSB_SUCCESS;
+}
+
+void UsbFreeTransfer(PUVPERF_TRANSFER_HANDLE handle) {
+    if (handle->UsbTransfer) {
+        libusb_free_transfer(handle->UsbTransfer);
+        handle->UsbTransfer = NULL;
+    }
+}
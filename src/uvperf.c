@@ -9,21 +9,42 @@
  *
  *   Usage:
  *   uvperf -V VERBOSE-v VID -p PID -i INTERFACE -a AltInterface -e ENDPOINT -m TRANSFERMODE
- * -t TIMEOUT -b BUFFERCOUNT -l READLENGTH -w WRITELENGTH -r REPEAT -S
+ * -A -T TIMER -t TIMEOUT -b BUFFERCOUNT -l READLENGTH -w WRITELENGTH -r REPEAT -S -u -E -H
+ * -I RECORDS -o PERCENT -s SPEC -x FILE -P COUNT -B MBPS -G PROFILE -C CPUS -Y SCHED -M CPU
+ * -J EVERY -F FRAME -K -O SPEC
  *
  *   -VVERBOSE       Enable verbose output
  *   -vVID           USB Vendor ID
  *   -pPID           USB Product ID
  *   -iINTERFACE     USB Interface
  *   -aAltInterface  USB Alternate Interface
- *   -eENDPOINT      USB Endpoint
- *   -mTRANSFERMODE  0 = isochronous, 1 = bulk
+ *   -eENDPOINT      USB Endpoint, repeat to run several endpoints at once
+ *   -A              Run every bulk/iso endpoint of the device's interfaces at once
+ *   -mTRANSFERMODE  0 = sync, 1 = async (-b > 1, -E and isochronous pipes force async)
+ *   -TTIMER         Timer in seconds, seconds per point with -o and -s
  *   -tTIMEOUT       USB Transfer Timeout
- *   -bBUFFERCOUNT   Number of buffers to use
+ *   -bBUFFERCOUNT   Number of outstanding transfers (queue depth)
  *   -lREADLENGTH    Length of read transfers
  *   -wWRITELENGTH   Length of write transfers
  *   -rREPEAT        Number of transfers to perform
  *   -S              1 = Show transfer data, defulat = 0\n
+ *   -u              Run pipe I/O through libusb-1.0 (Windows, device still opened with libusbK)
+ *   -E              Service all endpoints from one event loop thread
+ *   -H              Back the transfer buffer pool with large pages
+ *   -IRECORDS       Record the last RECORDS iso packets to ../log/uvperf_iso_*.bin
+ *   -oPERCENT       Tune -b/-l/-w, report the smallest setting within PERCENT of peak
+ *   -sSPEC          Sweep alt setting/mode/-b/-l, e.g. a=0-2,m=0/1,b=1-32,l=4096-65536
+ *   -xFILE          Sweep results file, .json for JSON, CSV otherwise
+ *   -PCOUNT         Measure COUNT OUT -> IN echo round trips, reports latency percentiles
+ *   -BMBPS          Pace every endpoint's submissions to MBPS with a token bucket
+ *   -GPROFILE       Bursty workload, e.g. onoff,n=32,off=50 or poisson,r=200,z=512/4096,seed=7
+ *   -CCPUS          Pin transfer thread i to the i-th CPU of CPUS, e.g. 2,3 or 4-7
+ *   -YSCHED         normal, high or rt (realtime priority class, needs administrator)
+ *   -MCPU           Pin the display/main thread to CPU
+ *   -JEVERY         Halt the endpoint after every EVERY-th transfer to test the recovery
+ *   -FFRAME         Move FRAME sized frames split into -l/-w segments, e.g. 16M or 1M,zlp=always
+ *   -K              Measure interrupt IN polling (inter-arrival, jitter, missed bIntervals)
+ *   -OSPEC          EP0 vendor request benchmark, e.g. in,r=0x0F,n=1 or out,r=0x20,n=4,q=8
  *
  *   Example:
  *   uvperf -v0x1004 -p0xa000 -i0 -a0 -e0x81 -m1 -t1000 -l1024 -r1000
@@ -67,6 +88,15 @@
 //included libusb headerfile
 #include "libusb.h"
 #include "usb_descriptor.h"
+#include "usb_transfer.h"
+#include "engine.h"
+#include "tuner.h"
+#include "sweep.h"
+#include "latency.h"
+#include "workload.h"
+#include "frame.h"
+#include "control.h"
+#include "timestamp.h"
 
 BOOL verbose = FALSE;
 
@@ -74,7 +104,6 @@ const char *TestDisplayString[] = {"None", "Read", "Write", "Loop", NULL};
 const char *EndpointTypeDisplayString[] = {"Control", "Isochronous", "Bulk", "Interrupt", NULL};
 
 KUSB_DRIVER_API K;
-CRITICAL_SECTION DisplayCriticalSection;
 
 
 #include <pshpack1.h>
@@ -87,15 +116,49 @@ typedef struct _KBENCH_CONTEXT_LSTK {
 
 int ParseArgs(PUVPERF_PARAM TestParams, int argc, char **argv);
 
+// -C 2,3,4-7: transfer thread i runs on the i-th CPU of the list, wrapping around.
+static int ParseCpuList(PUVPERF_PARAM TestParams, char *list) {
+    char *next = list;
+    char *token;
+    long first, last;
+    BOOL empty;
+
+    TestParams->cpuCount = 0;
+    do {
+        // strtol parses an empty token, e.g. "" or the end of "2,", as CPU 0.
+        token = next;
+        first = last = strtol(token, &next, 0);
+        empty = next == token;
+        if (!empty && *next == '-') {
+            token = next + 1;
+            last = strtol(token, &next, 0);
+            empty = next == token;
+        }
+
+        if (empty || first < 0 || last < first || last >= MAX_CPUS ||
+            (*next && *next != ',')) {
+            LOG_ERROR("Invalid CPU list %s, CPUs must be between 0 and %d\n", list,
+                      MAX_CPUS - 1);
+            return -1;
+        }
+        while (first <= last && TestParams->cpuCount < MAX_TRANSFER_PARAMS)
+            TestParams->cpus[TestParams->cpuCount++] = first++;
+    } while (*next++ == ',');
+
+    return 0;
+}
+
 int ParseArgs(PUVPERF_PARAM TestParams, int argc, char **argv) {
     int i;
     int arg;
     char *temp;
     int value;
     int status = 0;
+    BOOL syncRequested = FALSE;
 
     int c;
-    while ((c = getopt(argc, argv, "Vv:p:i:a:e:m:t:fb:l:w:r:SRWL")) != -1) {
+    while ((c = getopt(argc, argv,
+                       "Vv:p:i:a:e:Am:T:t:fb:l:w:r:SRWLuEHI:o:s:x:P:B:G:C:Y:M:J:F:KO:")) != -1) {
         switch (c) {
         case 'V':
             verbose = TRUE;
@@ -114,10 +177,20 @@ int ParseArgs(PUVPERF_PARAM TestParams, int argc, char **argv) {
             break;
         case 'e':
             TestParams->endpoint = strtol(optarg, NULL, 0);
+            if (TestParams->endpointCount == MAX_TRANSFER_PARAMS) {
+                LOG_ERROR("At most %d endpoints can be given with -e\n", MAX_TRANSFER_PARAMS);
+                status = -1;
+                break;
+            }
+            TestParams->endpoints[TestParams->endpointCount++] = TestParams->endpoint;
+            break;
+        case 'A':
+            TestParams->allEndpoints = TRUE;
             break;
         case 'm':
             TestParams->TransferMode =
                 (strtol(optarg, NULL, 0) ? TRANSFER_MODE_ASYNC : TRANSFER_MODE_SYNC);
+            syncRequested = TestParams->TransferMode == TRANSFER_MODE_SYNC;
             break;
         case 'T':
             TestParams->Timer = strtol(optarg, NULL, 0);
@@ -130,7 +203,10 @@ int ParseArgs(PUVPERF_PARAM TestParams, int argc, char **argv) {
             break;
         case 'b':
             TestParams->bufferCount = strtol(optarg, NULL, 0);
-            if (TestParams->bufferCount > 1) {
+            if (TestParams->bufferCount < 1) {
+                LOGERR0("Buffer count must be at least 1\n");
+                status = -1;
+            } else if (TestParams->bufferCount > 1) {
                 TestParams->TransferMode = TRANSFER_MODE_ASYNC;
             }
             break;
@@ -155,6 +231,100 @@ int ParseArgs(PUVPERF_PARAM TestParams, int argc, char **argv) {
         case 'L':
             TestParams->TestType = TestTypeLoop;
             break;
+        case 'u':
+            TestParams->Backend = BACKEND_LIBUSB;
+            break;
+        case 'E':
+            // The event loop only multiplexes asynchronous transfers.
+            TestParams->useEventLoop = TRUE;
+            TestParams->TransferMode = TRANSFER_MODE_ASYNC;
+            break;
+        case 'H':
+            TestParams->useLargePages = TRUE;
+            break;
+        case 'I':
+            TestParams->isoTimelineSize = strtol(optarg, NULL, 0);
+            break;
+        case 'o':
+            TestParams->tunePercent = strtol(optarg, NULL, 0);
+            if (TestParams->tunePercent < 1 || TestParams->tunePercent > 99) {
+                LOGERR0("Tuning percent must be between 1 and 99\n");
+                status = -1;
+            }
+            break;
+        case 's':
+            TestParams->sweepSpec = optarg;
+            break;
+        case 'x':
+            strncpy(TestParams->sweepFileName, optarg, MAX_PATH - 1);
+            break;
+        case 'B':
+            TestParams->targetMbps = strtod(optarg, NULL);
+            if (TestParams->targetMbps <= 0) {
+                LOGERR0("Target rate must be greater than 0 Mbps\n");
+                status = -1;
+            }
+            break;
+        case 'G':
+            // Bursts are driven through the async ring.
+            TestParams->workloadSpec = optarg;
+            TestParams->TransferMode = TRANSFER_MODE_ASYNC;
+            if (ParseWorkloadProfile(TestParams, optarg) < 0)
+                status = -1;
+            break;
+        case 'P':
+            TestParams->pingPongCount = strtol(optarg, NULL, 0);
+            if (TestParams->pingPongCount < 1) {
+                LOGERR0("Round trip count must be at least 1\n");
+                status = -1;
+            }
+            break;
+        case 'C':
+            if (ParseCpuList(TestParams, optarg) < 0)
+                status = -1;
+            break;
+        case 'Y':
+            if (!_stricmp(optarg, "normal")) {
+                TestParams->scheduling = SchedulingNormal;
+            } else if (!_stricmp(optarg, "high")) {
+                TestParams->scheduling = SchedulingHigh;
+            } else if (!_stricmp(optarg, "rt")) {
+                TestParams->scheduling = SchedulingRealtime;
+            } else {
+                LOGERR0("Scheduling must be normal, high or rt\n");
+                status = -1;
+            }
+            break;
+        case 'M':
+            TestParams->displayCpu = strtol(optarg, NULL, 0);
+            if (TestParams->displayCpu < 0 || TestParams->displayCpu >= MAX_CPUS) {
+                LOG_ERROR("Display CPU must be between 0 and %d\n", MAX_CPUS - 1);
+                status = -1;
+            }
+            break;
+        case 'J':
+            TestParams->injectStallEvery = strtol(optarg, NULL, 0);
+            if (TestParams->injectStallEvery < 1) {
+                LOGERR0("Stall interval must be at least 1 transfer\n");
+                status = -1;
+            }
+            break;
+        case 'O':
+            TestParams->controlSpec = optarg;
+            if (ParseControlSpec(TestParams, optarg) < 0)
+                status = -1;
+            break;
+        case 'K':
+            // Every service interval needs a transfer already queued.
+            TestParams->measurePolling = TRUE;
+            TestParams->TransferMode = TRANSFER_MODE_ASYNC;
+            break;
+        case 'F':
+            // Segments of a frame are kept in flight through the async ring.
+            TestParams->TransferMode = TRANSFER_MODE_ASYNC;
+            if (ParseFrameSpec(TestParams, optarg) < 0)
+                status = -1;
+            break;
         default:
             LOGERR0("Invalid argument\n");
             status = -1;
@@ -162,6 +332,37 @@ int ParseArgs(PUVPERF_PARAM TestParams, int argc, char **argv) {
         }
     }
 
+    // Also when -m 0 came after -E.
+    if (TestParams->useEventLoop)
+        TestParams->TransferMode = TRANSFER_MODE_ASYNC;
+
+    // The pacer runs in TransferThread, the event loop has no per-endpoint thread to pace.
+    if (TestParams->targetMbps > 0 && TestParams->useEventLoop) {
+        LOG_WARNING("-B is not supported with -E, running unpaced\n");
+        TestParams->targetMbps = 0;
+    }
+
+    // Workloads run the async ring in their own per-endpoint thread, which sets its own pace and
+    // picks the length of every submission.
+    if (TestParams->workloadSpec) {
+        if (TestParams->useEventLoop) {
+            LOGERR0("-G cannot be combined with -E\n");
+            status = -1;
+        }
+        if (TestParams->targetMbps > 0) {
+            LOGERR0("-G cannot be combined with -B\n");
+            status = -1;
+        }
+        if (TestParams->frameSize) {
+            LOGERR0("-G cannot be combined with -F\n");
+            status = -1;
+        }
+        if (syncRequested) {
+            LOGERR0("-G cannot be combined with -m 0\n");
+            status = -1;
+        }
+    }
+
     if (optind < argc) {
         printf("Non-option arguments: ");
         while (optind < argc)
@@ -176,10 +377,15 @@ int main(int argc, char **argv) {
     UVPERF_PARAM TestParams;
     PUVPERF_TRANSFER_PARAM InTest = NULL;
     PUVPERF_TRANSFER_PARAM OutTest = NULL;
+    PUVPERF_TRANSFER_PARAM TransferParams[MAX_TRANSFER_PARAMS];
+    PUVPERF_TRANSFER_STATS stats;
+    LONGLONG remaining;
+    DWORD msToWait;
+    int transferParamCount = 0;
+    int i;
     int key;
     long ec;
     unsigned int count;
-    UCHAR bIsoAsap;
 
 //showing descriptors
     libusb_device **devs;
@@ -216,11 +422,15 @@ int main(int argc, char **argv) {
     if (ParseArgs(&TestParams, argc, argv) < 0)
         return -1;
 
-    FileIOOpen(&TestParams);
+    LOG_VERBOSE("SetProcessPlacement\n");
+    if (SetProcessPlacement(&TestParams) < 0)
+        return -1;
+
+    LOG_VERBOSE("InitTimestampClock\n");
+    InitTimestampClock();
 
+    FileIOOpen(&TestParams);
 
-    LOG_VERBOSE("InitializeCriticalSection\n");
-    InitializeCriticalSection(&DisplayCriticalSection);
 
     LOG_VERBOSE("LibusbK device List Initialize\n");
     if (!LstK_Init(&TestParams.DeviceList, 0)) {
@@ -297,7 +507,8 @@ int main(int argc, char **argv) {
     ShowDeviceInterfaces(libusb_get_device(handle));
 
     LOG_VERBOSE("GetDeviceInfoFromList\n");
-    if (TestParams.intf == -1 || TestParams.altf == -1 || TestParams.endpoint == 0x00) {
+    if (TestParams.intf == -1 || TestParams.altf == -1 ||
+        (TestParams.endpoint == 0x00 && !TestParams.allEndpoints)) {
         if (GetDeviceInfoFromList(&TestParams) < 0) {
             goto Final;
         }
@@ -416,50 +627,57 @@ int main(int argc, char **argv) {
         goto Final;
     }
 
-    if (TestParams.TestType & TestTypeIn) {
-        LOG_VERBOSE("CreateTransferParam for InTest\n");
-        InTest = CreateTransferParam(&TestParams, TestParams.endpoint | USB_ENDPOINT_DIRECTION_MASK);
-        if (!InTest){
-            LOGERR0("Failed to create transfer param for InTest\n");
-            goto Final;
-        }
-        if (TestParams.UseRawIO != 0xFF) {
-            if (!K.SetPipePolicy(TestParams.InterfaceHandle, InTest->Ep.PipeId, RAW_IO, 1,
-                                 &TestParams.UseRawIO)) {
-                ec = GetLastError();
-                LOG_ERROR("SetPipePolicy:RAW_IO failed. ErrorCode=%08Xh message : %s\n", ec,
-                          strerror(ec));
-                goto Final;
-            }
-        }
+    // Pipes of a composite device may be spread over several interfaces.
+    if ((TestParams.allEndpoints || TestParams.endpointCount > 1) &&
+        !Bench_OpenAssociatedInterfaces(&TestParams)) {
+        goto Final;
     }
 
-    if (TestParams.TestType & TestTypeOut) {
-        LOG_VERBOSE("CreateTransferParam for OutTest\n");
-        OutTest = CreateTransferParam(&TestParams, TestParams.endpoint & 0x0F);
-        if (!OutTest)
+    if (TestParams.Backend == BACKEND_LIBUSB) {
+        LOG_VERBOSE("Open libusb backend\n");
+        if (UsbBackendOpen(&TestParams) < 0) {
             goto Final;
-        if (TestParams.fixedIsoPackets) {
-            if (!K.SetPipePolicy(TestParams.InterfaceHandle, OutTest->Ep.PipeId,
-                                 ISO_NUM_FIXED_PACKETS, 2, &TestParams.fixedIsoPackets)) {
-                ec = GetLastError();
-                LOG_ERROR("SetPipePolicy:ISO_NUM_FIXED_PACKETS failed. ErrorCode=0x%08X, "
-                          "message : %s\n",
-                          ec, strerror(ec));
-                goto Final;
-            }
-        }
-        if (TestParams.UseRawIO != 0xFF) {
-            if (!K.SetPipePolicy(TestParams.InterfaceHandle, OutTest->Ep.PipeId, RAW_IO, 1,
-                                 &TestParams.UseRawIO)) {
-                ec = GetLastError();
-                LOG_ERROR("SetPipePolicy:RAW_IO failed. ErrorCode=0x%08X\n, message : %s", ec,
-                          strerror(ec));
-                goto Final;
-            }
         }
     }
 
+    if (TestParams.allEndpoints && !Bench_SelectAllPipes(&TestParams)) {
+        LOG_ERROR("no bulk or isochronous pipes found\n");
+        goto Final;
+    }
+
+    if (TestParams.tunePercent) {
+        RunTuner(&TestParams);
+        goto Final;
+    }
+
+    if (TestParams.sweepSpec) {
+        RunSweep(&TestParams);
+        goto Final;
+    }
+
+    if (TestParams.controlSpec) {
+        RunControlBench(&TestParams);
+        goto Final;
+    }
+
+    if (TestParams.pingPongCount) {
+        RunPingPong(&TestParams);
+        goto Final;
+    }
+
+    transferParamCount = CreateTransferParams(&TestParams, TransferParams);
+    if (transferParamCount < 0) {
+        transferParamCount = 0;
+        goto Final;
+    }
+
+    for (i = 0; i < transferParamCount; i++) {
+        if (!InTest && USB_ENDPOINT_DIRECTION_IN(TransferParams[i]->Ep.PipeId))
+            InTest = TransferParams[i];
+        if (!OutTest && USB_ENDPOINT_DIRECTION_OUT(TransferParams[i]->Ep.PipeId))
+            OutTest = TransferParams[i];
+    }
+
     if (TestParams.verify) {
         if (InTest && OutTest) {
             LOG_VERBOSE("CreateVerifyBuffer for OutTest\n");
@@ -472,52 +690,13 @@ int main(int argc, char **argv) {
         }
     }
 
-    if ((OutTest && OutTest->Ep.PipeType == UsbdPipeTypeIsochronous) ||
-        (InTest && InTest->Ep.PipeType == UsbdPipeTypeIsochronous)) {
-        UINT frameNumber;
-        LOG_VERBOSE("GetCurrentFrameNumber\n");
-        if (!K.GetCurrentFrameNumber(TestParams.InterfaceHandle, &frameNumber)) {
-            ec = GetLastError();
-            LOG_ERROR("GetCurrentFrameNumber Failed. ErrorCode=%u, message : %s", ec, strerror(ec));
-            goto Final;
-        }
-        frameNumber += TestParams.bufferCount * 2;
-        if (OutTest) {
-            OutTest->frameNumber = frameNumber;
-            frameNumber++;
-        }
-        if (InTest) {
-            InTest->frameNumber = frameNumber;
-            frameNumber++;
-        }
-    }
-
     LOG_VERBOSE("ShowParams\n");
     ShowParams(&TestParams);
-    if (InTest)
-        ShowTransfer(InTest);
-    if (OutTest)
-        ShowTransfer(OutTest);
-
-    bIsoAsap = (UCHAR)TestParams.UseIsoAsap;
-    if (InTest)
-        K.SetPipePolicy(TestParams.InterfaceHandle, InTest->Ep.PipeId, ISO_ALWAYS_START_ASAP, 1,
-                        &bIsoAsap);
-    if (OutTest)
-        K.SetPipePolicy(TestParams.InterfaceHandle, OutTest->Ep.PipeId, ISO_ALWAYS_START_ASAP, 1,
-                        &bIsoAsap);
-
-    if (InTest) {
-        LOG_VERBOSE("ResumeThread for InTest\n");
-        SetThreadPriority(InTest->ThreadHandle, TestParams.priority);
-        ResumeThread(InTest->ThreadHandle);
-    }
+    for (i = 0; i < transferParamCount; i++)
+        ShowTransfer(TransferParams[i]);
 
-    if (OutTest) {
-        LOG_VERBOSE("ResumeThread for OutTest\n");
-        SetThreadPriority(OutTest->ThreadHandle, TestParams.priority);
-        ResumeThread(OutTest->ThreadHandle);
-    }
+    if (StartTransferParams(&TestParams, TransferParams, transferParamCount) < 0)
+        goto Final;
 
     LOGMSG0("Press 'Q' to abort\n");
 
@@ -525,7 +704,17 @@ int main(int argc, char **argv) {
 
     while (!TestParams.isCancelled) {
 
-        Sleep(TestParams.refresh);
+        // Wake up at the -T deadline rather than at the next refresh.
+        msToWait = TestParams.refresh;
+        for (i = 0; i < transferParamCount && TestParams.Timer; i++) {
+            stats = &TransferParams[i]->Stats;
+            if (stats->StartTick) {
+                remaining = (stats->StartTick + TestParams.Timer * 1000000000LL -
+                             GetTimestampNs()) / 1000000;
+                msToWait = (DWORD)max(0, min((LONGLONG)msToWait, remaining));
+            }
+        }
+        Sleep(msToWait);
         if (_kbhit()) {
             key = _getch();
             switch (key) {
@@ -535,42 +724,27 @@ int main(int argc, char **argv) {
                 TestParams.isUserAborted = TRUE;
                 TestParams.isCancelled = TRUE;
             }
+        }
 
-            if ((InTest) && !InTest->isRunning) {
-                LOG_VERBOSE("InTest is not running\n");
+        for (i = 0; i < transferParamCount; i++) {
+            if (!TransferParams[i]->isRunning) {
+                LOG_VERBOSE("Ep0x%02X is not running\n", TransferParams[i]->Ep.PipeId);
                 TestParams.isCancelled = TRUE;
                 break;
             }
 
-            if ((OutTest) && !OutTest->isRunning) {
-                LOG_VERBOSE("OutTest is not running\n");
+            stats = &TransferParams[i]->Stats;
+            if (TestParams.Timer && stats->StartTick &&
+                GetTimestampNs() - stats->StartTick >= TestParams.Timer * 1000000000LL) {
+                DOUBLE elapsedSeconds = (GetTimestampNs() - stats->StartTick) / 1000000000.0;
+                LOG_VERBOSE("Over %d seconds\n", TestParams.Timer);
+                LOG_MSG("Elapsed Time %.2f  seconds\n", elapsedSeconds);
+                TestParams.isUserAborted = TRUE;
                 TestParams.isCancelled = TRUE;
                 break;
             }
         }
 
-        if (TestParams.Timer && InTest &&
-            InTest->LastTick.tv_sec - InTest->StartTick.tv_sec >= TestParams.Timer) {
-            LOG_VERBOSE("Over 60 seconds\n");
-            DWORD elapsedSeconds =
-                ((InTest->LastTick.tv_sec - InTest->StartTick.tv_sec) +
-                 (InTest->LastTick.tv_nsec - InTest->StartTick.tv_nsec) / 100000000.0);
-            LOG_MSG("Elapsed Time %.2f  seconds\n", elapsedSeconds);
-            TestParams.isUserAborted = TRUE;
-            TestParams.isCancelled = TRUE;
-        }
-
-        if (TestParams.Timer && OutTest &&
-            OutTest->LastTick.tv_sec - OutTest->StartTick.tv_sec >= TestParams.Timer) {
-            LOG_VERBOSE("Over 60 seconds\n");
-            DWORD elapsedSeconds =
-                ((InTest->LastTick.tv_sec - InTest->StartTick.tv_sec) +
-                 (InTest->LastTick.tv_nsec - InTest->StartTick.tv_nsec) / 100000000.0);
-            LOG_MSG("Elapsed Time %.2f  seconds\n", elapsedSeconds);
-            TestParams.isUserAborted = TRUE;
-            TestParams.isCancelled = TRUE;
-        }
-
         // if (TestParams.fileIO) {
         //     if (InTest) {
         //         FileIOBuffer(&TestParams, InTest);
@@ -581,40 +755,37 @@ int main(int argc, char **argv) {
         // }
 
         LOG_VERBOSE("ShowRunningStatus\n");
-        ShowRunningStatus(InTest, OutTest);
+        ShowRunningStatus(TransferParams, transferParamCount);
         while (_kbhit())
             _getch();
     }
 
-    LOG_VERBOSE("WaitForTestTransfer\n");
-    WaitForTestTransfer(InTest, 1000);
-    if ((InTest) && InTest->isRunning) {
-        LOG_WARNING("Aborting Read Pipe 0x%02X..\n", InTest->Ep.PipeId);
-        K.AbortPipe(TestParams.InterfaceHandle, InTest->Ep.PipeId);
-    }
-
-    WaitForTestTransfer(OutTest, 1000);
-    if ((OutTest) && OutTest->isRunning) {
-        LOG_WARNING("Aborting Write Pipe 0x%02X..\n", OutTest->Ep.PipeId);
-        K.AbortPipe(TestParams.InterfaceHandle, OutTest->Ep.PipeId);
-    }
-
-    if ((InTest) && InTest->isRunning)
-        WaitForTestTransfer(InTest, INFINITE);
-    if ((OutTest) && OutTest->isRunning)
-        WaitForTestTransfer(OutTest, INFINITE);
+    StopTransferParams(&TestParams, TransferParams, transferParamCount);
 
     LOG_VERBOSE("Show Transfer\n");
-    if (InTest)
-        ShowTransfer(InTest);
-    if (OutTest)
-        ShowTransfer(OutTest);
+    ShowTransferSummary(TransferParams, transferParamCount);
+    ShowCpuUsage(&TestParams);
+
+    for (i = 0; i < transferParamCount; i++) {
+        FileIOIsoTimeline(&TestParams, TransferParams[i]);
+        FileIOLatency(&TestParams, TransferParams[i]);
+    }
 
     freopen("CON", "w", stdout);
     freopen("CON", "w", stderr);
 
 Final:
     LOG_VERBOSE("Free TransferParam\n");
+    for (i = 0; i < transferParamCount; i++)
+        FreeTransferParam(&TransferParams[i]);
+    InTest = NULL;
+    OutTest = NULL;
+
+    // libusb gives the interface back before libusbK restores the default alt setting.
+    UsbBackendClose(&TestParams);
+
+    Bench_CloseAssociatedInterfaces(&TestParams);
+
     if (TestParams.InterfaceHandle) {
         LOG_VERBOSE("ResetPipe\n");
         K.SetAltInterface(TestParams.InterfaceHandle, TestParams.InterfaceDescriptor.bInterfaceNumber,
@@ -642,10 +813,6 @@ Final:
 
     LOG_VERBOSE("Free TransferParam\n");
     LstK_Free(TestParams.DeviceList);
-    FreeTransferParam(&InTest);
-    FreeTransferParam(&OutTest);
-
-    DeleteCriticalSection(&DisplayCriticalSection);
 
     if (!TestParams.listDevicesOnly) {
         LOGMSG0("Press any key to exit\n");
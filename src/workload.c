@@ -0,0 +1,297 @@
+#include <windows.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "k.h"
+#include "workload.h"
+#include "latency.h"
+#include "pacer.h"
+#include "transfer_p.h"
+#include "timestamp.h"
+#include "fileio.h"
+#include "param.h"
+
+// Traffic shape profiles (-G PROFILE). Instead of streaming flat out, WorkloadThread drives the
+// async ring in bursts separated by idle time, draining the ring after every burst so the device
+// really sees the bus go quiet. Every burst records its throughput and the time from its start
+// to the first completed transfer (time to first byte after idle).
+//
+// PROFILE is a comma separated list, the shape first:
+//   onoff             bursts separated by off ms of idle time (default)
+//   poisson           bursts start at exponentially distributed intervals, r per second
+//   n=COUNT           transfers per burst (default 16)
+//   on=MS             burst length in ms instead of a transfer count
+//   off=MS            idle time of onoff (default 100)
+//   r=RATE            mean bursts per second of poisson (default 10)
+//   z=SIZE/SIZE/..    transfer sizes, each transfer picks one at random (default -l/-w)
+//   seed=SEED         random seed, the same seed gives the same sequence of gaps and sizes
+// e.g. -G onoff,n=32,off=50,z=512/4096/65536,seed=7 or -G poisson,r=200,n=1
+
+static int ParseWorkloadSizes(const char *values, PUVPERF_WORKLOAD_PROFILE profile) {
+    char *end;
+
+    profile->sizeCount = 0;
+    do {
+        if (profile->sizeCount == WORKLOAD_MAX_SIZES)
+            return -1;
+        profile->sizes[profile->sizeCount] = strtol(values, &end, 0);
+        if (end == values || profile->sizes[profile->sizeCount] < 1)
+            return -1;
+        profile->maxSize = max(profile->maxSize, profile->sizes[profile->sizeCount]);
+        profile->sizeCount++;
+        values = end + 1;
+    } while (*end == '/');
+
+    return (*end == '\0' || *end == ',') ? 0 : -1;
+}
+
+int ParseWorkloadProfile(PUVPERF_PARAM TestParams, const char *spec) {
+    PUVPERF_WORKLOAD_PROFILE profile = &TestParams->WorkloadProfile;
+    const char *value;
+    char *end;
+    BOOL valid;
+
+    memset(profile, 0, sizeof(*profile));
+    profile->shape = WORKLOAD_ON_OFF;
+    profile->burstCount = WORKLOAD_DEFAULT_BURST_COUNT;
+    profile->offMs = WORKLOAD_DEFAULT_OFF_MS;
+    profile->rate = WORKLOAD_DEFAULT_RATE;
+    profile->seed = WORKLOAD_DEFAULT_SEED;
+
+    while (*spec) {
+        valid = TRUE;
+        end = NULL;
+
+        if (!strncmp(spec, "onoff", 5) && (spec[5] == ',' || !spec[5])) {
+            profile->shape = WORKLOAD_ON_OFF;
+        } else if (!strncmp(spec, "poisson", 7) && (spec[7] == ',' || !spec[7])) {
+            profile->shape = WORKLOAD_POISSON;
+        } else if ((value = MatchSpecKey(spec, "n"))) {
+            profile->burstCount = strtol(value, &end, 0);
+            valid = profile->burstCount > 0;
+        } else if ((value = MatchSpecKey(spec, "on"))) {
+            profile->onMs = strtol(value, &end, 0);
+            profile->burstCount = 0;
+            valid = profile->onMs > 0;
+        } else if ((value = MatchSpecKey(spec, "off"))) {
+            profile->offMs = strtol(value, &end, 0);
+            valid = profile->offMs >= 0;
+        } else if ((value = MatchSpecKey(spec, "r"))) {
+            profile->rate = strtod(value, &end);
+            valid = profile->rate > 0;
+        } else if ((value = MatchSpecKey(spec, "z"))) {
+            valid = ParseWorkloadSizes(value, profile) == 0;
+        } else if ((value = MatchSpecKey(spec, "seed"))) {
+            profile->seed = strtoull(value, &end, 0);
+        } else {
+            valid = FALSE;
+        }
+
+        if (end && (end == value || (*end != ',' && *end != '\0')))
+            valid = FALSE;
+
+        if (!valid) {
+            LOG_ERROR("invalid workload entry '%s'\n", spec);
+            return -1;
+        }
+
+        spec = strchr(spec, ',');
+        if (!spec)
+            break;
+        spec++;
+    }
+
+    return 0;
+}
+
+static ULONGLONG NextWorkloadRandom(PUVPERF_WORKLOAD workload) {
+    ULONGLONG x = workload->Random;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    workload->Random = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Exponentially distributed gap between Poisson bursts, in ns.
+static LONGLONG NextWorkloadGap(PUVPERF_WORKLOAD workload) {
+    DOUBLE uniform = ((NextWorkloadRandom(workload) >> 11) + 1) / 9007199254740992.0;
+
+    return (LONGLONG)(-log(uniform) / workload->Profile->rate * 1000000000.0);
+}
+
+int NextWorkloadLength(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_WORKLOAD_PROFILE profile = transferParam->Workload->Profile;
+
+    if (!profile->sizeCount || !HasVariableTransferLength(transferParam))
+        return GetTransferLength(transferParam);
+
+    return profile->sizes[NextWorkloadRandom(transferParam->Workload) % profile->sizeCount];
+}
+
+int CreateWorkload(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_PARAM TestParams = transferParam->TestParams;
+    PUVPERF_WORKLOAD workload;
+    char fileName[MAX_PATH];
+
+    workload = calloc(1, sizeof(UVPERF_WORKLOAD));
+    if (!workload) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+    transferParam->Workload = workload;
+
+    workload->Profile = &TestParams->WorkloadProfile;
+    workload->Random =
+        (workload->Profile->seed ^ (transferParam->Ep.PipeId * 0x9E3779B97F4A7C15ULL)) | 1;
+    workload->MinBurstBps = -1;
+
+    workload->FirstByte = calloc(1, sizeof(UVPERF_LATENCY_HISTOGRAM));
+    if (!workload->FirstByte) {
+        LOG_ERROR("memory allocation failure at line %d!\n", __LINE__);
+        return -1;
+    }
+
+    if (InitPacer(&workload->Idle, 0, 0) < 0)
+        return -1;
+
+    if (workload->Profile->sizeCount && !HasVariableTransferLength(transferParam)) {
+        LOG_WARNING("Ep0x%02X is isochronous, ignoring the workload sizes\n",
+                    transferParam->Ep.PipeId);
+    }
+
+    if (TestParams->fileIO) {
+        workload->BurstFile = FileIOOpenEndpointFile(transferParam, "bursts.csv", "w", fileName);
+        if (workload->BurstFile) {
+            fprintf(workload->BurstFile,
+                    "burst,start_ns,transfers,bytes,duration_us,mbps,first_byte_us\n");
+        }
+    }
+
+    return 0;
+}
+
+void FreeWorkload(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_WORKLOAD workload = transferParam->Workload;
+
+    if (!workload)
+        return;
+
+    if (workload->BurstFile)
+        fclose(workload->BurstFile);
+    FreePacer(&workload->Idle);
+    free(workload->FirstByte);
+    free(workload);
+    transferParam->Workload = NULL;
+}
+
+// Submits one burst through the async ring and waits until all of it has completed. Returns FALSE
+// once the endpoint should stop.
+static BOOL RunBurst(PUVPERF_TRANSFER_PARAM transferParam, LONGLONG burstStart) {
+    PUVPERF_WORKLOAD workload = transferParam->Workload;
+    PUVPERF_WORKLOAD_PROFILE profile = workload->Profile;
+    LONGLONG burstEnd = burstStart + profile->onMs * 1000000LL;
+    LONGLONG firstByte = 0, lastCompletion = 0, bytes = 0;
+    PUVPERF_TRANSFER_HANDLE handle;
+    DOUBLE bps;
+    int transfers = 0;
+    int ret;
+
+    workload->SubmitBudget = profile->burstCount ? profile->burstCount : INT_MAX;
+
+    do {
+        ret = TransferAsync(transferParam, &handle);
+        if (!handle)
+            break;
+
+        if (!profile->burstCount && GetTimestampNs() >= burstEnd)
+            workload->SubmitBudget = 0;
+
+        if (!TransferComplete(transferParam, ret >= 0 ? handle->Data : NULL, ret)) {
+            workload->SubmitBudget = 0;
+            return FALSE;
+        }
+
+        if (ret >= 0) {
+            // Reap order is not completion order once several transfers are in flight.
+            if (!firstByte || handle->CompletionTime < firstByte)
+                firstByte = handle->CompletionTime;
+            if (handle->CompletionTime > lastCompletion)
+                lastCompletion = handle->CompletionTime;
+            bytes += ret;
+            transfers++;
+        }
+    } while (transferParam->outstandingTransferCount || workload->SubmitBudget);
+
+    workload->SubmitBudget = 0;
+
+    if (!transfers || lastCompletion <= burstStart)
+        return TRUE;
+
+    bps = bytes / ((lastCompletion - burstStart) / 1000000000.0);
+    if (workload->MinBurstBps < 0 || bps < workload->MinBurstBps)
+        workload->MinBurstBps = bps;
+    if (bps > workload->MaxBurstBps)
+        workload->MaxBurstBps = bps;
+    workload->BurstBpsSum += bps;
+    RecordLatency(workload->FirstByte, firstByte - burstStart);
+
+    if (workload->BurstFile) {
+        fprintf(workload->BurstFile, "%I64d,%I64d,%d,%I64d,%.1f,%.3f,%.1f\n", workload->BurstCount,
+                burstStart, transfers, bytes, (lastCompletion - burstStart) / 1000.0,
+                bps * 8 / 1000 / 1000, (firstByte - burstStart) / 1000.0);
+    }
+    workload->BurstCount++;
+
+    return TRUE;
+}
+
+DWORD WorkloadThread(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_WORKLOAD workload = transferParam->Workload;
+    LONGLONG burstStart;
+    LONGLONG nextBurst = GetTimestampNs();
+
+    transferParam->isRunning = TRUE;
+
+    while (!transferParam->TestParams->isCancelled) {
+        burstStart = PacerSleepUntil(&workload->Idle, transferParam->TestParams, nextBurst);
+        if (!burstStart)
+            break;
+
+        if (!RunBurst(transferParam, burstStart))
+            break;
+
+        // Poisson arrivals keep their own schedule, a burst that is due already starts at once.
+        if (workload->Profile->shape == WORKLOAD_POISSON)
+            nextBurst += NextWorkloadGap(workload);
+        else
+            nextBurst = GetTimestampNs() + workload->Profile->offMs * 1000000LL;
+    }
+
+    CancelTransfers(transferParam);
+
+    transferParam->isRunning = FALSE;
+    return 0;
+}
+
+void ShowWorkload(PUVPERF_TRANSFER_PARAM transferParam) {
+    PUVPERF_WORKLOAD workload = transferParam->Workload;
+    PUVPERF_LATENCY_HISTOGRAM firstByte;
+
+    if (!workload || !workload->BurstCount)
+        return;
+
+    firstByte = workload->FirstByte;
+    LOG_MSG("\tBursts %I64d, Mbps/sec (min/avg/max) %.2f/%.2f/%.2f\n", workload->BurstCount,
+            workload->MinBurstBps * 8 / 1000 / 1000,
+            workload->BurstBpsSum / workload->BurstCount * 8 / 1000 / 1000,
+            workload->MaxBurstBps * 8 / 1000 / 1000);
+    LOG_MSG("\tFirst byte after idle us (min/p50/p99/max) %.1f/%.1f/%.1f/%.1f\n",
+            firstByte->Min / 1000.0, GetLatencyPercentile(firstByte, 50.0) / 1000.0,
+            GetLatencyPercentile(firstByte, 99.0) / 1000.0, firstByte->Max / 1000.0);
+}